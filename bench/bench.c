@@ -0,0 +1,545 @@
+/* Benchmark harness: the walker end to end, and its matching kernels
+ * in isolation. walk.c is compiled in so the kernels can be called
+ * directly; its main() is renamed out of the way. */
+#define _XOPEN_SOURCE 700
+#define main walk_main
+#include "../walk.c"
+#undef main
+#include <ftw.h>
+#include <sys/wait.h>
+
+#define MAX_RESULTS 64
+#define MAX_ARGS 32
+
+typedef struct {
+    char name[64];
+    double seconds;         /* best of all repetitions */
+    double mb_s;
+    double files_s;         /* end-to-end runs only */
+} BenchResult;
+
+typedef struct {
+    const char *walk;
+    const char *corpus;
+    const char *output;
+    const char *label;
+    const char *keyword;
+    int reps;
+    int jobs;
+    long kernel_mb;
+    int cold;
+    int warm;
+    int kernels;
+    BenchResult results[MAX_RESULTS];
+    int nresults;
+    const char *cold_method;
+} Bench;
+
+/* One kernel over a whole buffer; returns its hit count so the work
+ * cannot be optimized away */
+typedef long (*KernelFn)(const char *buf, size_t len, const void *ctx);
+
+typedef struct {
+    const char *needle;
+    size_t needle_len;
+    const char *(*find_case)(const char *, size_t, const char *, size_t);
+    const KeywordMatcher *matcher;
+    long (*count_newlines)(const char *, const char *);
+} KernelContext;
+
+static double seconds_since(int64_t started) {
+    return (double)(now_ns() - started) / 1e9;
+}
+
+static BenchResult *add_result(Bench *bench, const char *name) {
+    if (bench->nresults >= MAX_RESULTS) {
+        fprintf(stderr, "Error: Too many results\n");
+        exit(EXIT_FAILURE);
+    }
+    BenchResult *r = &bench->results[bench->nresults++];
+    memset(r, 0, sizeof(*r));
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    return r;
+}
+
+/* Kernels */
+
+static long run_find_bytes(const char *buf, size_t len, const void *arg) {
+    const KernelContext *ctx = arg;
+    const char *p = buf, *end = buf + len;
+    long hits = 0;
+    
+    while ((p = find_bytes(p, (size_t)(end - p), ctx->needle,
+                           ctx->needle_len)) != NULL) {
+        hits++;
+        p++;
+    }
+    return hits;
+}
+
+static long run_find_case(const char *buf, size_t len, const void *arg) {
+    const KernelContext *ctx = arg;
+    const char *p = buf, *end = buf + len;
+    long hits = 0;
+    
+    while ((p = ctx->find_case(p, (size_t)(end - p), ctx->needle,
+                               ctx->needle_len)) != NULL) {
+        hits++;
+        p++;
+    }
+    return hits;
+}
+
+/* The NUL-terminated search the original line loop used */
+static long run_strstr_case(const char *buf, size_t len, const void *arg) {
+    const KernelContext *ctx = arg;
+    const char *p = buf;
+    long hits = 0;
+    
+    (void)len;
+    while ((p = strstr_case(p, ctx->needle)) != NULL) {
+        hits++;
+        p++;
+    }
+    return hits;
+}
+
+static long run_matcher(const char *buf, size_t len, const void *arg) {
+    const KernelContext *ctx = arg;
+    size_t pos = 0;
+    int32_t state = 0;
+    long hits = 0;
+    
+    while (pos < len) {
+        uint32_t mask = 0;
+        pos = matcher_run(ctx->matcher, buf, pos, len, &state, &mask) + 1;
+        if (mask) hits++;
+    }
+    return hits;
+}
+
+static long run_newlines(const char *buf, size_t len, const void *arg) {
+    const KernelContext *ctx = arg;
+    return ctx->count_newlines(buf, buf + len);
+}
+
+static void time_kernel(Bench *bench, const char *name, KernelFn fn,
+                        const char *buf, size_t len, const void *ctx) {
+    BenchResult *r = add_result(bench, name);
+    long hits = 0;
+    
+    for (int rep = 0; rep < bench->reps; rep++) {
+        int64_t started = now_ns();
+        hits = fn(buf, len, ctx);
+        double t = seconds_since(started);
+        if (rep == 0 || t < r->seconds) r->seconds = t;
+    }
+    r->mb_s = r->seconds > 0 ? (double)len / r->seconds / (1024 * 1024) : 0;
+    printf("  %-28s %9.1f MB/s  (%ld hits)\n", name, r->mb_s, hits);
+}
+
+/* Text with the keyword (in mixed case) every ~50 KB and a newline
+ * every ~70 bytes, NUL-terminated for strstr_case() */
+static char *kernel_buffer(const Bench *bench, size_t len) {
+    static const char *filler[] = { "static", "buffer", "return", "value",
+        "the", "of", "directory", "worker", "struct", "offset", "x", "if" };
+    char *buf = malloc(len + 1);
+    size_t kw_len = strlen(bench->keyword);
+    size_t at = 0, line = 0;
+    uint32_t rng = 12345;
+    
+    if (!buf) return NULL;
+    while (at < len) {
+        rng = rng * 1103515245 + 12345;
+        const char *word = filler[(rng >> 16) % 12];
+        size_t word_len = strlen(word);
+        if ((rng >> 8) % 8192 == 0) {
+            word = bench->keyword;
+            word_len = kw_len;
+        }
+        if (at + word_len + 1 > len) break;
+        memcpy(buf + at, word, word_len);
+        if (word == bench->keyword && (rng & 1)) buf[at] = (char)toupper(buf[at]);
+        at += word_len;
+        line += word_len + 1;
+        buf[at++] = line > 70 ? '\n' : ' ';
+        if (line > 70) line = 0;
+    }
+    memset(buf + at, '\n', len - at);
+    buf[len] = '\0';
+    return buf;
+}
+
+static void bench_kernels(Bench *bench) {
+    size_t len = (size_t)bench->kernel_mb * 1024 * 1024;
+    char *buf = kernel_buffer(bench, len);
+    KernelContext ctx;
+    char folded[256];
+    
+    if (!buf) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    init_fold_table();
+    snprintf(folded, sizeof(folded), "%s", bench->keyword);
+    for (char *p = folded; *p; p++) *p = (char)fold_table[(unsigned char)*p];
+    ctx.needle = folded;
+    ctx.needle_len = strlen(folded);
+    
+    printf("Kernels (%ld MB buffer, best of %d):\n", bench->kernel_mb, bench->reps);
+    time_kernel(bench, "kernel/find_bytes", run_find_bytes, buf, len, &ctx);
+    time_kernel(bench, "kernel/strstr_case", run_strstr_case, buf, len, &ctx);
+    ctx.find_case = find_bytes_case;
+    time_kernel(bench, "kernel/find_case_scalar", run_find_case, buf, len, &ctx);
+#ifdef WALK_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        ctx.find_case = find_bytes_case_sse2;
+        time_kernel(bench, "kernel/find_case_sse2", run_find_case, buf, len, &ctx);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        ctx.find_case = find_bytes_case_avx2;
+        time_kernel(bench, "kernel/find_case_avx2", run_find_case, buf, len, &ctx);
+    }
+#endif
+#ifdef WALK_NEON_SIMD
+    ctx.find_case = find_bytes_case_neon;
+    time_kernel(bench, "kernel/find_case_neon", run_find_case, buf, len, &ctx);
+#endif
+    
+    /* The automaton as a multi-keyword search compiles it */
+    SearchOptions opts;
+    init_options(&opts);
+    opts.case_sensitive = 0;
+    add_keyword(&opts, bench->keyword, 0);
+    add_keyword(&opts, "timeout", 0);
+    add_keyword(&opts, "handler", 0);
+    add_keyword(&opts, "context", 0);
+    compile_keywords(&opts);
+    ctx.matcher = opts.matcher;
+    time_kernel(bench, "kernel/automaton_4", run_matcher, buf, len, &ctx);
+    free_keywords(&opts);
+    
+    ctx.count_newlines = count_newlines;
+    time_kernel(bench, "kernel/count_newlines", run_newlines, buf, len, &ctx);
+#ifdef WALK_X86_SIMD
+    ctx.count_newlines = count_newlines_sse2;
+    time_kernel(bench, "kernel/count_newlines_sse2", run_newlines, buf, len, &ctx);
+    if (__builtin_cpu_supports("avx2")) {
+        ctx.count_newlines = count_newlines_avx2;
+        time_kernel(bench, "kernel/count_newlines_avx2", run_newlines, buf, len, &ctx);
+    }
+#endif
+#ifdef WALK_NEON_SIMD
+    ctx.count_newlines = count_newlines_neon;
+    time_kernel(bench, "kernel/count_newlines_neon", run_newlines, buf, len, &ctx);
+#endif
+    free(buf);
+}
+
+/* End to end */
+
+static int evict_file(const char *path, const struct stat *st, int type,
+                      struct FTW *ftw) {
+    (void)st; (void)ftw;
+    if (type == FTW_F) {
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+/* Drop the page cache if we may, or else ask for the corpus's pages
+ * to be evicted; directory entries and inodes stay cached then */
+static void drop_caches(Bench *bench) {
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd >= 0 && write(fd, "3\n", 2) == 2) {
+        close(fd);
+        bench->cold_method = "drop_caches";
+        return;
+    }
+    if (fd >= 0) close(fd);
+    nftw(bench->corpus, evict_file, 64, FTW_PHYS);
+    bench->cold_method = "fadvise";
+}
+
+/* Run the walker with --json; fills files and bytes from its final
+ * stats record. Returns the wall time, or a negative value on failure. */
+static double run_walk(const Bench *bench, char *const extra[],
+                       long *files, long *bytes) {
+    char *argv[MAX_ARGS];
+    char jobs[16];
+    int argc = 0;
+    int pipefd[2];
+    
+    argv[argc++] = (char *)bench->walk;
+    argv[argc++] = "--json";
+    if (bench->jobs > 0) {
+        snprintf(jobs, sizeof(jobs), "%d", bench->jobs);
+        argv[argc++] = "-j";
+        argv[argc++] = jobs;
+    }
+    argv[argc++] = (char *)bench->corpus;
+    for (int k = 0; extra[k] && argc < MAX_ARGS - 1; k++) argv[argc++] = extra[k];
+    argv[argc] = NULL;
+    
+    if (pipe(pipefd) != 0) return -1;
+    int64_t started = now_ns();
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(pipefd[1]);
+    
+    /* Only the last record matters; keep the tail of the stream */
+    char tail[4096];
+    size_t have = 0;
+    ssize_t n;
+    while ((n = read(pipefd[0], tail + have, sizeof(tail) - 1 - have)) > 0) {
+        have += (size_t)n;
+        if (have == sizeof(tail) - 1) {
+            memmove(tail, tail + have / 2, have - have / 2);
+            have -= have / 2;
+        }
+    }
+    close(pipefd[0]);
+    
+    int status;
+    waitpid(pid, &status, 0);
+    double elapsed = seconds_since(started);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) > 1) return -1;
+    
+    tail[have] = '\0';
+    const char *record = strstr(tail, "{\"type\":\"stats\"");
+    const char *f = record ? strstr(record, "\"files_searched\":") : NULL;
+    const char *b = record ? strstr(record, "\"bytes\":") : NULL;
+    if (!f || !b) return -1;
+    *files = atol(f + 17);
+    *bytes = atol(b + 8);
+    return elapsed;
+}
+
+static void bench_walk(Bench *bench, const char *name, char *const extra[]) {
+    for (int cold = 1; cold >= 0; cold--) {
+        if (cold ? !bench->cold : !bench->warm) continue;
+        
+        char full[64];
+        long files = 0, bytes = 0;
+        snprintf(full, sizeof(full), "walk/%s/%s", name, cold ? "cold" : "warm");
+        BenchResult *r = add_result(bench, full);
+        
+        /* A warm run starts after one untimed pass has filled the cache */
+        if (!cold && run_walk(bench, extra, &files, &bytes) < 0) {
+            fprintf(stderr, "Error: Cannot run %s\n", bench->walk);
+            exit(EXIT_FAILURE);
+        }
+        for (int rep = 0; rep < bench->reps; rep++) {
+            if (cold) drop_caches(bench);
+            double t = run_walk(bench, extra, &files, &bytes);
+            if (t < 0) {
+                fprintf(stderr, "Error: Cannot run %s\n", bench->walk);
+                exit(EXIT_FAILURE);
+            }
+            if (rep == 0 || t < r->seconds) r->seconds = t;
+        }
+        if (r->seconds > 0) {
+            r->mb_s = (double)bytes / r->seconds / (1024 * 1024);
+            r->files_s = (double)files / r->seconds;
+        }
+        printf("  %-28s %9.1f MB/s  %9.0f files/s  %.3f s\n", full, r->mb_s,
+               r->files_s, r->seconds);
+    }
+}
+
+static void write_results(const Bench *bench) {
+    FILE *out = fopen(bench->output, "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot write %s\n", bench->output);
+        exit(EXIT_FAILURE);
+    }
+    
+    fprintf(out, "{\"label\":\"%s\",\"time\":%ld,\"reps\":%d,\"jobs\":%d,",
+            bench->label, (long)time(NULL), bench->reps, bench->jobs);
+    fprintf(out, "\"corpus\":\"%s\",\"cold_method\":\"%s\",\"results\":[",
+            bench->corpus ? bench->corpus : "",
+            bench->cold_method ? bench->cold_method : "");
+    for (int k = 0; k < bench->nresults; k++) {
+        const BenchResult *r = &bench->results[k];
+        fprintf(out, "%s\n  {\"name\":\"%s\",\"seconds\":%.6f,\"mb_s\":%.3f",
+                k ? "," : "", r->name, r->seconds, r->mb_s);
+        if (r->files_s > 0) fprintf(out, ",\"files_s\":%.1f", r->files_s);
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    printf("Results written to %s\n", bench->output);
+}
+
+/* Comparison */
+
+static char *read_all(const char *path) {
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "Error: Cannot read %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    rewind(in);
+    char *text = malloc((size_t)size + 1);
+    if (!text || fread(text, 1, (size_t)size, in) != (size_t)size) {
+        fprintf(stderr, "Error: Cannot read %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    text[size] = '\0';
+    fclose(in);
+    return text;
+}
+
+/* MB/s of a named result in a file written by write_results() */
+static double find_rate(const char *text, const char *name) {
+    char key[96];
+    snprintf(key, sizeof(key), "\"name\":\"%s\"", name);
+    const char *at = strstr(text, key);
+    const char *rate = at ? strstr(at, "\"mb_s\":") : NULL;
+    return rate ? atof(rate + 7) : -1;
+}
+
+/* Print new/old throughput for every result in both files; a drop of
+ * more than threshold percent anywhere makes the exit status 1 */
+static int compare_results(const char *old_path, const char *new_path,
+                           double threshold) {
+    char *old_text = read_all(old_path);
+    char *new_text = read_all(new_path);
+    int regressed = 0;
+    
+    printf("%-28s %10s %10s %8s\n", "benchmark", "old MB/s", "new MB/s", "change");
+    for (const char *at = strstr(new_text, "\"name\":\""); at;
+         at = strstr(at + 1, "\"name\":\"")) {
+        char name[64];
+        const char *start = at + 8;
+        const char *end = strchr(start, '"');
+        if (!end || (size_t)(end - start) >= sizeof(name)) continue;
+        memcpy(name, start, (size_t)(end - start));
+        name[end - start] = '\0';
+        
+        double before = find_rate(old_text, name);
+        double after = find_rate(new_text, name);
+        if (before <= 0 || after < 0) continue;
+        double change = (after / before - 1) * 100;
+        int bad = change < -threshold;
+        printf("%-28s %10.1f %10.1f %+7.1f%%%s\n", name, before, after, change,
+               bad ? "  REGRESSION" : "");
+        regressed |= bad;
+    }
+    free(old_text);
+    free(new_text);
+    return regressed;
+}
+
+static void print_bench_help(void) {
+    printf("Usage: bench [OPTIONS]\n");
+    printf("       bench --compare OLD.json NEW.json [--threshold PCT]\n\n");
+    printf("Options:\n");
+    printf("  --walk PATH     Walker binary to run (default: ./walk)\n");
+    printf("  --corpus DIR    Corpus for end-to-end runs (see gencorpus)\n");
+    printf("  -o FILE         Write results as JSON (default: bench.json)\n");
+    printf("  --label TEXT    Label stored with the results, e.g. a commit\n");
+    printf("  --keyword WORD  Keyword to search for (default: needle)\n");
+    printf("  --reps N        Repetitions; the best is kept (default: 5)\n");
+    printf("  -j JOBS         Worker threads passed to the walker\n");
+    printf("  --kernel-mb N   Kernel buffer size in MB (default: 64)\n");
+    printf("  --cache MODE    cold, warm or both (default: both)\n");
+    printf("  --no-kernels    Only run the end-to-end benchmarks\n");
+}
+
+int main(int argc, char *argv[]) {
+    static Bench bench;
+    const char *compare[2] = { NULL, NULL };
+    double threshold = 10;
+    
+    bench.walk = "./walk";
+    bench.output = "bench.json";
+    bench.label = "";
+    bench.keyword = "needle";
+    bench.reps = 5;
+    bench.kernel_mb = 64;
+    bench.cold = bench.warm = bench.kernels = 1;
+    
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_bench_help();
+            return EXIT_SUCCESS;
+        }
+        if (strcmp(arg, "--no-kernels") == 0) {
+            bench.kernels = 0;
+            continue;
+        }
+        if (!value) {
+            fprintf(stderr, "Error: %s needs a value\n", arg);
+            return EXIT_FAILURE;
+        }
+        i++;
+        if (strcmp(arg, "--walk") == 0) bench.walk = value;
+        else if (strcmp(arg, "--corpus") == 0) bench.corpus = value;
+        else if (strcmp(arg, "-o") == 0) bench.output = value;
+        else if (strcmp(arg, "--label") == 0) bench.label = value;
+        else if (strcmp(arg, "--keyword") == 0) bench.keyword = value;
+        else if (strcmp(arg, "--reps") == 0) bench.reps = atoi(value);
+        else if (strcmp(arg, "-j") == 0) bench.jobs = atoi(value);
+        else if (strcmp(arg, "--kernel-mb") == 0) bench.kernel_mb = atol(value);
+        else if (strcmp(arg, "--threshold") == 0) threshold = atof(value);
+        else if (strcmp(arg, "--compare") == 0 && i + 1 < argc) {
+            compare[0] = value;
+            compare[1] = argv[++i];
+        } else if (strcmp(arg, "--cache") == 0) {
+            bench.cold = strcmp(value, "warm") != 0;
+            bench.warm = strcmp(value, "cold") != 0;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    if (compare[0]) {
+        return compare_results(compare[0], compare[1], threshold)
+            ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (bench.reps < 1 || bench.kernel_mb < 1 || strlen(bench.keyword) >= 256) {
+        print_bench_help();
+        return EXIT_FAILURE;
+    }
+    
+    if (bench.kernels) {
+        bench_kernels(&bench);
+    }
+    
+    if (bench.corpus) {
+        char *literal[] = { "-c", (char *)bench.keyword, NULL };
+        char *icase[] = { "-c", "-i", (char *)bench.keyword, NULL };
+        char *multi[] = { "-c", (char *)bench.keyword, "timeout", "handler", NULL };
+        char *listing[] = { "-l", (char *)bench.keyword, NULL };
+        
+        printf("End to end (%s, best of %d):\n", bench.corpus, bench.reps);
+        bench_walk(&bench, "literal", literal);
+        bench_walk(&bench, "icase", icase);
+        bench_walk(&bench, "multi", multi);
+        bench_walk(&bench, "files_with_matches", listing);
+    }
+    
+    write_results(&bench);
+    return EXIT_SUCCESS;
+}
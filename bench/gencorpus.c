@@ -0,0 +1,272 @@
+/* Synthetic corpus generator for the walk benchmarks */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <math.h>
+
+#define MAX_PATH 4096
+#define MANIFEST_NAME "CORPUS"
+
+typedef struct {
+    long files;
+    long mean_size;         /* bytes, exponentially distributed */
+    long max_size;
+    int fanout;             /* subdirectories per directory */
+    int per_dir;            /* files per directory */
+    double binary_ratio;    /* share of files with NUL bytes up front */
+    double density;         /* keyword occurrences per MB of text */
+    char keyword[256];
+    uint64_t seed;
+    const char *dir;
+} CorpusOptions;
+
+/* Filler vocabulary; none of these contain the default keyword */
+static const char *words[] = {
+    "the", "of", "and", "to", "in", "is", "for", "on", "with", "as",
+    "static", "const", "return", "struct", "int", "char", "void", "if",
+    "else", "while", "buffer", "length", "offset", "value", "result",
+    "error", "file", "path", "directory", "worker", "thread", "queue",
+    "match", "line", "search", "index", "count", "size", "pointer",
+    "memory", "system", "option", "default", "config", "server", "client",
+    "request", "response", "table", "entry", "record", "header", "stream",
+    "module", "object", "string", "number", "parse", "format", "output",
+    "input", "timeout", "handler", "context",
+};
+#define WORD_COUNT (sizeof(words) / sizeof(words[0]))
+
+/* xorshift64*: fast, and the same corpus for the same seed everywhere */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ull;
+}
+
+static double next_unit(uint64_t *state) {
+    return (double)(next_random(state) >> 11) / (double)(1ull << 53);
+}
+
+/* Print usage information */
+static void print_help(void) {
+    printf("Usage: gencorpus [OPTIONS] DIR\n\n");
+    printf("Options:\n");
+    printf("  -n FILES        Number of files (default: 20000)\n");
+    printf("  -s MEAN         Mean file size in bytes (default: 8192)\n");
+    printf("  -S MAX          Largest file size in bytes (default: 4194304)\n");
+    printf("  --fanout N      Subdirectories per directory (default: 8)\n");
+    printf("  --per-dir N     Files per directory (default: 32)\n");
+    printf("  --binary R      Share of binary files, 0..1 (default: 0.05)\n");
+    printf("  --density D     Keyword occurrences per MB (default: 20)\n");
+    printf("  --keyword WORD  Keyword to plant (default: needle)\n");
+    printf("  --seed N        Random seed (default: 1)\n");
+}
+
+static void parse_arguments(int argc, char *argv[], CorpusOptions *opts) {
+    opts->files = 20000;
+    opts->mean_size = 8192;
+    opts->max_size = 4 * 1024 * 1024;
+    opts->fanout = 8;
+    opts->per_dir = 32;
+    opts->binary_ratio = 0.05;
+    opts->density = 20;
+    strcpy(opts->keyword, "needle");
+    opts->seed = 1;
+    opts->dir = NULL;
+    
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        
+        if (arg[0] != '-') {
+            opts->dir = arg;
+            continue;
+        }
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_help();
+            exit(EXIT_SUCCESS);
+        }
+        if (!value) {
+            fprintf(stderr, "Error: %s needs a value\n", arg);
+            exit(EXIT_FAILURE);
+        }
+        i++;
+        if (strcmp(arg, "-n") == 0) opts->files = atol(value);
+        else if (strcmp(arg, "-s") == 0) opts->mean_size = atol(value);
+        else if (strcmp(arg, "-S") == 0) opts->max_size = atol(value);
+        else if (strcmp(arg, "--fanout") == 0) opts->fanout = atoi(value);
+        else if (strcmp(arg, "--per-dir") == 0) opts->per_dir = atoi(value);
+        else if (strcmp(arg, "--binary") == 0) opts->binary_ratio = atof(value);
+        else if (strcmp(arg, "--density") == 0) opts->density = atof(value);
+        else if (strcmp(arg, "--seed") == 0) opts->seed = strtoull(value, NULL, 10);
+        else if (strcmp(arg, "--keyword") == 0) {
+            strncpy(opts->keyword, value, sizeof(opts->keyword) - 1);
+            opts->keyword[sizeof(opts->keyword) - 1] = '\0';
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    if (!opts->dir || opts->files < 0 || opts->mean_size <= 0 ||
+        opts->max_size <= 0 || opts->fanout < 1 || opts->per_dir < 1 ||
+        !opts->keyword[0]) {
+        print_help();
+        exit(EXIT_FAILURE);
+    }
+    if (opts->seed == 0) opts->seed = 1;
+}
+
+/* Path of directory k: directories form a tree with fanout children
+ * each, numbered breadth first, so d0 is the corpus root */
+static void dir_path(const CorpusOptions *opts, long k, char *out, size_t cap) {
+    long chain[64];
+    int depth = 0;
+    
+    while (k > 0 && depth < 64) {
+        chain[depth++] = k;
+        k = (k - 1) / opts->fanout;
+    }
+    size_t len = (size_t)snprintf(out, cap, "%s", opts->dir);
+    while (depth > 0 && len < cap) {
+        len += (size_t)snprintf(out + len, cap - len, "/d%ld", chain[--depth]);
+    }
+}
+
+/* Fill buf with lines of filler words, planting the keyword at the
+ * requested density; binary files start with a block of random bytes */
+static size_t fill_file(const CorpusOptions *opts, uint64_t *rng, char *buf,
+                        size_t size, int binary, long *planted) {
+    size_t len = 0;
+    size_t keyword_len = strlen(opts->keyword);
+    double plant = opts->density * 6.0 / 1e6;   /* ~6 bytes per word */
+    
+    if (binary) {
+        size_t head = size < 4096 ? size : 4096;
+        for (; len < head; len++) {
+            buf[len] = (char)(next_random(rng) >> 56);
+        }
+        buf[len / 2] = '\0';
+    }
+    
+    size_t line_start = len;
+    size_t line_len = 40 + next_random(rng) % 60;
+    while (len < size) {
+        const char *word = words[next_random(rng) % WORD_COUNT];
+        size_t word_len = strlen(word);
+        
+        if (next_unit(rng) < plant) {
+            word = opts->keyword;
+            word_len = keyword_len;
+            (*planted)++;
+        }
+        if (len + word_len + 1 > size) break;
+        memcpy(buf + len, word, word_len);
+        len += word_len;
+        if (len - line_start >= line_len) {
+            buf[len++] = '\n';
+            line_start = len;
+            line_len = 40 + next_random(rng) % 60;
+        } else {
+            buf[len++] = ' ';
+        }
+    }
+    while (len < size) buf[len++] = '\n';
+    return len;
+}
+
+/* Contents of the manifest: the parameters, so reruns can be skipped */
+static void describe(const CorpusOptions *opts, char *out, size_t cap) {
+    snprintf(out, cap, "files=%ld mean=%ld max=%ld fanout=%d per_dir=%d "
+             "binary=%.4f density=%.4f keyword=%s seed=%llu\n",
+             opts->files, opts->mean_size, opts->max_size, opts->fanout,
+             opts->per_dir, opts->binary_ratio, opts->density, opts->keyword,
+             (unsigned long long)opts->seed);
+}
+
+int main(int argc, char *argv[]) {
+    CorpusOptions opts;
+    char path[MAX_PATH];
+    char params[1024], existing[1024];
+    
+    parse_arguments(argc, argv, &opts);
+    describe(&opts, params, sizeof(params));
+    
+    snprintf(path, sizeof(path), "%s/%s", opts.dir, MANIFEST_NAME);
+    FILE *manifest = fopen(path, "r");
+    if (manifest) {
+        size_t n = fread(existing, 1, sizeof(existing) - 1, manifest);
+        existing[n] = '\0';
+        fclose(manifest);
+        if (strcmp(existing, params) == 0) {
+            printf("Corpus in %s is up to date\n", opts.dir);
+            return EXIT_SUCCESS;
+        }
+        /* Files of the old corpus would be left behind and measured */
+        fprintf(stderr, "Error: %s holds a different corpus; remove it first\n",
+                opts.dir);
+        return EXIT_FAILURE;
+    }
+    
+    char *buf = malloc((size_t)opts.max_size);
+    if (!buf) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    
+    uint64_t rng = opts.seed;
+    long dirs = (opts.files + opts.per_dir - 1) / opts.per_dir;
+    long total = 0, planted = 0, binaries = 0;
+    if (dirs < 1) dirs = 1;
+    
+    /* Parents are numbered before their children, so mkdir in order */
+    for (long k = 0; k < dirs; k++) {
+        dir_path(&opts, k, path, sizeof(path));
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: Cannot create %s\n", path);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    for (long i = 0; i < opts.files; i++) {
+        double size = -log(1.0 - next_unit(&rng)) * (double)opts.mean_size;
+        size_t want = size < 1 ? 1 : size > opts.max_size ?
+                      (size_t)opts.max_size : (size_t)size;
+        int binary = next_unit(&rng) < opts.binary_ratio;
+        
+        size_t len = fill_file(&opts, &rng, buf, want, binary, &planted);
+        dir_path(&opts, i / opts.per_dir, path, sizeof(path));
+        size_t plen = strlen(path);
+        snprintf(path + plen, sizeof(path) - plen, "/f%ld.%s", i,
+                 binary ? "bin" : "txt");
+        
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || write(fd, buf, len) != (ssize_t)len) {
+            fprintf(stderr, "Error: Cannot write %s\n", path);
+            return EXIT_FAILURE;
+        }
+        close(fd);
+        total += (long)len;
+        binaries += binary;
+    }
+    free(buf);
+    
+    snprintf(path, sizeof(path), "%s/%s", opts.dir, MANIFEST_NAME);
+    manifest = fopen(path, "w");
+    if (manifest) {
+        fputs(params, manifest);
+        fclose(manifest);
+    }
+    
+    printf("Wrote %ld files (%ld binary) in %ld directories, %ld bytes, "
+           "%ld keyword occurrences\n", opts.files, binaries, dirs, total,
+           planted);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,39 @@
+#!/bin/sh
+# A file with a NUL byte in its first block is reported as one "Binary
+# file X matches" line by default, searched as text under -a and skipped
+# under -I; text files are searched the same in all three modes.
+# Usage: tests/binary.sh [./walk]
+WALK=${1:-./walk}
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+mkdir "$DIR/tree"
+
+printf 'a text needle\n' > "$DIR/tree/text.txt"
+printf 'head\000needle\nmore needle\n' > "$DIR/tree/obj.bin"
+printf 'head\000nothing here\n' > "$DIR/tree/other.bin"
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+# run OPTION: the result lines for the tree, sorted
+run() {
+    "$WALK" $1 "$DIR/tree" needle 2>&1 | grep -a "$DIR/tree/" | sort
+}
+
+printf '%s\n' "$DIR/tree/text.txt:1:a text needle" \
+    "Binary file $DIR/tree/obj.bin matches" | sort > "$DIR/want"
+run "" > "$DIR/got"
+cmp -s "$DIR/got" "$DIR/want" || fail "default: $(cat "$DIR/got")"
+
+# The NUL is printed as is; drop it to compare
+run -a | tr -d '\000' > "$DIR/got"
+grep -q "obj.bin:1:headneedle" "$DIR/got" &&
+    [ "$(grep -c obj.bin "$DIR/got")" -eq 2 ] &&
+    grep -q "obj.bin:2:more needle" "$DIR/got" &&
+    grep -q "text.txt:1:a text needle" "$DIR/got" || fail "-a: $(cat "$DIR/got")"
+
+run -I > "$DIR/got"
+[ "$(cat "$DIR/got")" = "$DIR/tree/text.txt:1:a text needle" ] || fail "-I: $(cat "$DIR/got")"
+echo "PASS: binary"
@@ -0,0 +1,50 @@
+#!/bin/sh
+# --cache must replay the results of unchanged files, giving the same
+# output as a fresh search, and search again any file whose size or
+# mtime changed; another query must not reuse the records.
+# Usage: tests/cache.sh [./walk]
+WALK=${1:-./walk}
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+mkdir "$DIR/tree"
+
+for f in $(seq 1 30); do
+    awk -v f="$f" 'BEGIN { for (i = 1; i <= 40; i++) print (i % f ? "line " : "needle ") f " " i }' \
+        > "$DIR/tree/f$f.txt"
+done
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+# run STEP CACHED [KEYWORD]: a cached search must find what a plain one
+# does, replaying CACHED files
+run() {
+    kw=${3:-needle}
+    "$WALK" --cache "$DIR/cache" "$DIR/tree" $kw > "$DIR/out" 2>&1
+    grep "^$DIR/tree/" "$DIR/out" | sort > "$DIR/got"
+    "$WALK" "$DIR/tree" $kw 2>&1 | grep "^$DIR/tree/" | sort > "$DIR/want"
+    cmp -s "$DIR/got" "$DIR/want" || fail "$1: results differ from a plain search"
+    [ -s "$DIR/want" ] || fail "$1: nothing found"
+    cached=$(sed -n 's/^Files cached: *\([0-9]*\).*/\1/p' "$DIR/out")
+    [ "${cached:-0}" -eq "$2" ] || fail "$1: ${cached:-0} files replayed, want $2"
+}
+
+run first 0
+run replay 30
+
+# A changed file is searched again, and so is a file only touched
+sleep 1
+echo "needle added" >> "$DIR/tree/f4.txt"
+sed 's/^line/needle/' "$DIR/tree/f9.txt" > "$DIR/f9" && mv "$DIR/f9" "$DIR/tree/f9.txt"
+touch "$DIR/tree/f20.txt"
+run changed 27
+grep -q "^$DIR/tree/f4.txt:41:needle added" "$DIR/got" || fail "changed: appended line missing"
+run recorded 30
+
+rm "$DIR/tree/f5.txt"
+run removed 29
+run other 0 line
+run back 29
+echo "PASS: cache"
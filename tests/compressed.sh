@@ -0,0 +1,61 @@
+#!/bin/sh
+# -z must find in a compressed file exactly the lines grep finds in its
+# decoded text, with the right line numbers, although the text is
+# scanned DECODE_CHUNK_BYTES (256 KB) at a time: matches and lines,
+# including one longer than a chunk, straddle the chunk boundaries.
+# xz and zstd are checked when this walk decodes them.
+# Usage: tests/compressed.sh [./walk]
+WALK=${1:-./walk}
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+mkdir "$DIR/tree"
+
+awk 'BEGIN {
+    srand(7)
+    for (i = 1; i <= 30000; i++) {
+        n = 20 + int(rand() * 130)
+        line = ""
+        while (length(line) < n) line = line sprintf("%c", 97 + int(rand() * 26))
+        if (i % 5 == 0) {
+            at = int(rand() * n)
+            line = substr(line, 1, at) "needle" substr(line, at + 1)
+        }
+        print line
+        if (i == 12000) {
+            long = ""
+            for (j = 0; j < 6000; j++) long = long "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx"
+            print substr(long, 1, 300000) "needle" substr(long, 300001)
+        }
+    }
+}' > "$DIR/text"
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+# check FILE DECODER: walk -z on FILE against grep on the decoded text
+check() {
+    "$WALK" -z "$DIR/tree" needle 2>&1 | grep "^$1:" > "$DIR/got"
+    $2 < "$1" | grep -n needle | sed "s|^|$1:|" > "$DIR/want"
+    cmp -s "$DIR/got" "$DIR/want" ||
+        fail "$1: $(wc -l < "$DIR/got") lines, want $(wc -l < "$DIR/want")"
+}
+
+gzip -c "$DIR/text" > "$DIR/tree/text.gz"
+check "$DIR/tree/text.gz" "gzip -dc"
+rm "$DIR/tree/text.gz"
+
+# The other formats only where both the tool and the decoder exist
+echo needle > "$DIR/probe"
+for format in xz zstd; do
+    command -v $format >/dev/null || continue
+    $format -c "$DIR/probe" > "$DIR/tree/probe.$format"
+    found=$("$WALK" -z "$DIR/tree" needle 2>&1 | grep -c "probe.$format:1:needle$")
+    rm "$DIR/tree/probe.$format"
+    [ "$found" -eq 1 ] || continue
+    $format -c "$DIR/text" > "$DIR/tree/text.$format"
+    check "$DIR/tree/text.$format" "$format -dc"
+    rm "$DIR/tree/text.$format"
+done
+echo "PASS: compressed"
@@ -0,0 +1,43 @@
+#!/bin/sh
+# -A/-B/-C output must be what grep -nH prints for the same files:
+# overlapping and adjacent windows merged, "--" between the rest and
+# between files, matches on the first and last lines, and windows
+# wider than the file. Unordered output must hold the same lines.
+# Usage: tests/context.sh [./walk]
+WALK=${1:-./walk}
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+mkdir "$DIR/tree"
+
+for f in $(seq 1 12); do
+    awk -v f="$f" 'BEGIN {
+        n = 5 + f * 7
+        for (i = 1; i <= n; i++) {
+            hit = i == 1 || i == n || (i * f) % 11 == 0 || (i % 17 == 0 && f % 2)
+            print (hit ? "needle " : "line ") f " " i
+        }
+    }' > "$DIR/tree/f$f.txt"
+done
+seq 1 30 > "$DIR/tree/none.txt"
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+for opts in "-A 1" "-B 2" "-C 1" "-C 0" "-A 3 -B 1" "-C 40"; do
+    "$WALK" -O $opts "$DIR/tree" needle 2>&1 | grep "^$DIR/tree/\|^--$" > "$DIR/got"
+    files=$(grep "^$DIR/tree/" "$DIR/got" | sed 's/[-:][0-9]*[-:].*//' | uniq)
+    [ "$(echo "$files" | wc -l)" -eq 12 ] || fail "$opts: files out of order or missing"
+    grep -nH $opts needle $files > "$DIR/want"
+    cmp -s "$DIR/got" "$DIR/want" || {
+        echo "FAIL: $opts: differs from grep -nH (< walk, > grep)"
+        diff "$DIR/got" "$DIR/want" | head -20
+        exit 1
+    }
+    
+    "$WALK" -j 8 $opts "$DIR/tree" needle 2>&1 | grep "^$DIR/tree/\|^--$" |
+        sort > "$DIR/got"
+    sort "$DIR/want" | cmp -s - "$DIR/got" || fail "$opts: unordered output differs"
+done
+echo "PASS: context"
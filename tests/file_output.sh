@@ -0,0 +1,27 @@
+#!/bin/sh
+# Every file's matching lines must come out as one run, also when a file
+# has more than MAX_MATCHES_PER_FILE (50) of them and workers race.
+# Usage: tests/file_output.sh [./walk]
+WALK=${1:-./walk}
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+mkdir "$DIR/tree"
+
+for f in $(seq 1 64); do
+    awk -v f="$f" 'BEGIN { for (i = 1; i <= 400; i++) print "needle " f " " i }' \
+        > "$DIR/tree/f$f.txt"
+done
+
+for round in 1 2 3 4 5; do
+    "$WALK" "$DIR/tree" needle -j 8 2>&1 | grep "^$DIR/tree/" > "$DIR/out" || {
+        echo "FAIL: walk found nothing"
+        exit 1
+    }
+    lines=$(wc -l < "$DIR/out")
+    runs=$(cut -d: -f1 "$DIR/out" | uniq | wc -l)
+    if [ "$lines" -ne 25600 ] || [ "$runs" -ne 64 ]; then
+        echo "FAIL: round $round: $lines lines in $runs runs, want 25600 in 64"
+        exit 1
+    fi
+done
+echo "PASS: file_output"
@@ -0,0 +1,42 @@
+#!/bin/sh
+# .gitignore/.ignore rules must follow gitignore(5): globs on the name,
+# '/' anchoring to the ignore file's directory, trailing '/' for
+# directories only, '!' negation, inner files and .ignore overriding,
+# and .git skipped; --no-ignore searches everything.
+# Usage: tests/gitignore.sh [./walk]
+WALK=${1:-./walk}
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+T="$DIR/tree"
+mkdir -p "$T/.git" "$T/build" "$T/sub/deep" "$T/docs/deep" "$T/other/docs"
+
+printf '%s\n' '# comment' '*.log' '!keep.log' 'build/' '/top.txt' \
+    'docs/*.tmp' 'secret.txt' > "$T/.gitignore"
+printf '%s\n' '!secret.txt' > "$T/.ignore"
+printf '%s\n' '!debug.log' 'local.txt' > "$T/sub/.gitignore"
+
+for f in .git/config build/out.txt a.txt a.log keep.log top.txt secret.txt \
+         sub/top.txt sub/a.log sub/debug.log sub/local.txt sub/build \
+         sub/deep/local.txt docs/a.tmp docs/deep/b.tmp other/docs/a.tmp; do
+    echo needle > "$T/$f"
+done
+
+# check OPTION FILE...: exactly FILEs must match
+check() {
+    opt=$1
+    shift
+    "$WALK" $opt "$T" needle -l 2>&1 | grep "^$T/" | sed "s|^$T/||" | sort > "$DIR/got"
+    printf '%s\n' "$@" | sort > "$DIR/want"
+    cmp -s "$DIR/got" "$DIR/want" || {
+        echo "FAIL: ${opt:-default}: unexpected files (< got, > want)"
+        diff "$DIR/got" "$DIR/want"
+        exit 1
+    }
+}
+
+check "" a.txt keep.log secret.txt sub/top.txt sub/debug.log sub/build \
+    docs/deep/b.tmp other/docs/a.tmp
+check --no-ignore .git/config build/out.txt a.txt a.log keep.log top.txt \
+    secret.txt sub/top.txt sub/a.log sub/debug.log sub/local.txt sub/build \
+    sub/deep/local.txt docs/a.tmp docs/deep/b.tmp other/docs/a.tmp
+echo "PASS: gitignore"
@@ -0,0 +1,50 @@
+#!/bin/sh
+# -f and --exclude take several globs each, with '*', '?', '[...]' and
+# '**'; globs without a '/' match the basename, the rest the path below
+# the start directory, and matching ignores case.
+# Usage: tests/globs.sh [./walk]
+WALK=${1:-./walk}
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+T="$DIR/tree"
+mkdir -p "$T/src/deep" "$T/build" "$T/lib"
+
+for f in a.c B.C a.h Makefile notes.md src/x.c src/deep/y.h src/deep/z.txt \
+         build/gen.c lib/t1.txt lib/t2.txt lib/t10.txt lib/tx.txt; do
+    echo needle > "$T/$f"
+done
+
+# check OPTIONS -- FILE...: exactly FILEs must match; the globs in
+# OPTIONS are for walk, not the shell
+set -f
+check() {
+    opts=
+    while [ "$1" != -- ]; do
+        opts="$opts $1"
+        shift
+    done
+    shift
+    "$WALK" $opts "$T" needle -l 2>&1 | grep "^$T/" | sed "s|^$T/||" | sort > "$DIR/got"
+    printf '%s\n' "$@" | sort > "$DIR/want"
+    cmp -s "$DIR/got" "$DIR/want" || {
+        echo "FAIL:$opts: unexpected files (< got, > want)"
+        diff "$DIR/got" "$DIR/want"
+        exit 1
+    }
+}
+
+# Extension and exact-name sets, folding case
+check -f '*.c' -f '*.h' -f makefile -- \
+    a.c B.C a.h Makefile src/x.c src/deep/y.h build/gen.c
+check -f '*.c' -f '*.h' --exclude build -- \
+    a.c B.C a.h src/x.c src/deep/y.h
+# '?' and classes stay within one name
+check -f 't?.txt' -- lib/t1.txt lib/t2.txt lib/tx.txt
+check -f 't[0-9].txt' -f 't[!0-9x]*.txt' -- lib/t1.txt lib/t2.txt
+# Path globs: '**/' spans zero or more directories, '*' never spans '/'
+check -f 'src/**/*.c' -f 'src/**/*.h' -- src/x.c src/deep/y.h
+check -f 'src/*' -- src/x.c
+check -f './lib/t1*' -- lib/t1.txt lib/t10.txt
+check --exclude '*.txt' --exclude src/deep --exclude '[ab].*' -- \
+    Makefile notes.md src/x.c build/gen.c
+echo "PASS: globs"
@@ -0,0 +1,51 @@
+#!/bin/sh
+# An index query must prune files that cannot match yet find everything a
+# plain search finds, also for files changed after the index was built;
+# --index update must read only the changed files.
+# Usage: tests/index.sh [./walk]
+WALK=${1:-./walk}
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+mkdir "$DIR/tree"
+
+for f in $(seq 1 40); do
+    awk -v f="$f" 'BEGIN { for (i = 1; i <= 50; i++) print "plain line " f " " i }' \
+        > "$DIR/tree/f$f.txt"
+done
+echo "a needle in f3" >> "$DIR/tree/f3.txt"
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+# query STEP: the index must give the plain search's matches and prune
+query() {
+    "$WALK" --index "$DIR/tree" needle > "$DIR/out" 2>&1
+    grep "^$DIR/tree/" "$DIR/out" | sort > "$DIR/indexed"
+    "$WALK" "$DIR/tree" needle 2>&1 | grep "^$DIR/tree/" | sort > "$DIR/plain"
+    cmp -s "$DIR/indexed" "$DIR/plain" || fail "$1: index results differ from a plain search"
+    [ -s "$DIR/plain" ] || fail "$1: nothing found"
+    pruned=$(sed -n 's/^Files pruned: *\([0-9]*\).*/\1/p' "$DIR/out")
+    [ "${pruned:-0}" -gt 30 ] || fail "$1: only ${pruned:-0} files pruned"
+}
+
+"$WALK" --index build "$DIR/tree" | grep -q "^Indexed 40 files (40 read" ||
+    fail "build did not index 40 files"
+query build
+
+# A file changed since the build is searched without an update
+sleep 1
+echo "another needle" >> "$DIR/tree/f7.txt"
+query stale
+grep -q "^$DIR/tree/f7.txt:51:" "$DIR/indexed" || fail "stale: changed file missed"
+
+"$WALK" --index update "$DIR/tree" | grep -q "^Indexed 40 files (1 read, 39 unchanged)" ||
+    fail "update read more than the changed file"
+query update
+
+rm "$DIR/tree/f3.txt"
+"$WALK" --index update "$DIR/tree" | grep -q "^Indexed 39 files (0 read, 39 unchanged)" ||
+    fail "update kept a removed file"
+query remove
+echo "PASS: index"
@@ -0,0 +1,64 @@
+#!/bin/sh
+# -L must follow symbolic links yet enter each directory once, so links
+# back up the tree or to one directory twice neither loop nor repeat;
+# --dedup must search each inode once however many hard links or
+# followed symlinks reach it, also with many workers racing.
+# Usage: tests/links.sh [./walk]
+WALK=${1:-./walk}
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+T="$DIR/tree"
+mkdir -p "$T/a/sub" "$DIR/out"
+
+echo needle > "$T/a/x.txt"
+echo needle > "$DIR/out/o.txt"
+ln "$T/a/x.txt" "$T/a/hard.txt"
+ln -s .. "$T/a/sub/up"
+ln -s ../.. "$T/a/sub/top"
+ln -s ../out "$T/out1"
+ln -s "$DIR/out" "$T/out2"
+ln -s a/x.txt "$T/sym.txt"
+ln -s missing "$T/dangling"
+for d in $(seq 1 20); do
+    mkdir "$T/d$d"
+    echo "needle $d" > "$T/d$d/own.txt"
+    for c in $(seq 1 10); do
+        [ -f "$DIR/c$c" ] || echo "needle c$c" > "$DIR/c$c"
+        ln "$DIR/c$c" "$T/d$d/c$c.txt"
+    done
+done
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+# list OPTIONS: the matching files, sorted
+list() {
+    timeout 20 "$WALK" $1 -j 8 "$T" needle -l 2>&1 | grep "^$T/" | sort
+}
+
+# Without -L symlinks are skipped and every hard link is searched
+[ "$(list "" | wc -l)" -eq 222 ] || fail "default: $(list "" | wc -l) files, want 222"
+list "" | grep -q "sym.txt\|out[12]/\|/sub/" && fail "default: followed a symlink"
+
+for round in 1 2 3; do
+    list -L > "$DIR/got"
+    [ "$(wc -l < "$DIR/got")" -eq 224 ] || fail "-L: $(wc -l < "$DIR/got") files, want 224"
+    grep -q "^$T/sym.txt$" "$DIR/got" || fail "-L: linked file missing"
+    [ "$(grep -c "/out[12]/o.txt$" "$DIR/got")" -eq 1 ] ||
+        fail "-L: linked directory not entered exactly once"
+    grep -q "/sub/" "$DIR/got" && fail "-L: entered a directory again through a cycle"
+    
+    # One file per inode: x.txt, o.txt, 20 own.txt and 10 shared files
+    for opts in --dedup "-L --dedup"; do
+        list "$opts" > "$DIR/got"
+        want=31
+        [ "$opts" = --dedup ] || want=32
+        [ "$(wc -l < "$DIR/got")" -eq $want ] ||
+            fail "$opts: $(wc -l < "$DIR/got") files, want $want"
+        inodes=$(while read -r f; do stat -L -c %i "$f"; done < "$DIR/got" | sort -u | wc -l)
+        [ "$inodes" -eq $want ] || fail "$opts: an inode was searched twice"
+    done
+done
+echo "PASS: links"
@@ -0,0 +1,65 @@
+#!/bin/sh
+# -e must find exactly the lines grep -E finds. The patterns are ones
+# whose required literals are easy to get wrong: alternations, optional
+# and repeated atoms, groups, classes, escapes and anchors.
+# Usage: tests/regex.sh [./walk]
+WALK=${1:-./walk}
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+T="$DIR/tree"
+mkdir "$T"
+
+awk 'BEGIN {
+    n = split("color colour colouur foo bar baz foobar barbaz abab ababc " \
+              "a.b axb Needle needle NEEDLE start end x{2} xx ac abc abbc", w, " ")
+    for (f = 1; f <= 8; f++) {
+        file = sprintf("'"$T"'/f%d.txt", f)
+        for (i = 1; i <= 300; i++) {
+            line = ""
+            for (j = 0; j < 1 + (i * f) % 4; j++) {
+                line = line (j ? " " : "") w[1 + (i * 7 + j * 13 + f * 3) % n]
+            }
+            print line > file
+        }
+        close(file)
+    }
+}'
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+# check [-i] REGEX: walk -e REGEX against grep -E REGEX
+check() {
+    opt=
+    if [ "$1" = -i ]; then
+        opt=-i
+        shift
+    fi
+    "$WALK" $opt "$T" -e "$1" 2>&1 | grep "^$T/" | sort > "$DIR/got"
+    grep -rnHE $opt -e "$1" "$T" | sort > "$DIR/want"
+    [ -s "$DIR/want" ] || fail "test pattern '$1' matches nothing"
+    cmp -s "$DIR/got" "$DIR/want" ||
+        fail "$opt '$1': $(wc -l < "$DIR/got") lines, grep -E finds $(wc -l < "$DIR/want")"
+}
+
+check 'foo|baz'
+check 'colou?r'
+check 'colou*r'
+check 'colou{0,1}r'
+check 'colou+r'
+check '(ab)+c'
+check '(ab){2}'
+check '(foo|bar)baz'
+check 'x\{2\}'
+check 'a\.b'
+check 'a.b'
+check '[Nn]eedle'
+check '^start'
+check 'end$'
+check 'ab?c'
+check 'needle|^end'
+check -i 'needle'
+check -i 'COLOU?R|Foobar'
+echo "PASS: regex"
@@ -1,25 +1,297 @@
 /* Safe recursive file search */
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE     /* dirent.d_type and DT_* on glibc */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <regex.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#define WALK_HAVE_GETDENTS 1
+#define WALK_HAVE_INOTIFY 1
+#if defined(__has_include) && !defined(WALK_NO_IO_URING)
+#if __has_include(<linux/io_uring.h>) && defined(SYS_io_uring_setup)
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#define WALK_HAVE_IO_URING 1
+#endif
+#endif
+/* O_DIRECT is only exposed with _GNU_SOURCE; glibc always has the inner name */
+#if !defined(O_DIRECT) && defined(__O_DIRECT)
+#define O_DIRECT __O_DIRECT
+#endif
+#endif
+/* -z decoders are linked in on request: -DWALK_HAVE_ZLIB -lz,
+ * -DWALK_HAVE_LZMA -llzma, -DWALK_HAVE_ZSTD -lzstd (make finds them) */
+#ifdef WALK_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WALK_HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef WALK_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WALK_X86_SIMD 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define WALK_NEON_SIMD 1
+#endif
+#ifdef WALK_LIBRARY
+#include <setjmp.h>
+#endif
+#include "walk.h"
 
 /* Safe buffer sizes */
 #define MAX_PATH 4096
 #define MAX_LINE 2048
 #define MAX_KEYWORDS 20
+#define MAX_FILTERS 64
+#define MAX_LITERALS (MAX_KEYWORDS * 8)  /* automaton patterns, all keywords */
 #define MAX_MATCHES_PER_FILE 50
+#define OUTPUT_BATCH_BYTES (64 * 1024)
+#define OUTPUT_FLUSH_BYTES (256 * 1024)
+#define OUTPUT_MAX_IOV 1024
+#define MMAP_THRESHOLD (1024 * 1024)
+#define BINARY_PROBE_BYTES 8192         /* a NUL in here marks a binary file */
+#define IGNORE_FILE_MAX (1024 * 1024)   /* larger ignore files are skipped */
+#define READ_BLOCK_BYTES (256 * 1024)
+#define DENTS_BUF_BYTES (256 * 1024)
+#define STAT_BATCH 64
+#define FILE_BATCH 32                   /* files of one directory per work item */
+#define PREFETCH_BYTES (64 * 1024)      /* read per batched file by the ring */
+#define SPLIT_MIN_BYTES (16 * 1024 * 1024)  /* larger files are scanned in chunks */
+#define SPLIT_CHUNK_BYTES (4 * 1024 * 1024)
+#define DECODE_CHUNK_BYTES (256 * 1024)     /* -z: decoded per scan step */
+#define DECODE_MAX_LINE (16 * 1024 * 1024)  /* longer lines are split */
+#define DIRECT_ALIGN 4096                   /* --io=direct buffer and block size */
+#define DIRECT_BLOCK_BYTES (1024 * 1024)    /* --io=direct: read per call */
+#define MAX_DEVICES 64                  /* network mounts with their own queue */
+#define REMOTE_JOBS 32                  /* default --remote-jobs */
+#define DEVICE_JOBS 8                   /* default --device-jobs */
+#define ARENA_MIN_BLOCK 1024            /* first block of a directory's arena */
+#define ARENA_CLASSES 7                 /* block sizes 1 KB .. 64 KB */
+#define ARENA_CACHE_BLOCKS 32           /* free blocks kept per size class */
+
+#define INDEX_FILE_NAME ".walkindex"
+#define INDEX_MAGIC "WALKIDX1"
+#define INDEX_VERSION 1
+#define INDEX_MAX_TRIGRAMS (1 << 16)    /* files with more are never pruned */
+#define INDEX_NO_ID UINT32_MAX
+#define WATCH_SETTLE_MS 500             /* quiet time before a refresh */
+#define CACHE_MAGIC "WALKRC01"
+#define CACHE_VERSION 2
+#define CACHE_MIN_STALE 1024            /* superseded records before compacting */
+
+/* Directory enumeration backends */
+enum { BACKEND_POSIX, BACKEND_GETDENTS, BACKEND_URING };
+
+/* -z: compressed formats, told apart by their magic bytes */
+enum { CODEC_NONE, CODEC_GZIP, CODEC_XZ, CODEC_ZSTD };
+
+/* --order: which end of its deque a worker takes its own work from */
+enum { ORDER_DFS, ORDER_BFS };
+
+/* What to do with files that look binary */
+enum { BINARY_SUMMARY, BINARY_TEXT, BINARY_SKIP };
+
+/* --io: how file contents meet the page cache */
+enum { IO_NORMAL, IO_NOCACHE, IO_DIRECT };
+
+/* --index modes */
+enum { INDEX_NONE, INDEX_BUILD, INDEX_UPDATE, INDEX_WATCH, INDEX_QUERY };
+
+#ifndef WALK_DEFAULT_BACKEND
+#define WALK_DEFAULT_BACKEND BACKEND_POSIX
+#endif
+
+/* A literal the automaton looks for, and the keyword it stands for. A
+ * plain keyword is its own literal; a -e regex contributes the literals
+ * one of which every match must contain, and hits are then confirmed
+ * with regexec() on the line. */
+typedef struct {
+    char text[256];
+    size_t len;
+    int slot;
+} MatcherLiteral;
+
+/* Keyword set compiled into one Aho-Corasick DFA. Input bytes map to
+ * equivalence classes (upper and lower case share one with -i), so the
+ * table is nstates x nclasses and every byte costs a single lookup.
+ * Transitions hold the target row offset, negated for accepting states. */
+typedef struct {
+    MatcherLiteral lits[MAX_LITERALS];
+    int nlits;
+    uint32_t regex_mask;    /* keywords that are regexes to confirm */
+    regex_t regex[MAX_KEYWORDS];
+    unsigned char byte_class[256];
+    int nclasses;
+    int nstates;
+    int32_t *next;          /* nstates * nclasses transitions */
+    uint32_t *out;          /* keywords ending in each state */
+    uint32_t every_line;    /* keywords every line is a candidate for */
+    int single;             /* one literal: use a substring kernel instead */
+    char folded[256];       /* that literal folded to lower case, for -i */
+    const char *(*find_case)(const char *, size_t, const char *, size_t);
+    long (*count_newlines)(const char *, const char *);
+} KeywordMatcher;
+
+/* One -f/--exclude glob that needs the general matcher */
+typedef struct {
+    const char *glob;
+    size_t len;
+    int path;               /* has a '/': matched against the relative path */
+} FilterGlob;
+
+/* Key in a pattern set's hash table: a whole basename or an extension */
+typedef struct {
+    const char *text;       /* NULL for an empty slot */
+    size_t len;
+    int kind;               /* FILTER_NAME or FILTER_EXT */
+} FilterKey;
+
+enum { FILTER_NAME = 1, FILTER_EXT = 2 };
+
+/* A compiled list of patterns. Plain names and "*.ext" go in one
+ * case-insensitive hash set, so most lookups are a hash and a compare;
+ * only the remaining globs are run one by one. Matching is
+ * case-insensitive, as -f always was. */
+typedef struct {
+    FilterKey *keys;
+    size_t mask;
+    int has_ext;
+    FilterGlob *globs;
+    int nglobs;
+    int any_path;
+    int count;
+} PatternSet;
+
+/* On-disk trigram index, mapped read-only. Layout: header, file table
+ * (sorted by path relative to the indexed directory), path strings,
+ * trigram table (sorted), then delta+varint encoded posting lists of
+ * file ids. Trigrams are taken over case-folded bytes so one index
+ * serves both -i and case-sensitive queries. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t nfiles;
+    uint64_t ntrigrams;
+    uint64_t files_off;
+    uint64_t strings_off;
+    uint64_t trigrams_off;
+    uint64_t postings_off;
+    uint64_t file_size;
+} IndexHeader;
+
+enum { INDEX_UNINDEXED = 1 };   /* too many trigrams: always scanned */
+
+typedef struct {
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+    uint64_t ino;
+    uint32_t path_off;
+    uint32_t path_len;
+    uint32_t flags;
+    uint32_t reserved;
+} IndexFileEntry;
+
+typedef struct {
+    uint32_t trigram;
+    uint32_t count;
+    uint64_t offset;
+} IndexTrigram;
+
+typedef struct {
+    const char *map;
+    size_t map_len;
+    const IndexHeader *hdr;
+    const IndexFileEntry *files;
+    const char *strings;
+    const IndexTrigram *trigrams;
+    const unsigned char *postings;
+    uint32_t *slots;            /* path hash table: file id + 1, 0 = empty */
+    size_t slot_mask;
+    unsigned char *candidate;   /* per file: content may hold a keyword */
+    int usable;                 /* 0 when some keyword is too short */
+} SearchIndex;
+
+/* --cache: append-only log of per-file results, mapped read-only. Layout:
+ * header, then records, each a CacheRecord followed by the path relative
+ * to the start directory and the file's content output, padded to 8
+ * bytes. A later record for the same query and path supersedes earlier
+ * ones; superseded records are dropped when the log is rewritten. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} CacheHeader;
+
+typedef struct {
+    uint64_t query;         /* hash of every option that shapes the output */
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+    uint64_t ino;
+    int64_t matches;
+    uint32_t path_len;
+    uint32_t out_len;
+} CacheRecord;
+
+typedef struct {
+    char path[MAX_PATH];
+    const char *map;
+    size_t map_len;
+    size_t valid_len;           /* whole records; a torn append ends earlier */
+    size_t records;
+    uint64_t query;             /* of this run */
+    dev_t dev;                  /* the cache file itself, never searched */
+    ino_t ino;
+    uint64_t *slots;            /* latest record offset + 1 per (query, path) */
+    size_t slot_mask;
+    size_t live;                /* used slots */
+    unsigned char *replaced;    /* per slot: rescanned during this run */
+} ResultCache;
 
 /* Search options */
 typedef struct {
     char keywords[MAX_KEYWORDS][256];
+    size_t keyword_len[MAX_KEYWORDS];
     int keyword_count;
+    uint32_t regex_keywords;    /* -e: bit k set if keywords[k] is a regex */
+    long max_count;             /* -m: matching lines per file, 0 = all */
+    long max_total;             /* --max-total/--first/-q, 0 = no limit */
+    long before_context;        /* -B/-C: lines shown before a match */
+    long after_context;         /* -A/-C: lines shown after a match */
+    int context;                /* -A/-B/-C given, so "--" even for 0 */
+    int quiet;                  /* -q: exit status only */
+    int detailed_stats;         /* --stats=detailed */
+    int json;                   /* --json: one JSON record per line */
+    int decompress;             /* -z: search inside compressed files */
+    int follow_links;           /* -L: follow symlinks, each directory once */
+    int dedup;                  /* --dedup: search each inode once */
+    int one_file_system;        /* -x: stay on the start directory's device */
+    int remote_jobs;            /* --remote-jobs: workers for network mounts */
+    int device_jobs;            /* --device-jobs: per network mount at once */
     int case_sensitive;
     int recursive;
     int search_filenames;
@@ -30,35 +302,374 @@ typedef struct {
     int count_only;
     long min_size;
     long max_size;
-    char file_pattern[256];
+    int jobs;
+    int ordered_output;
+    int backend;
+    int order;                  /* --order: ORDER_DFS or ORDER_BFS */
+    int max_open_dirs;          /* --max-open-dirs, -1 = from RLIMIT_NOFILE */
+    int binary_mode;
+    int io_mode;                /* --io: IO_NORMAL, IO_NOCACHE or IO_DIRECT */
+    int use_ignore;         /* honour .gitignore/.ignore, skip .git */
+    char include[MAX_FILTERS][256];     /* -f: files must match one */
+    int include_count;
+    char exclude[MAX_FILTERS][256];     /* --exclude: files and dirs to skip */
+    int exclude_count;
+    PatternSet includes;
+    PatternSet excludes;
     char start_dir[MAX_PATH];
+    char cache_file[MAX_PATH];  /* --cache, empty if unused */
+    int index_mode;
+    SearchIndex *index;
+    ResultCache *cache;         /* --cache, NULL if unused */
+    KeywordMatcher *matcher;
+    struct WalkRun *run;        /* libwalk: matches go to its callback */
 } SearchOptions;
 
-/* File match result */
+/* File contents in memory, either mapped or in a worker's read buffer */
+typedef struct {
+    const char *data;
+    size_t len;
+    int mapped;
+} FileView;
+
+/* Per-file match buffer: formatted output records, handed to the
+ * output sink in one piece so records from different files never mix */
 typedef struct {
-    int line_number;
-    char line_content[MAX_LINE];
+    char *data;
+    size_t len;
+    size_t cap;
+    int count;      /* records of the file being searched */
+    int held;       /* part was written; the sink waits for the rest */
 } FileMatch;
 
-/* Global statistics */
+/* Position of a work item in traversal order (ordered output only).
+ * Directories own their children in readdir order; the sink emits the
+ * tree depth-first as nodes complete. */
+typedef struct OrderNode {
+    struct OrderNode *parent;
+    struct OrderNode *first_child;
+    struct OrderNode *last_child;
+    struct OrderNode *next;
+    FileMatch out;
+    int done;
+} OrderNode;
+
+/* Output sink: collects finished buffers and writes them with writev */
+typedef struct {
+    int fd;
+    int ordered;
+    int failed;
+    int flushing;
+    int lead_separator;     /* drop the "--" before the first context group */
+    pthread_mutex_t lock;
+    FileMatch *holder;      /* file whose output is being written in parts */
+    pthread_cond_t released;
+    FileMatch *batch;
+    size_t batch_count;
+    size_t batch_cap;
+    size_t batch_bytes;
+    char **spare;           /* recycled buffers, all OUTPUT_BATCH_BYTES */
+    size_t spare_count;
+    size_t spare_cap;
+    OrderNode *cursor;      /* next node to emit in ordered mode */
+    long write_ns;          /* time in writev, by whoever flushed */
+    long write_calls;
+} OutputSink;
+
+/* --stats=detailed: where the time went, per worker and merged */
+enum { PHASE_TRAVERSE, PHASE_OPEN, PHASE_READ, PHASE_MATCH, PHASE_OUTPUT, 
+       PHASE_COUNT };
+enum { CALL_OPEN, CALL_STAT, CALL_READ, CALL_MMAP, CALL_DIRREAD, CALL_WRITE,
+       CALL_COUNT };
+static const char *const phase_names[PHASE_COUNT] = 
+    { "traverse", "open", "read", "match", "output" };
+static const char *const call_names[CALL_COUNT] = 
+    { "open", "stat", "read", "mmap", "dirread", "write" };
+
+#define LATENCY_BUCKETS 24      /* log2 of a work item's duration in us */
+#define TOP_SUBTREES 10
+
+typedef struct {
+    long phase_ns[PHASE_COUNT];
+    long calls[CALL_COUNT];
+    long latency[LATENCY_BUCKETS];
+    long items;
+    long busy_ns;
+} Profile;
+
+/* Slowest directories by total work time of everything below them */
+typedef struct {
+    long ns;
+    char path[MAX_PATH];
+} SlowSubtree;
+
+typedef struct {
+    Profile total;
+    Profile *threads;
+    int nthreads;
+    SlowSubtree slow[TOP_SUBTREES];
+    int nslow;
+    pthread_mutex_t slow_lock;
+} ProfileReport;
+
+/* Search statistics; each worker keeps its own copy, merged at the end */
 typedef struct {
     long files_searched;
     long files_matched;
     long total_matches;
-    long total_size;
-    time_t start_time;
+    long total_size;        /* bytes in searched files (after filters) */
+    long files_pruned;      /* skipped unopened thanks to the index */
+    long files_cached;      /* answered from --cache without reading */
+    long files_duplicate;   /* --dedup: inode already searched elsewhere */
+    int64_t start_ns;       /* CLOCK_MONOTONIC */
+    ProfileReport *report;  /* --stats=detailed only */
 } SearchStats;
 
+/* One line of a .gitignore/.ignore file */
+typedef struct {
+    const char *glob;
+    size_t len;
+    int flags;              /* IGNORE_* */
+} IgnoreRule;
+
+enum {
+    IGNORE_NEGATE = 1,      /* "!pattern" re-includes */
+    IGNORE_DIR_ONLY = 2,    /* "pattern/" */
+    IGNORE_ANCHORED = 4,    /* has a '/': matched against the relative path */
+    IGNORE_LITERAL = 8,     /* no wildcards: plain compare */
+    IGNORE_SUFFIX = 16      /* "*literal": compare the tail */
+};
+
+/* Rules read in one directory, chained to those in force above it. Owned
+ * by the DirNode they were read in; subdirectories share the pointer. */
+typedef struct IgnoreList {
+    struct IgnoreList *parent;
+    const struct DirNode *owner;
+    IgnoreRule *rules;
+    int count;
+    int anchored;           /* some rule needs the path below owner */
+    char *text;
+} IgnoreList;
+
+/* Bump allocator for one directory's entry names and child nodes. A
+ * directory's items all hold a reference on it, so everything they point
+ * into is released at once with the node. Blocks double in size up to
+ * the largest class and are recycled through per-worker caches. */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t cap;
+    int size_class;         /* -1 for an oversized one-off block */
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+} Arena;
+
+/* Directory in the walk. Entries are stored as (parent, name) and full
+ * paths are only joined when something has to be printed or opened by
+ * path. While children are pending the directory's fd stays open so
+ * they can be reached with openat()/fstatat(). */
+typedef struct DirNode {
+    struct DirNode *parent;
+    atomic_int refs;        /* own work item + queued children */
+    int fd;                 /* -1 when not held */
+    atomic_int fd_users;    /* enumeration + queued items opening via fd */
+    int depth;
+    IgnoreList *ignore;     /* innermost ignore rules, inherited */
+    atomic_long work_ns;    /* --stats=detailed: time spent in this subtree */
+    dev_t dev;              /* once classified; inherited until then */
+    int device;             /* pool->devices index + 1, 0 = local */
+    int classified;         /* dev, -x and the visited set checked */
+    Arena arena;            /* names of queued entries, child nodes */
+    size_t name_len;
+    char name[];            /* the root holds the start directory */
+} DirNode;
+
+/* A file to scan; path is joined lazily into the worker's path buffer */
+typedef struct {
+    DirNode *dir;
+    const char *name;
+    const char *path;
+    size_t path_len;
+} FileRef;
+
+/* Per-worker state while building an index */
+typedef struct {
+    char *path;             /* relative to the indexed directory */
+    struct stat st;
+    size_t tri_off;         /* into IndexBuilder.tris */
+    uint32_t tri_count;
+    uint32_t flags;
+    uint32_t old_id;        /* unchanged entry in the previous index */
+} IndexedFile;
+
+typedef struct {
+    IndexedFile *files;
+    size_t count;
+    size_t cap;
+    uint32_t *tris;         /* every file's sorted, unique trigrams */
+    size_t tri_count;
+    size_t tri_cap;
+    uint64_t *seen;         /* 2^24-bit scratch set, cleared after each file */
+    long reused;            /* files carried over from the previous index */
+} IndexBuilder;
+
+/* Unit of work: a directory to enumerate, one file or a batch of files
+ * from the same directory to scan, or a hand in scanning a large file */
+enum { WORK_DIR, WORK_FILE, WORK_BATCH, WORK_CHUNK };
+
+struct SplitFile;
+
+typedef struct {
+    int kind;
+    DirNode *dir;           /* the directory itself, or the file's parent */
+    const char *name;       /* file name in dir's arena (WORK_FILE only) */
+    const char **names;     /* WORK_BATCH: count names in dir's arena */
+    int count;
+    struct SplitFile *split;    /* WORK_CHUNK only */
+    OrderNode *slot;
+    int device;             /* set on push: device queue it went to, 0 = none */
+} WorkItem;
+
+/* Per-worker deque: the owner pushes and pops at the tail, thieves take
+ * from the head so they grab the oldest (usually largest) subtrees */
+typedef struct {
+    pthread_mutex_t lock;
+    WorkItem *items;
+    size_t head;
+    size_t count;
+    size_t cap;
+} WorkDeque;
+
+struct WorkPool;
+struct Uring;
+struct Prefetch;
+struct VisitedSet;
+struct DirScan;
+struct Decoder;
+
+typedef struct {
+    struct WorkPool *pool;
+    int id;
+    pthread_t thread;
+    unsigned int rng;
+    WorkDeque deque;
+    SearchStats stats;
+    FileMatch out;          /* pending output in unordered mode */
+    char *read_buf;         /* reused for files below MMAP_THRESHOLD */
+    size_t read_cap;
+    char *direct_buf;       /* --io=direct: DIRECT_ALIGN aligned block */
+    char *path_buf;         /* scratch for joined paths */
+    size_t path_cap;
+    char *dents_buf;        /* getdents64 backend */
+    char *line_buf;         /* regex lines, without REG_STARTEND */
+    size_t line_cap;
+    struct Uring *uring;    /* io_uring backend, NULL if unavailable */
+    struct Prefetch *prefetch;  /* files of the batch the ring opened */
+    struct DirScan *scan;   /* reused by search_directory() */
+    IndexBuilder *indexer;  /* --index build only */
+    int remote;             /* serves the device queues, not the deques */
+    char *cache_buf;        /* --cache records to append after the walk */
+    size_t cache_len;
+    size_t cache_cap;
+    long cache_stale;       /* of those, ones superseding a cached record */
+    struct Decoder *decoder;    /* -z only, reused across files */
+    Profile *profile;       /* --stats=detailed only */
+    ArenaBlock *free_blocks[ARENA_CLASSES];
+    int free_count[ARENA_CLASSES];
+} Worker;
+
+/* A network mount's queue; lock is unused, remote_lock guards it */
+typedef struct {
+    dev_t dev;
+    WorkDeque queue;
+    int busy;               /* items taken and not finished */
+} Device;
+
+/* Work-stealing pool shared by all workers */
+typedef struct WorkPool {
+    const SearchOptions *opts;
+    OutputSink *sink;
+    Worker *workers;
+    int nworkers;
+    atomic_long pending;    /* items pushed but not yet finished */
+    atomic_long queued;     /* items sitting in some deque */
+    atomic_int sleepers;
+    atomic_int held_fds;    /* directory fds kept open for children */
+    int max_held_fds;
+    atomic_long lines;      /* matching lines so far, for --max-total */
+    atomic_int stop;        /* limit reached: drain without working */
+    struct VisitedSet *visited; /* -L/--dedup: inodes reached so far */
+    dev_t root_dev;         /* -x: device of the start directory */
+    ProfileReport *report;  /* --stats=detailed only */
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    /* Network mounts: one queue per device, taken by the nremote workers
+     * after the first nworkers, at most device_jobs items of a device at
+     * once; all of it under remote_lock. nremote is 0 unless the mount
+     * table has a network mount within reach, and devices is allocated
+     * when the first one is entered. */
+    char **mounts;          /* mount points below the start, relative */
+    int nmounts;            /* -1: no mount table, check every directory */
+    Device *devices;        /* MAX_DEVICES of them */
+    int ndevices;
+    int nremote;
+    int remote_started;
+    int next_device;        /* where remote workers look first */
+    int device_jobs;
+    Worker *remote_workers;
+    pthread_mutex_t remote_lock;
+    pthread_cond_t remote_cond;
+} WorkPool;
+
 /* Function prototypes */
 void init_options(SearchOptions *opts);
 void parse_arguments(int argc, char *argv[], SearchOptions *opts);
-void search_directory(const char *path, int depth, 
-                     const SearchOptions *opts, SearchStats *stats);
-int search_file(const char *filename, const SearchOptions *opts, 
-               SearchStats *stats);
-int matches_pattern(const char *filename, const char *pattern);
+void compile_keywords(SearchOptions *opts);
+void free_keywords(SearchOptions *opts);
+void search_directory(DirNode *dir, const SearchOptions *opts, 
+                     Worker *worker, OrderNode *slot);
+int search_file(FileRef *file, const SearchOptions *opts, 
+               Worker *worker, FileMatch *out);
+void compile_filters(SearchOptions *opts);
+void free_filters(SearchOptions *opts);
+int index_file(FileRef *file, Worker *worker);
+int write_index(const SearchOptions *opts, Worker *workers, int nworkers,
+                long *files_out, long *trigrams_out);
+void watch_index(SearchOptions *opts);
+SearchIndex *load_index(const char *dir);
+void prepare_index(SearchIndex *index, const SearchOptions *opts);
+void free_index(SearchIndex *index);
+ResultCache *load_cache(const char *path, const SearchOptions *opts);
+int write_cache(ResultCache *cache, Worker *workers, int nworkers);
+void free_cache(ResultCache *cache);
+static void pool_push_item(Worker *worker, const WorkItem *work, int front);
+void run_search(const SearchOptions *opts, SearchStats *stats);
 void print_help(void);
 void print_stats(const SearchStats *stats);
+void print_profile(const SearchStats *stats);
+void print_stats_json(const SearchStats *stats);
+
+/* Monotonic clock in nanoseconds */
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Profiling hooks: free when --stats=detailed is off */
+static inline int64_t phase_start(const Profile *profile) {
+    return profile ? now_ns() : 0;
+}
+
+static inline void phase_end(Profile *profile, int phase, int64_t started) {
+    if (profile) profile->phase_ns[phase] += (long)(now_ns() - started);
+}
+
+static inline void count_call(Profile *profile, int call) {
+    if (profile) profile->calls[call]++;
+}
 
 /* Safe case-insensitive comparison */
 int strcasecmp_safe(const char *s1, const char *s2) {
@@ -92,6 +703,251 @@ const char *strstr_case(const char *haystack, const char *needle) {
     return NULL;
 }
 
+/* ASCII lower-case table shared by the case-insensitive kernels */
+static unsigned char fold_table[256];
+
+static void init_fold_table(void) {
+    for (int c = 0; c < 256; c++) {
+        fold_table[c] = (unsigned char)tolower(c);
+    }
+}
+
+/* Compare needle bytes [1, len - 1) against a candidate, ignoring case */
+static int middle_equal_case(const unsigned char *h, const unsigned char *n,
+                             size_t len) {
+    for (size_t j = 1; j + 1 < len; j++) {
+        if (fold_table[h[j]] != n[j]) return 0;
+    }
+    return 1;
+}
+
+/* Portable case-insensitive search over a byte range; the needle must
+ * already be folded. Same algorithm as strstr_case() without the NUL
+ * terminator, and the fallback for the SIMD kernels below. */
+static const char *find_bytes_case(const char *hay, size_t hay_len,
+                                   const char *needle, size_t needle_len) {
+    const unsigned char *h = (const unsigned char *)hay;
+    const unsigned char *n = (const unsigned char *)needle;
+    
+    if (needle_len == 0 || needle_len > hay_len) return NULL;
+    
+    for (size_t i = 0; i + needle_len <= hay_len; i++) {
+        if (fold_table[h[i]] != n[0] || 
+            fold_table[h[i + needle_len - 1]] != n[needle_len - 1]) {
+            continue;
+        }
+        if (middle_equal_case(h + i, n, needle_len)) return hay + i;
+    }
+    return NULL;
+}
+
+#ifdef WALK_X86_SIMD
+/* Fold ASCII upper case in a vector: bytes in 'A'..'Z' get 0x20 set.
+ * Shifting by 128 - 'A' moves the range to the bottom of signed bytes. */
+static inline __m128i fold_sse2(__m128i v) {
+    __m128i shifted = _mm_add_epi8(v, _mm_set1_epi8((char)(128 - 'A')));
+    __m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(-128 + 26)));
+    return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+/* SSE2 kernel: filter candidates on the folded first and last bytes,
+ * 16 positions at a time, then verify the middle */
+static const char *find_bytes_case_sse2(const char *hay, size_t hay_len,
+                                        const char *needle, size_t needle_len) {
+    const unsigned char *n = (const unsigned char *)needle;
+    
+    if (needle_len == 0 || needle_len > hay_len) return NULL;
+    
+    __m128i first = _mm_set1_epi8((char)n[0]);
+    __m128i last = _mm_set1_epi8((char)n[needle_len - 1]);
+    size_t i = 0;
+    
+    for (; i + needle_len - 1 + 16 <= hay_len; i += 16) {
+        __m128i a = fold_sse2(_mm_loadu_si128((const __m128i *)(hay + i)));
+        __m128i b = fold_sse2(_mm_loadu_si128(
+            (const __m128i *)(hay + i + needle_len - 1)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            const unsigned char *h = (const unsigned char *)hay + i + bit;
+            if (middle_equal_case(h, n, needle_len)) return (const char *)h;
+            mask &= mask - 1;
+        }
+    }
+    
+    const char *tail = find_bytes_case(hay + i, hay_len - i, needle, needle_len);
+    return tail;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i fold_avx2(__m256i v) {
+    __m256i shifted = _mm256_add_epi8(v, _mm256_set1_epi8((char)(128 - 'A')));
+    __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(-128 + 26)), 
+                                      shifted);
+    return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+/* AVX2 kernel: as the SSE2 one, 32 positions at a time */
+__attribute__((target("avx2")))
+static const char *find_bytes_case_avx2(const char *hay, size_t hay_len,
+                                        const char *needle, size_t needle_len) {
+    const unsigned char *n = (const unsigned char *)needle;
+    
+    if (needle_len == 0 || needle_len > hay_len) return NULL;
+    
+    __m256i first = _mm256_set1_epi8((char)n[0]);
+    __m256i last = _mm256_set1_epi8((char)n[needle_len - 1]);
+    size_t i = 0;
+    
+    for (; i + needle_len - 1 + 32 <= hay_len; i += 32) {
+        __m256i a = fold_avx2(_mm256_loadu_si256((const __m256i *)(hay + i)));
+        __m256i b = fold_avx2(_mm256_loadu_si256(
+            (const __m256i *)(hay + i + needle_len - 1)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first), 
+                             _mm256_cmpeq_epi8(b, last)));
+        
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            const unsigned char *h = (const unsigned char *)hay + i + bit;
+            if (middle_equal_case(h, n, needle_len)) return (const char *)h;
+            mask &= mask - 1;
+        }
+    }
+    
+    return find_bytes_case_sse2(hay + i, hay_len - i, needle, needle_len);
+}
+#endif
+
+#ifdef WALK_NEON_SIMD
+static inline uint8x16_t fold_neon(uint8x16_t v) {
+    uint8x16_t upper = vcltq_u8(vsubq_u8(v, vdupq_n_u8('A')), vdupq_n_u8(26));
+    return vorrq_u8(v, vandq_u8(upper, vdupq_n_u8(0x20)));
+}
+
+/* NEON kernel: first/last byte filter, 16 positions at a time */
+static const char *find_bytes_case_neon(const char *hay, size_t hay_len,
+                                        const char *needle, size_t needle_len) {
+    const unsigned char *n = (const unsigned char *)needle;
+    const unsigned char *h = (const unsigned char *)hay;
+    
+    if (needle_len == 0 || needle_len > hay_len) return NULL;
+    
+    uint8x16_t first = vdupq_n_u8(n[0]);
+    uint8x16_t last = vdupq_n_u8(n[needle_len - 1]);
+    size_t i = 0;
+    
+    for (; i + needle_len - 1 + 16 <= hay_len; i += 16) {
+        uint8x16_t a = fold_neon(vld1q_u8(h + i));
+        uint8x16_t b = fold_neon(vld1q_u8(h + i + needle_len - 1));
+        uint8x16_t eq = vandq_u8(vceqq_u8(a, first), vceqq_u8(b, last));
+        
+        /* Narrow to one nibble per byte to get a 64-bit candidate mask */
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+            vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        while (mask) {
+            int bit = __builtin_ctzll(mask) >> 2;
+            if (middle_equal_case(h + i + bit, n, needle_len)) {
+                return hay + i + bit;
+            }
+            mask &= ~(0xfULL << (bit * 4));
+        }
+    }
+    
+    return find_bytes_case(hay + i, hay_len - i, needle, needle_len);
+}
+#endif
+
+/* Pick the fastest case-insensitive kernel this CPU supports */
+static const char *(*select_find_case(void))(const char *, size_t, 
+                                             const char *, size_t) {
+    init_fold_table();
+#ifdef WALK_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return find_bytes_case_avx2;
+    if (__builtin_cpu_supports("sse2")) return find_bytes_case_sse2;
+#endif
+#ifdef WALK_NEON_SIMD
+    return find_bytes_case_neon;
+#endif
+    return find_bytes_case;
+}
+
+static long count_newlines(const char *p, const char *end);
+
+#ifdef WALK_X86_SIMD
+/* Newline counting: compare 16 or 32 bytes at a time and subtract the
+ * 0xff results into byte counters, folded with SAD before they can wrap */
+static long count_newlines_sse2(const char *p, const char *end) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    long count = 0;
+    
+    while (end - p >= 16) {
+        __m128i acc = zero;
+        for (int n = 0; n < 255 && end - p >= 16; n++, p += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)p);
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+        }
+        __m128i sums = _mm_sad_epu8(acc, zero);
+        count += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+    }
+    return count + count_newlines(p, end);
+}
+
+__attribute__((target("avx2")))
+static long count_newlines_avx2(const char *p, const char *end) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    long count = 0;
+    
+    while (end - p >= 32) {
+        __m256i acc = zero;
+        for (int n = 0; n < 255 && end - p >= 32; n++, p += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)p);
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+        }
+        __m256i sad = _mm256_sad_epu8(acc, zero);
+        __m128i sums = _mm_add_epi64(_mm256_castsi256_si128(sad),
+                                     _mm256_extracti128_si256(sad, 1));
+        count += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+    }
+    return count + count_newlines(p, end);
+}
+#endif
+
+#ifdef WALK_NEON_SIMD
+static long count_newlines_neon(const char *p, const char *end) {
+    const uint8x16_t nl = vdupq_n_u8('\n');
+    long count = 0;
+    
+    while (end - p >= 16) {
+        uint8x16_t acc = vdupq_n_u8(0);
+        for (int n = 0; n < 255 && end - p >= 16; n++, p += 16) {
+            acc = vsubq_u8(acc, vceqq_u8(vld1q_u8((const uint8_t *)p), nl));
+        }
+        uint64x2_t sums = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(acc)));
+        count += (long)(vgetq_lane_u64(sums, 0) + vgetq_lane_u64(sums, 1));
+    }
+    return count + count_newlines(p, end);
+}
+#endif
+
+/* Pick the fastest newline counter this CPU supports */
+static long (*select_count_newlines(void))(const char *, const char *) {
+#ifdef WALK_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return count_newlines_avx2;
+    if (__builtin_cpu_supports("sse2")) return count_newlines_sse2;
+#endif
+#ifdef WALK_NEON_SIMD
+    return count_newlines_neon;
+#endif
+    return count_newlines;
+}
+
 /* Initialize default options */
 void init_options(SearchOptions *opts) {
     memset(opts, 0, sizeof(SearchOptions));
@@ -106,10 +962,241 @@ void init_options(SearchOptions *opts) {
     opts->count_only = 0;
     opts->min_size = 0;
     opts->max_size = -1;
-    opts->file_pattern[0] = '\0';
+    opts->jobs = 0;
+    opts->ordered_output = 0;
+    opts->backend = WALK_DEFAULT_BACKEND;
+    opts->order = ORDER_DFS;
+    opts->max_open_dirs = -1;
+    opts->binary_mode = BINARY_SUMMARY;
+    opts->io_mode = IO_NORMAL;
+    opts->remote_jobs = REMOTE_JOBS;
+    opts->device_jobs = DEVICE_JOBS;
+    opts->use_ignore = 1;
+    opts->include_count = 0;
+    opts->exclude_count = 0;
+    opts->max_count = 0;
+    opts->before_context = 0;
+    opts->after_context = 0;
+    opts->context = 0;
+    opts->max_total = 0;
+    opts->quiet = 0;
+    opts->detailed_stats = 0;
+    opts->json = 0;
+    opts->decompress = 0;
     strcpy(opts->start_dir, ".");
 }
 
+/* Bad arguments end the program; in libwalk they only fail the
+ * walk_compile() call that passed them */
+#ifdef WALK_LIBRARY
+static _Thread_local jmp_buf *compile_abort;
+#endif
+
+static _Noreturn void argument_exit(int status) {
+#ifdef WALK_LIBRARY
+    if (compile_abort) longjmp(*compile_abort, 1);
+#endif
+    exit(status);
+}
+
+/* Append a keyword, or with regex set a -e pattern */
+static void add_keyword(SearchOptions *opts, const char *text, int regex) {
+    if (opts->keyword_count >= MAX_KEYWORDS) return;
+    
+    int k = opts->keyword_count++;
+    strncpy(opts->keywords[k], text, 255);
+    opts->keywords[k][255] = '\0';
+    opts->keyword_len[k] = strlen(opts->keywords[k]);
+    if (regex) opts->regex_keywords |= 1u << k;
+}
+
+/* Append a -f/--exclude pattern */
+static void add_filter(char list[][256], int *count, const char *pattern) {
+    if (*count >= MAX_FILTERS) {
+        fprintf(stderr, "Error: At most %d patterns per option\n", MAX_FILTERS);
+        argument_exit(EXIT_FAILURE);
+    }
+    strncpy(list[*count], pattern, 255);
+    list[*count][255] = '\0';
+    (*count)++;
+}
+
+/* Parse a --long option; returns 0 if it is not one we know */
+static int parse_long_option(int argc, char *argv[], int *i, 
+                             SearchOptions *opts) {
+    const char *arg = argv[*i];
+    
+    if (strcmp(arg, "--exclude") == 0 || strncmp(arg, "--exclude=", 10) == 0) {
+        if (arg[9] == '=') {
+            add_filter(opts->exclude, &opts->exclude_count, arg + 10);
+        } else if (*i + 1 < argc) {
+            add_filter(opts->exclude, &opts->exclude_count, argv[++*i]);
+        }
+        return 1;
+    }
+    
+    if (strncmp(arg, "--stats=", 8) == 0) {
+        if (strcmp(arg + 8, "detailed") == 0) {
+            opts->detailed_stats = 1;
+        } else if (strcmp(arg + 8, "basic") == 0) {
+            opts->detailed_stats = 0;
+        } else {
+            return 0;
+        }
+        return 1;
+    }
+    
+    if (strcmp(arg, "--json") == 0) {
+        opts->json = 1;
+        return 1;
+    }
+    
+    if (strcmp(arg, "--first") == 0) {
+        opts->max_total = 1;
+        return 1;
+    }
+    
+    if (strcmp(arg, "--max-total") == 0 || strncmp(arg, "--max-total=", 12) == 0) {
+        if (arg[11] == '=') {
+            opts->max_total = atol(arg + 12);
+        } else if (*i + 1 < argc) {
+            opts->max_total = atol(argv[++*i]);
+        }
+        return 1;
+    }
+    
+    if (strcmp(arg, "--cache") == 0 || strncmp(arg, "--cache=", 8) == 0) {
+        const char *file = arg[7] == '=' ? arg + 8 : *i + 1 < argc ? argv[++*i] : "";
+        if (!file[0] || strlen(file) >= MAX_PATH) {
+            fprintf(stderr, "Error: --cache needs a file name\n");
+            argument_exit(EXIT_FAILURE);
+        }
+        strcpy(opts->cache_file, file);
+        return 1;
+    }
+    
+    if (strncmp(arg, "--io=", 5) == 0) {
+        if (strcmp(arg + 5, "normal") == 0) {
+            opts->io_mode = IO_NORMAL;
+        } else if (strcmp(arg + 5, "nocache") == 0) {
+            opts->io_mode = IO_NOCACHE;
+        } else if (strcmp(arg + 5, "direct") == 0) {
+            opts->io_mode = IO_DIRECT;
+        } else {
+            return 0;
+        }
+        return 1;
+    }
+    
+    if (strcmp(arg, "--no-cache-pollution") == 0) {
+        opts->io_mode = IO_NOCACHE;
+        return 1;
+    }
+    
+    if (strcmp(arg, "--one-file-system") == 0) {
+        opts->one_file_system = 1;
+        return 1;
+    }
+    
+    if (strcmp(arg, "--remote-jobs") == 0 || strncmp(arg, "--remote-jobs=", 14) == 0 ||
+        strcmp(arg, "--device-jobs") == 0 || strncmp(arg, "--device-jobs=", 14) == 0) {
+        const char *value = arg[13] == '=' ? arg + 14 : 
+                            *i + 1 < argc ? argv[++*i] : NULL;
+        int remote = arg[2] == 'r';
+        if (!value || atoi(value) < (remote ? 0 : 1)) {
+            fprintf(stderr, "Error: %.13s needs a count\n", arg);
+            argument_exit(EXIT_FAILURE);
+        }
+        if (remote) {
+            opts->remote_jobs = atoi(value);
+        } else {
+            opts->device_jobs = atoi(value);
+        }
+        return 1;
+    }
+    
+    if (strcmp(arg, "--dedup") == 0) {
+        opts->dedup = 1;
+        return 1;
+    }
+    
+    if (strcmp(arg, "--no-ignore") == 0) {
+        opts->use_ignore = 0;
+        return 1;
+    }
+    
+    if (strcmp(arg, "--index") == 0) {
+        const char *mode = *i + 1 < argc ? argv[*i + 1] : "";
+        if (strcmp(mode, "build") == 0) {
+            opts->index_mode = INDEX_BUILD;
+            (*i)++;
+        } else if (strcmp(mode, "update") == 0) {
+            opts->index_mode = INDEX_UPDATE;
+            (*i)++;
+        } else if (strcmp(mode, "watch") == 0) {
+            opts->index_mode = INDEX_WATCH;
+            (*i)++;
+        } else {
+            opts->index_mode = INDEX_QUERY;
+        }
+        if (*i + 1 >= argc) {
+            fprintf(stderr, "Error: --index needs a directory\n");
+            argument_exit(EXIT_FAILURE);
+        }
+        strncpy(opts->start_dir, argv[++*i], sizeof(opts->start_dir) - 1);
+        return 1;
+    }
+    
+    if (strncmp(arg, "--order=", 8) == 0) {
+        if (strcmp(arg + 8, "dfs") == 0) {
+            opts->order = ORDER_DFS;
+        } else if (strcmp(arg + 8, "bfs") == 0) {
+            opts->order = ORDER_BFS;
+        } else {
+            return 0;
+        }
+        return 1;
+    }
+    
+    if (strcmp(arg, "--max-open-dirs") == 0 || 
+        strncmp(arg, "--max-open-dirs=", 16) == 0) {
+        const char *value = arg[15] == '=' ? arg + 16 : 
+                            *i + 1 < argc ? argv[++*i] : NULL;
+        if (!value || atoi(value) < 0) {
+            fprintf(stderr, "Error: --max-open-dirs needs a count\n");
+            argument_exit(EXIT_FAILURE);
+        }
+        opts->max_open_dirs = atoi(value);
+        return 1;
+    }
+    
+    if (strncmp(arg, "--backend=", 10) == 0) {
+        const char *name = arg + 10;
+        if (strcmp(name, "posix") == 0) {
+            opts->backend = BACKEND_POSIX;
+        } else if (strcmp(name, "getdents") == 0) {
+#ifdef WALK_HAVE_GETDENTS
+            opts->backend = BACKEND_GETDENTS;
+#else
+            fprintf(stderr, "Error: getdents backend not available\n");
+            argument_exit(EXIT_FAILURE);
+#endif
+        } else if (strcmp(name, "uring") == 0) {
+#ifdef WALK_HAVE_IO_URING
+            opts->backend = BACKEND_URING;
+#else
+            fprintf(stderr, "Error: io_uring backend not available\n");
+            argument_exit(EXIT_FAILURE);
+#endif
+        } else {
+            return 0;
+        }
+        return 1;
+    }
+    
+    return 0;
+}
+
 /* Parse command line arguments safely */
 void parse_arguments(int argc, char *argv[], SearchOptions *opts) {
     int i = 1;
@@ -132,10 +1219,61 @@ void parse_arguments(int argc, char *argv[], SearchOptions *opts) {
                 case 'n': 
                     opts->show_line_numbers = 1; 
                     break;
+                case 'N':
+                    opts->show_line_numbers = 0;
+                    break;
+                case 'O':
+                    opts->ordered_output = 1;
+                    break;
+                case 'e':
+                    if (i + 1 < argc) {
+                        add_keyword(opts, argv[++i], 1);
+                    }
+                    break;
+                case 'm':
+                    if (i + 1 < argc) {
+                        opts->max_count = atol(argv[++i]);
+                    }
+                    break;
+                case 'A':
+                case 'B':
+                case 'C':
+                    if (i + 1 < argc) {
+                        char which = argv[i][1];
+                        long n = atol(argv[++i]);
+                        if (n < 0) {
+                            fprintf(stderr, "Error: Invalid context length: %s\n", 
+                                    argv[i]);
+                            argument_exit(EXIT_FAILURE);
+                        }
+                        if (which != 'A') opts->before_context = n;
+                        if (which != 'B') opts->after_context = n;
+                        opts->context = 1;
+                    }
+                    break;
+                case 'q':
+                    opts->quiet = 1;
+                    opts->count_only = 1;
+                    opts->max_total = 1;
+                    break;
+                case 'a':
+                    opts->binary_mode = BINARY_TEXT;
+                    break;
+                case 'z':
+                    opts->decompress = 1;
+                    break;
+                case 'L':
+                    opts->follow_links = 1;
+                    break;
+                case 'x':
+                    opts->one_file_system = 1;
+                    break;
+                case 'I':
+                    opts->binary_mode = BINARY_SKIP;
+                    break;
                 case 'f': 
                     if (i + 1 < argc) {
-                        strncpy(opts->file_pattern, argv[++i], 
-                                sizeof(opts->file_pattern) - 1);
+                        add_filter(opts->include, &opts->include_count, argv[++i]);
                     }
                     break;
                 case 'd':
@@ -153,18 +1291,33 @@ void parse_arguments(int argc, char *argv[], SearchOptions *opts) {
                         opts->max_size = atol(argv[++i]);
                     }
                     break;
+                case 'j':
+                    if (i + 1 < argc) {
+                        opts->jobs = atoi(argv[++i]);
+                    }
+                    break;
+                case '-':
+                    if (!parse_long_option(argc, argv, &i, opts)) {
+                        fprintf(stderr, "Unknown option: %s\n", argv[i]);
+                        print_help();
+                        argument_exit(EXIT_FAILURE);
+                    }
+                    break;
                 case 'h':
                     print_help();
-                    exit(EXIT_SUCCESS);
+                    argument_exit(EXIT_SUCCESS);
                 default:
                     fprintf(stderr, "Unknown option: %s\n", argv[i]);
                     print_help();
-                    exit(EXIT_FAILURE);
+                    argument_exit(EXIT_FAILURE);
             }
             i++;
         } else {
             /* First non-option argument could be directory */
-            if (opts->keyword_count == 0 && access(argv[i], F_OK) == 0) {
+            int positional = opts->keyword_count - 
+                             __builtin_popcount(opts->regex_keywords);
+            if (positional == 0 && opts->index_mode == INDEX_NONE &&
+                access(argv[i], F_OK) == 0) {
                 struct stat st;
                 if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
                     strncpy(opts->start_dir, argv[i], sizeof(opts->start_dir) - 1);
@@ -174,202 +1327,4976 @@ void parse_arguments(int argc, char *argv[], SearchOptions *opts) {
             }
             
             /* Otherwise, treat as keyword */
-            if (opts->keyword_count < MAX_KEYWORDS) {
-                strncpy(opts->keywords[opts->keyword_count], argv[i], 255);
-                opts->keywords[opts->keyword_count][255] = '\0';
-                opts->keyword_count++;
-            }
+            add_keyword(opts, argv[i], 0);
             i++;
         }
     }
     
-    if (opts->keyword_count == 0) {
+    if (opts->keyword_count == 0 && (opts->index_mode == INDEX_NONE ||
+                                     opts->index_mode == INDEX_QUERY)) {
         fprintf(stderr, "Error: No keywords specified\n");
         print_help();
-        exit(EXIT_FAILURE);
+        argument_exit(EXIT_FAILURE);
     }
 }
 
-/* Check if filename matches pattern */
-int matches_pattern(const char *filename, const char *pattern) {
-    if (!filename || !pattern) return 0;
-    if (pattern[0] == '\0') return 1;
-    
-    const char *basename = strrchr(filename, '/');
-    basename = basename ? basename + 1 : filename;
-    
-    /* Simple wildcard matching */
-    if (pattern[0] == '*' && pattern[1] == '.') {
-        const char *ext = strrchr(basename, '.');
-        if (!ext) return 0;
-        return strcasecmp_safe(ext + 1, pattern + 2) == 0;
+/* Skip one bracket expression starting at p ('['); returns the byte
+ * after its ']' or end if it is unterminated */
+static const char *skip_bracket(const char *p, const char *end) {
+    p++;
+    if (p < end && *p == '^') p++;
+    if (p < end && *p == ']') p++;
+    while (p < end && *p != ']') {
+        if (*p == '[' && p + 1 < end && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+            char close = p[1];
+            p += 2;
+            while (p + 1 < end && !(p[0] == close && p[1] == ']')) p++;
+            p += 2;
+        } else {
+            p++;
+        }
     }
-    
-    return strcasecmp_safe(basename, pattern) == 0;
+    return p < end ? p + 1 : end;
 }
 
-/* Search a single file safely */
-int search_file(const char *filename, const SearchOptions *opts, 
-               SearchStats *stats) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        return 0;
-    }
+/* Longest literal that every match of one alternative must contain; the
+ * scan is conservative: anything it does not understand ends a run */
+static size_t branch_literal(const char *p, const char *end, char *best) {
+    char run[256];
+    size_t run_len = 0, best_len = 0;
     
-    /* Check file size constraints */
-    struct stat st;
-    if (fstat(fileno(file), &st) == 0) {
-        stats->total_size += st.st_size;
+    while (p < end) {
+        int literal = 0;
+        char c = 0;
         
-        if ((opts->min_size > 0 && st.st_size < opts->min_size) ||
-            (opts->max_size >= 0 && st.st_size > opts->max_size)) {
-            fclose(file);
-            return 0;
-        }
-    }
-    
-    /* Check filename pattern */
-    if (opts->file_pattern[0] && !matches_pattern(filename, opts->file_pattern)) {
-        fclose(file);
+        if (*p == '\\' && p + 1 < end) {
+            literal = ispunct((unsigned char)p[1]) != 0;
+            c = p[1];
+            p += 2;
+        } else if (*p == '[') {
+            p = skip_bracket(p, end);
+        } else if (*p == '(') {
+            int depth = 0;
+            for (; p < end; p++) {
+                if (*p == '\\' && p + 1 < end) {
+                    p++;
+                } else if (*p == '[') {
+                    p = skip_bracket(p, end) - 1;
+                } else if (*p == '(') {
+                    depth++;
+                } else if (*p == ')' && --depth == 0) {
+                    p++;
+                    break;
+                }
+            }
+        } else if (*p == '.' || *p == '^' || *p == '$') {
+            p++;
+        } else {
+            literal = 1;
+            c = *p++;
+        }
+        
+        /* A quantifier decides whether the atom is required at all */
+        int optional = 0, repeated = 0;
+        if (p < end && (*p == '*' || *p == '?')) {
+            optional = 1;
+            p++;
+        } else if (p < end && *p == '+') {
+            repeated = 1;
+            p++;
+        } else if (p < end && *p == '{') {
+            optional = p + 1 < end && (p[1] == '0' || p[1] == ',');
+            repeated = !optional;
+            const char *close = memchr(p, '}', (size_t)(end - p));
+            p = close ? close + 1 : end;
+        }
+        
+        if (literal && !optional && run_len < sizeof(run) - 1) {
+            run[run_len++] = c;
+        }
+        if (!literal || optional || repeated) {
+            if (run_len > best_len) {
+                memcpy(best, run, run_len);
+                best_len = run_len;
+            }
+            run_len = 0;
+        }
+    }
+    if (run_len > best_len) {
+        memcpy(best, run, run_len);
+        best_len = run_len;
+    }
+    return best_len;
+}
+
+/* Add the literals that prefilter regex keyword k, one per top-level
+ * alternative. Returns 0 if some alternative has none, in which case
+ * every line has to go to regexec(). */
+static int regex_literals(KeywordMatcher *m, const char *re, size_t len, int k) {
+    const char *end = re + len, *start = re;
+    int depth = 0, first = m->nlits;
+    
+    for (const char *p = re; p <= end; p++) {
+        if (p < end && *p == '\\' && p + 1 < end) {
+            p++;
+            continue;
+        }
+        if (p < end && *p == '[') {
+            p = skip_bracket(p, end) - 1;
+            continue;
+        }
+        if (p < end && *p == '(') depth++;
+        if (p < end && *p == ')') depth--;
+        if (p < end && (*p != '|' || depth > 0)) continue;
+        
+        MatcherLiteral *lit = &m->lits[m->nlits];
+        if (m->nlits == MAX_LITERALS ||
+            (lit->len = branch_literal(start, p, lit->text)) == 0) {
+            m->nlits = first;
+            return 0;
+        }
+        lit->slot = k;
+        m->nlits++;
+        start = p + 1;
+    }
+    return 1;
+}
+
+/* Build the keyword automaton once, before the walk starts */
+void compile_keywords(SearchOptions *opts) {
+    KeywordMatcher *m = calloc(1, sizeof(KeywordMatcher));
+    size_t max_states = 1;
+    
+    if (!m) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int k = 0; k < opts->keyword_count; k++) {
+        const char *kw = opts->keywords[k];
+        size_t len = opts->keyword_len[k];
+        
+        if (!(opts->regex_keywords & (1u << k))) {
+            /* Lines never span '\n', so such keywords never match */
+            if (memchr(kw, '\n', len)) continue;
+            if (len == 0) {
+                m->every_line |= 1u << k;
+                continue;
+            }
+            memcpy(m->lits[m->nlits].text, kw, len);
+            m->lits[m->nlits].len = len;
+            m->lits[m->nlits].slot = k;
+            m->nlits++;
+            continue;
+        }
+        
+        int flags = REG_EXTENDED | REG_NEWLINE | REG_NOSUB |
+                    (opts->case_sensitive ? 0 : REG_ICASE);
+        int err = regcomp(&m->regex[k], kw, flags);
+        if (err != 0) {
+            char msg[256];
+            regerror(err, &m->regex[k], msg, sizeof(msg));
+            fprintf(stderr, "Error: Bad regex \"%s\": %s\n", kw, msg);
+            opts->matcher = m;      /* for free_keywords() in libwalk */
+            argument_exit(EXIT_FAILURE);
+        }
+        m->regex_mask |= 1u << k;
+        if (!regex_literals(m, kw, len, k)) {
+            m->every_line |= 1u << k;
+        }
+    }
+    
+    /* Class 0 is every byte that appears in no literal */
+    m->nclasses = 1;
+    for (int j = 0; j < m->nlits; j++) {
+        max_states += m->lits[j].len;
+        for (size_t i = 0; i < m->lits[j].len; i++) {
+            unsigned char c = (unsigned char)m->lits[j].text[i];
+            if (m->byte_class[c]) continue;
+            
+            if (opts->case_sensitive) {
+                m->byte_class[c] = (unsigned char)m->nclasses++;
+            } else {
+                unsigned char lo = (unsigned char)tolower(c);
+                unsigned char up = (unsigned char)toupper(c);
+                m->byte_class[lo] = m->byte_class[up] = (unsigned char)m->nclasses++;
+            }
+        }
+    }
+    
+    size_t width = (size_t)m->nclasses;
+    int32_t *fail = malloc(max_states * sizeof(int32_t));
+    int32_t *queue = malloc(max_states * sizeof(int32_t));
+    m->next = malloc(max_states * width * sizeof(int32_t));
+    m->out = calloc(max_states, sizeof(uint32_t));
+    if (!fail || !queue || !m->next || !m->out) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    /* Trie of all literals */
+    m->nstates = 1;
+    for (size_t c = 0; c < width; c++) m->next[c] = -1;
+    for (int j = 0; j < m->nlits; j++) {
+        const char *kw = m->lits[j].text;
+        size_t len = m->lits[j].len;
+        
+        if (memchr(kw, '\n', len)) continue;
+        
+        int32_t state = 0;
+        for (size_t i = 0; i < len; i++) {
+            int32_t *slot = &m->next[(size_t)state * width + 
+                                     m->byte_class[(unsigned char)kw[i]]];
+            if (*slot < 0) {
+                *slot = m->nstates;
+                for (size_t c = 0; c < width; c++) {
+                    m->next[(size_t)m->nstates * width + c] = -1;
+                }
+                m->nstates++;
+            }
+            state = *slot;
+        }
+        m->out[state] |= 1u << m->lits[j].slot;
+    }
+    
+    /* Breadth-first failure links, folded straight into the DFA */
+    size_t head = 0, tail = 0;
+    for (size_t c = 0; c < width; c++) {
+        int32_t t = m->next[c];
+        if (t < 0) {
+            m->next[c] = 0;
+        } else {
+            fail[t] = 0;
+            queue[tail++] = t;
+        }
+    }
+    while (head < tail) {
+        int32_t s = queue[head++];
+        m->out[s] |= m->out[fail[s]];
+        for (size_t c = 0; c < width; c++) {
+            int32_t *slot = &m->next[(size_t)s * width + c];
+            int32_t via_fail = m->next[(size_t)fail[s] * width + c];
+            if (*slot < 0) {
+                *slot = via_fail;
+            } else {
+                fail[*slot] = via_fail;
+                queue[tail++] = *slot;
+            }
+        }
+    }
+    
+    /* Pre-multiply targets into row offsets and flag accepting ones */
+    for (size_t i = 0; i < (size_t)m->nstates * width; i++) {
+        int32_t t = m->next[i];
+        m->next[i] = m->out[t] ? -(int32_t)((size_t)t * width) - 1
+                               : (int32_t)((size_t)t * width);
+    }
+    
+    free(fail);
+    free(queue);
+    
+    m->single = m->nlits == 1 && !m->every_line &&
+                !memchr(m->lits[0].text, '\n', m->lits[0].len);
+    m->find_case = select_find_case();
+    m->count_newlines = select_count_newlines();
+    
+    /* The case-insensitive kernels expect a folded needle */
+    if (!opts->case_sensitive) {
+        for (size_t i = 0; i < m->lits[0].len; i++) {
+            m->folded[i] = (char)fold_table[(unsigned char)m->lits[0].text[i]];
+        }
+    }
+    opts->matcher = m;
+}
+
+void free_keywords(SearchOptions *opts) {
+    if (!opts->matcher) return;
+    for (int k = 0; k < opts->keyword_count; k++) {
+        if (opts->matcher->regex_mask & (1u << k)) regfree(&opts->matcher->regex[k]);
+    }
+    free(opts->matcher->next);
+    free(opts->matcher->out);
+    free(opts->matcher);
+    opts->matcher = NULL;
+}
+
+/* Run the automaton from *state (a row offset); returns the offset of
+ * the first byte that completes a keyword (its set in *mask), or len */
+static size_t matcher_run(const KeywordMatcher *m, const char *buf,
+                          size_t pos, size_t len, int32_t *state,
+                          uint32_t *mask) {
+    const unsigned char *p = (const unsigned char *)buf;
+    const unsigned char *byte_class = m->byte_class;
+    const int32_t *next = m->next;
+    int32_t s = *state;
+    
+    for (; pos < len; pos++) {
+        int32_t t = next[s + byte_class[p[pos]]];
+        if (t < 0) {
+            s = -(t + 1);
+            *mask = m->out[s / m->nclasses];
+            break;
+        }
+        s = t;
+    }
+    
+    *state = s;
+    return pos;
+}
+
+/* glob_match() flags */
+#define GLOB_PATHNAME 1     /* '*', '?' and classes never match '/' */
+#define GLOB_CASEFOLD 2
+
+/* Match one [...] class at *p against c; advances *p past it. Returns -1
+ * if the class is unterminated, so the caller can take '[' literally. */
+static int glob_class(const char **p, const char *end, unsigned char c, int flags) {
+    const char *q = *p + 1;
+    int negate = 0, found = 0;
+    
+    if (q < end && (*q == '!' || *q == '^')) {
+        negate = 1;
+        q++;
+    }
+    if (flags & GLOB_CASEFOLD) c = (unsigned char)tolower(c);
+    
+    /* A ']' right after the opening bracket is a member */
+    for (const char *first = q; q < end && (*q != ']' || q == first); ) {
+        unsigned char lo = (unsigned char)*q++, hi;
+        if (lo == '\\' && q < end) lo = (unsigned char)*q++;
+        hi = lo;
+        if (q + 1 < end && *q == '-' && q[1] != ']') {
+            hi = (unsigned char)q[1];
+            q += 2;
+            if (hi == '\\' && q < end) hi = (unsigned char)*q++;
+        }
+        if (flags & GLOB_CASEFOLD) {
+            lo = (unsigned char)tolower(lo);
+            hi = (unsigned char)tolower(hi);
+        }
+        if (c >= lo && c <= hi) found = 1;
+    }
+    if (q >= end) return -1;
+    
+    *p = q + 1;
+    return found != negate;
+}
+
+/* Shell-style glob over byte ranges: '*', '?', '[...]', '\' escapes, and
+ * with GLOB_PATHNAME also '**', which spans directories ("**" + "/"
+ * matches zero or more whole leading directories) */
+static int glob_match(const char *p, const char *pe, const char *s, 
+                      const char *se, int flags) {
+    const char *star_p = NULL, *star_s = NULL;
+    int sep = flags & GLOB_PATHNAME;
+    
+    while (p < pe || s < se) {
+        if (p < pe && *p == '*' && sep && p + 1 < pe && p[1] == '*') {
+            const char *q = p + 2;
+            int dirs = q < pe && *q == '/';
+            if (dirs) q++;
+            for (const char *t = s; ; t++) {
+                if ((!dirs || t == s || t[-1] == '/') &&
+                    glob_match(q, pe, t, se, flags)) {
+                    return 1;
+                }
+                if (t == se) break;
+            }
+        } else if (p < pe && *p == '*') {
+            star_p = p++;
+            star_s = s;
+            continue;
+        } else if (p < pe && s < se && !(sep && *s == '/' && *p != '/')) {
+            const char *q = p;
+            int ok;
+            
+            if (*q == '?') {
+                ok = 1;
+                q++;
+            } else if (*q == '[' && 
+                       (ok = glob_class(&q, pe, (unsigned char)*s, flags)) >= 0) {
+                /* q is past the class */
+            } else {
+                if (*q == '\\' && q + 1 < pe) q++;
+                ok = (flags & GLOB_CASEFOLD)
+                    ? tolower((unsigned char)*q) == tolower((unsigned char)*s)
+                    : *q == *s;
+                q++;
+            }
+            if (ok) {
+                p = q;
+                s++;
+                continue;
+            }
+        }
+        
+        /* Mismatch: let the last '*' swallow one more character */
+        if (star_p && star_s < se && !(sep && *star_s == '/')) {
+            p = star_p + 1;
+            s = ++star_s;
+            continue;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+static uint64_t filter_hash(int kind, const char *p, size_t len) {
+    uint64_t h = 1469598103934665603ULL ^ (uint64_t)kind;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)tolower((unsigned char)p[i])) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static int filter_key_equal(const FilterKey *key, int kind, const char *p, 
+                            size_t len) {
+    if (key->kind != kind || key->len != len) return 0;
+    for (size_t i = 0; i < len; i++) {
+        if (tolower((unsigned char)key->text[i]) != tolower((unsigned char)p[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int has_glob_meta(const char *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] == '*' || p[i] == '?' || p[i] == '[' || p[i] == '\\') return 1;
+    }
+    return 0;
+}
+
+/* Sort patterns into the hash set or the glob list */
+static void compile_pattern_set(PatternSet *set, char patterns[][256], int count) {
+    size_t slots = 16;
+    
+    memset(set, 0, sizeof(*set));
+    set->count = count;
+    if (count == 0) return;
+    
+    while (slots < (size_t)count * 2) slots *= 2;
+    set->keys = calloc(slots, sizeof(FilterKey));
+    set->globs = calloc((size_t)count, sizeof(FilterGlob));
+    if (!set->keys || !set->globs) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    set->mask = slots - 1;
+    
+    for (int k = 0; k < count; k++) {
+        const char *pat = patterns[k];
+        size_t len = strlen(pat);
+        int kind = 0;
+        
+        /* "./x" and "/x" both mean x at the top of the walk */
+        if (pat[0] == '.' && pat[1] == '/') {
+            pat += 2;
+            len -= 2;
+        } else if (pat[0] == '/') {
+            pat++;
+            len--;
+        }
+        
+        int path = memchr(pat, '/', len) != NULL;
+        if (!path && len > 2 && pat[0] == '*' && pat[1] == '.' &&
+            !has_glob_meta(pat + 2, len - 2) && !memchr(pat + 2, '.', len - 2)) {
+            kind = FILTER_EXT;
+            pat += 2;
+            len -= 2;
+            set->has_ext = 1;
+        } else if (!path && !has_glob_meta(pat, len)) {
+            kind = FILTER_NAME;
+        }
+        
+        if (kind) {
+            size_t h = (size_t)filter_hash(kind, pat, len);
+            while (set->keys[h & set->mask].text) {
+                if (filter_key_equal(&set->keys[h & set->mask], kind, pat, len)) break;
+                h++;
+            }
+            set->keys[h & set->mask].text = pat;
+            set->keys[h & set->mask].len = len;
+            set->keys[h & set->mask].kind = kind;
+        } else {
+            set->globs[set->nglobs].glob = pat;
+            set->globs[set->nglobs].len = len;
+            set->globs[set->nglobs].path = path;
+            set->nglobs++;
+            set->any_path |= path;
+        }
+    }
+}
+
+static int filter_lookup(const PatternSet *set, int kind, const char *p, size_t len) {
+    for (size_t h = (size_t)filter_hash(kind, p, len); ; h++) {
+        const FilterKey *key = &set->keys[h & set->mask];
+        if (!key->text) return 0;
+        if (filter_key_equal(key, kind, p, len)) return 1;
+    }
+}
+
+/* Does a basename (and, if any glob needs it, the relative path) match
+ * any pattern in the set? */
+static int pattern_set_matches(const PatternSet *set, const char *name, size_t name_len,
+                               const char *rel, size_t rel_len) {
+    if (set->has_ext) {
+        const char *dot = strrchr(name, '.');
+        if (dot && filter_lookup(set, FILTER_EXT, dot + 1, 
+                                 name_len - (size_t)(dot + 1 - name))) {
+            return 1;
+        }
+    }
+    if (filter_lookup(set, FILTER_NAME, name, name_len)) return 1;
+    
+    for (int k = 0; k < set->nglobs; k++) {
+        const FilterGlob *g = &set->globs[k];
+        const char *s = g->path ? rel : name;
+        size_t n = g->path ? rel_len : name_len;
+        if (s && glob_match(g->glob, g->glob + g->len, s, s + n, 
+                            GLOB_PATHNAME | GLOB_CASEFOLD)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Compile -f and --exclude patterns once, before the walk */
+void compile_filters(SearchOptions *opts) {
+    compile_pattern_set(&opts->includes, opts->include, opts->include_count);
+    compile_pattern_set(&opts->excludes, opts->exclude, opts->exclude_count);
+}
+
+void free_filters(SearchOptions *opts) {
+    free(opts->includes.keys);
+    free(opts->includes.globs);
+    free(opts->excludes.keys);
+    free(opts->excludes.globs);
+    memset(&opts->includes, 0, sizeof(opts->includes));
+    memset(&opts->excludes, 0, sizeof(opts->excludes));
+}
+
+/* Grow a match buffer so that at least extra more bytes fit */
+static int fm_reserve(FileMatch *fm, size_t extra) {
+    if (fm->len + extra <= fm->cap) return 1;
+    
+    size_t new_cap = fm->cap ? fm->cap : 4096;
+    while (new_cap < fm->len + extra) new_cap *= 2;
+    
+    char *grown = realloc(fm->data, new_cap);
+    if (!grown) return 0;
+    fm->data = grown;
+    fm->cap = new_cap;
+    return 1;
+}
+
+static void fm_append(FileMatch *fm, const char *text, size_t len) {
+    if (!fm_reserve(fm, len)) return;
+    memcpy(fm->data + fm->len, text, len);
+    fm->len += len;
+}
+
+static void fm_append_long(FileMatch *fm, long value) {
+    char digits[24];
+    int n = snprintf(digits, sizeof(digits), "%ld", value);
+    fm_append(fm, digits, (size_t)n);
+}
+
+/* Length of the valid UTF-8 sequence at s, or 0 if it is not one */
+static size_t utf8_length(const unsigned char *s, const unsigned char *end) {
+    unsigned char c = s[0];
+    size_t n;
+    unsigned char lo = 0x80, hi = 0xBF;
+    
+    if (c >= 0xC2 && c <= 0xDF) n = 2;
+    else if (c >= 0xE0 && c <= 0xEF) n = 3;
+    else if (c >= 0xF0 && c <= 0xF4) n = 4;
+    else return 0;
+    
+    /* Second-byte limits rule out overlongs, surrogates and > U+10FFFF */
+    if (c == 0xE0) lo = 0xA0;
+    else if (c == 0xED) hi = 0x9F;
+    else if (c == 0xF0) lo = 0x90;
+    else if (c == 0xF4) hi = 0x8F;
+    
+    if ((size_t)(end - s) < n || s[1] < lo || s[1] > hi) return 0;
+    for (size_t k = 2; k < n; k++) {
+        if ((s[k] & 0xC0) != 0x80) return 0;
+    }
+    return n;
+}
+
+/* Append text as a JSON string. Room for the worst case is reserved
+ * once, so escaping never reallocates per byte. Bytes that are not
+ * valid UTF-8 are written as \u00XX so every record stays valid JSON. */
+static void fm_append_json(FileMatch *fm, const char *text, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *s = (const unsigned char *)text;
+    const unsigned char *end = s + len;
+    
+    if (!fm_reserve(fm, len * 6 + 2)) return;
+    char *o = fm->data + fm->len;
+    *o++ = '"';
+    while (s < end) {
+        unsigned char c = *s;
+        if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') {
+            *o++ = (char)c;
+            s++;
+            continue;
+        }
+        if (c >= 0x80) {
+            size_t n = utf8_length(s, end);
+            if (n) {
+                memcpy(o, s, n);
+                o += n;
+                s += n;
+                continue;
+            }
+        }
+        *o++ = '\\';
+        switch (c) {
+            case '"':  *o++ = '"'; break;
+            case '\\': *o++ = '\\'; break;
+            case '\n': *o++ = 'n'; break;
+            case '\r': *o++ = 'r'; break;
+            case '\t': *o++ = 't'; break;
+            default:
+                memcpy(o, "u00", 3);
+                o[3] = hex[c >> 4];
+                o[4] = hex[c & 15];
+                o += 5;
+                break;
+        }
+        s++;
+    }
+    *o++ = '"';
+    fm->len = (size_t)(o - fm->data);
+}
+
+/* Open a JSON record: {"type":"TYPE","path":"PATH" */
+static void json_begin(FileMatch *fm, const char *type, const char *path, 
+                       size_t path_len) {
+    fm_append(fm, "{\"type\":\"", 9);
+    fm_append(fm, type, strlen(type));
+    fm_append(fm, "\",\"path\":", 9);
+    fm_append_json(fm, path, path_len);
+}
+
+/* Append ,"NAME":VALUE to an open JSON record */
+static void json_long(FileMatch *fm, const char *name, long value) {
+    fm_append(fm, ",\"", 2);
+    fm_append(fm, name, strlen(name));
+    fm_append(fm, "\":", 2);
+    fm_append_long(fm, value);
+}
+
+/* Write a batch of buffers, retrying short writes */
+static int sink_write(OutputSink *sink, FileMatch *bufs, size_t count) {
+    struct iovec iov[OUTPUT_MAX_IOV];
+    size_t next = 0;
+    int64_t started = now_ns();
+    
+    while (next < count) {
+        int n = 0;
+        while (next < count && n < OUTPUT_MAX_IOV) {
+            if (bufs[next].len) {
+                iov[n].iov_base = bufs[next].data;
+                iov[n].iov_len = bufs[next].len;
+                n++;
+            }
+            next++;
+        }
+        
+        struct iovec *cur = iov;
+        while (n > 0) {
+            ssize_t written = writev(sink->fd, cur, n);
+            sink->write_calls++;
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return 0;
+            }
+            while (n > 0 && (size_t)written >= cur->iov_len) {
+                written -= (ssize_t)cur->iov_len;
+                cur++;
+                n--;
+            }
+            if (n > 0) {
+                cur->iov_base = (char *)cur->iov_base + written;
+                cur->iov_len -= (size_t)written;
+            }
+        }
+    }
+    
+    sink->write_ns += (long)(now_ns() - started);
+    return 1;
+}
+
+/* Drop a written buffer, keeping batch-sized ones for reuse */
+static void sink_recycle(OutputSink *sink, FileMatch *fm) {
+    if (fm->cap == OUTPUT_BATCH_BYTES && sink->spare_count < 64) {
+        if (sink->spare_count == sink->spare_cap) {
+            size_t new_cap = sink->spare_cap ? sink->spare_cap * 2 : 16;
+            char **grown = realloc(sink->spare, new_cap * sizeof(char *));
+            if (grown) {
+                sink->spare = grown;
+                sink->spare_cap = new_cap;
+            }
+        }
+        if (sink->spare_count < sink->spare_cap) {
+            sink->spare[sink->spare_count++] = fm->data;
+            return;
+        }
+    }
+    free(fm->data);
+}
+
+/* Move a buffer into the pending batch; called with the sink locked */
+static void sink_queue(OutputSink *sink, FileMatch *fm) {
+    if (fm->len == 0) {
+        return;
+    }
+    
+    /* Every context group starts with "--"; the first one written has
+     * nothing before it to be set apart from */
+    if (sink->lead_separator) {
+        sink->lead_separator = 0;
+        if (fm->len >= 3 && memcmp(fm->data, "--\n", 3) == 0) {
+            fm->len -= 3;
+            memmove(fm->data, fm->data + 3, fm->len);
+            if (fm->len == 0) return;
+        }
+    }
+    
+    if (sink->batch_count == sink->batch_cap) {
+        size_t new_cap = sink->batch_cap ? sink->batch_cap * 2 : 64;
+        FileMatch *grown = realloc(sink->batch, new_cap * sizeof(FileMatch));
+        if (!grown) return;
+        sink->batch = grown;
+        sink->batch_cap = new_cap;
+    }
+    
+    sink->batch[sink->batch_count++] = *fm;
+    sink->batch_bytes += fm->len;
+    memset(fm, 0, sizeof(*fm));
+}
+
+/* Write out the pending batch if it is big enough (or force is set).
+ * Called with the sink locked; the lock is dropped around writev so
+ * other workers keep queueing. Only one thread flushes at a time. */
+static void sink_drain(OutputSink *sink, int force) {
+    while (!sink->flushing && sink->batch_count > 0 &&
+           (force || sink->batch_bytes >= OUTPUT_FLUSH_BYTES)) {
+        FileMatch *bufs = sink->batch;
+        size_t count = sink->batch_count;
+        
+        sink->batch = NULL;
+        sink->batch_count = 0;
+        sink->batch_cap = 0;
+        sink->batch_bytes = 0;
+        sink->flushing = 1;
+        int ok = !sink->failed;
+        pthread_mutex_unlock(&sink->lock);
+        
+        if (ok) ok = sink_write(sink, bufs, count);
+        
+        pthread_mutex_lock(&sink->lock);
+        if (!ok) sink->failed = 1;
+        for (size_t k = 0; k < count; k++) {
+            sink_recycle(sink, &bufs[k]);
+        }
+        free(bufs);
+        sink->flushing = 0;
+    }
+}
+
+/* Emit every completed node at the front of the traversal order */
+static void sink_advance(OutputSink *sink) {
+    OrderNode *node = sink->cursor;
+    
+    while (node && node->done) {
+        sink_queue(sink, &node->out);
+        
+        if (node->first_child) {
+            node = node->first_child;
+            continue;
+        }
+        
+        /* Retire this node and any parents whose children are all out */
+        while (node) {
+            OrderNode *next = node->next;
+            OrderNode *parent = node->parent;
+            free(node->out.data);
+            free(node);
+            if (next) {
+                node = next;
+                break;
+            }
+            node = parent;
+        }
+    }
+    
+    sink->cursor = node;
+}
+
+/* Hand a worker's unordered output to the sink. With hold set the file
+ * is not finished: the sink takes no other file's output until the call
+ * that hands over the rest, so its lines stay together while memory for
+ * a file with huge output stays bounded. */
+static void sink_submit(OutputSink *sink, FileMatch *fm, int hold) {
+    pthread_mutex_lock(&sink->lock);
+    while (sink->holder && sink->holder != fm) {
+        pthread_cond_wait(&sink->released, &sink->lock);
+    }
+    sink_queue(sink, fm);
+    fm->held = hold;
+    if (hold) {
+        sink->holder = fm;
+    } else if (sink->holder == fm) {
+        sink->holder = NULL;
+        pthread_cond_broadcast(&sink->released);
+    }
+    if (!fm->data && sink->spare_count > 0) {
+        fm->data = sink->spare[--sink->spare_count];
+        fm->cap = OUTPUT_BATCH_BYTES;
+    }
+    sink_drain(sink, 0);
+    pthread_mutex_unlock(&sink->lock);
+    
+    if (!fm->data) fm_reserve(fm, OUTPUT_BATCH_BYTES);
+}
+
+/* Mark an ordered node finished and emit whatever became ready */
+static void sink_complete(OutputSink *sink, OrderNode *node) {
+    pthread_mutex_lock(&sink->lock);
+    node->done = 1;
+    sink_advance(sink);
+    sink_drain(sink, 0);
+    pthread_mutex_unlock(&sink->lock);
+}
+
+/* Create a traversal-order node as the last child of parent */
+static OrderNode *order_child(OrderNode *parent) {
+    OrderNode *node = calloc(1, sizeof(OrderNode));
+    if (!node) return NULL;
+    
+    node->parent = parent;
+    if (parent) {
+        if (parent->last_child) {
+            parent->last_child->next = node;
+        } else {
+            parent->first_child = node;
+        }
+        parent->last_child = node;
+    }
+    return node;
+}
+
+/* Finish a match record. In unordered mode a file's records go to the
+ * sink when it is done (see worker_main()), or in parts once they fill
+ * a batch, holding the sink for the rest of the file */
+static void record_done(Worker *worker, FileMatch *out) {
+    out->count++;
+    if (out->len >= OUTPUT_BATCH_BYTES && out == &worker->out) {
+        sink_submit(worker->pool->sink, out, 1);
+    }
+}
+
+/* Count a matching line against --max-total. Returns 0 once the limit
+ * is used up, in which case the line must not be reported; reaching it
+ * tells every worker to stop. */
+static int claim_line(Worker *worker, const SearchOptions *opts) {
+    if (opts->max_total <= 0) return 1;
+    
+    long n = atomic_fetch_add(&worker->pool->lines, 1) + 1;
+    if (n >= opts->max_total) {
+        atomic_store(&worker->pool->stop, 1);
+    }
+    return n <= opts->max_total;
+}
+
+static int pool_stopped(const Worker *worker) {
+    return atomic_load_explicit(&worker->pool->stop, memory_order_relaxed);
+}
+
+/* Find needle in a byte range: memchr on the first byte, then compare */
+static const char *find_bytes(const char *hay, size_t hay_len,
+                              const char *needle, size_t needle_len) {
+    if (needle_len == 0 || needle_len > hay_len) return NULL;
+    
+    const char *last = hay + hay_len - needle_len;
+    const char *p = hay;
+    while (p <= last) {
+        p = memchr(p, (unsigned char)needle[0], (size_t)(last - p) + 1);
+        if (!p) return NULL;
+        if (memcmp(p + 1, needle + 1, needle_len - 1) == 0) return p;
+        p++;
+    }
+    return NULL;
+}
+
+/* Count newlines in a byte range; the portable fallback and the tail
+ * of the SIMD counters */
+static long count_newlines(const char *p, const char *end) {
+    long count = 0;
+    
+    while (p < end && (p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        count++;
+        p++;
+    }
+    return count;
+}
+
+/* Bytes a block of a size class holds after its header */
+static size_t arena_class_bytes(int size_class) {
+    return ((size_t)ARENA_MIN_BLOCK << size_class) - sizeof(ArenaBlock);
+}
+
+/* Carve size bytes aligned to align out of an arena. Only the worker
+ * enumerating the directory allocates from its arena. */
+static void *arena_alloc(Worker *worker, Arena *arena, size_t size, 
+                         size_t align) {
+    ArenaBlock *block = arena->head;
+    
+    if (block) {
+        size_t at = (block->used + align - 1) & ~(align - 1);
+        if (at + size <= block->cap) {
+            block->used = at + size;
+            return (char *)(block + 1) + at;
+        }
+    }
+    
+    /* Each new block is twice the last, so waste stays within half */
+    int size_class = block ? block->size_class + 1 : 0;
+    if (size_class >= ARENA_CLASSES) size_class = ARENA_CLASSES - 1;
+    while (size_class < ARENA_CLASSES - 1 && arena_class_bytes(size_class) < size) {
+        size_class++;
+    }
+    
+    /* A one-off block goes behind the current one, which keeps serving */
+    if (size > arena_class_bytes(size_class)) {
+        ArenaBlock *big = malloc(sizeof(ArenaBlock) + size);
+        if (!big) return NULL;
+        big->size_class = -1;
+        big->cap = big->used = size;
+        if (block) {
+            big->next = block->next;
+            block->next = big;
+        } else {
+            big->next = NULL;
+            arena->head = big;
+        }
+        return big + 1;
+    }
+    if (worker->free_blocks[size_class]) {
+        block = worker->free_blocks[size_class];
+        worker->free_blocks[size_class] = block->next;
+        worker->free_count[size_class]--;
+    } else {
+        block = malloc(sizeof(ArenaBlock) + arena_class_bytes(size_class));
+        if (!block) return NULL;
+        block->size_class = size_class;
+        block->cap = arena_class_bytes(size_class);
+    }
+    block->used = size;
+    block->next = arena->head;
+    arena->head = block;
+    return block + 1;
+}
+
+static char *arena_strdup(Worker *worker, Arena *arena, const char *text, 
+                          size_t len) {
+    char *copy = arena_alloc(worker, arena, len + 1, 1);
+    if (copy) memcpy(copy, text, len + 1);
+    return copy;
+}
+
+/* Hand an arena's blocks back to the releasing worker's cache */
+static void arena_release(Worker *worker, Arena *arena) {
+    ArenaBlock *block = arena->head;
+    
+    while (block) {
+        ArenaBlock *next = block->next;
+        int size_class = block->size_class;
+        if (size_class >= 0 && worker->free_count[size_class] < ARENA_CACHE_BLOCKS) {
+            block->next = worker->free_blocks[size_class];
+            worker->free_blocks[size_class] = block;
+            worker->free_count[size_class]++;
+        } else {
+            free(block);
+        }
+        block = next;
+    }
+    arena->head = NULL;
+}
+
+static void arena_cache_free(Worker *worker) {
+    for (int c = 0; c < ARENA_CLASSES; c++) {
+        while (worker->free_blocks[c]) {
+            ArenaBlock *next = worker->free_blocks[c]->next;
+            free(worker->free_blocks[c]);
+            worker->free_blocks[c] = next;
+        }
+        worker->free_count[c] = 0;
+    }
+}
+
+/* Create a directory node under parent, which it keeps referenced. A
+ * child lives in its parent's arena, which outlives it; only the root
+ * is allocated on its own. */
+static DirNode *dir_new(Worker *worker, DirNode *parent, const char *name, 
+                        size_t name_len) {
+    size_t size = sizeof(DirNode) + name_len + 1;
+    DirNode *dir = parent 
+        ? arena_alloc(worker, &parent->arena, size, _Alignof(DirNode))
+        : malloc(size);
+    if (!dir) return NULL;
+    
+    dir->parent = parent;
+    atomic_init(&dir->refs, 1);
+    dir->fd = -1;
+    atomic_init(&dir->fd_users, 0);
+    dir->depth = parent ? parent->depth + 1 : 0;
+    dir->ignore = parent ? parent->ignore : NULL;
+    atomic_init(&dir->work_ns, 0);
+    dir->dev = parent ? parent->dev : 0;
+    dir->device = parent ? parent->device : 0;
+    dir->classified = 0;
+    dir->arena.head = NULL;
+    dir->name_len = name_len;
+    memcpy(dir->name, name, name_len + 1);
+    if (parent) atomic_fetch_add(&parent->refs, 1);
+    return dir;
+}
+
+/* Keep the TOP_SUBTREES slowest directories, slowest first */
+static void record_slow(ProfileReport *report, const DirNode *dir, long ns) {
+    pthread_mutex_lock(&report->slow_lock);
+    if (report->nslow < TOP_SUBTREES || ns > report->slow[TOP_SUBTREES - 1].ns) {
+        int at = report->nslow < TOP_SUBTREES ? report->nslow++ : TOP_SUBTREES - 1;
+        while (at > 0 && report->slow[at - 1].ns < ns) {
+            report->slow[at] = report->slow[at - 1];
+            at--;
+        }
+        
+        /* Parents outlive children, so the whole chain is still there */
+        SlowSubtree *entry = &report->slow[at];
+        size_t total = 0;
+        for (const DirNode *d = dir; d; d = d->parent) {
+            total += d->name_len + (d == dir ? 0 : 1);
+        }
+        if (total < sizeof(entry->path)) {
+            char *end = entry->path + total;
+            *end = '\0';
+            for (const DirNode *d = dir; d; d = d->parent) {
+                if (d != dir) *--end = '/';
+                end -= d->name_len;
+                memcpy(end, d->name, d->name_len);
+            }
+        } else {
+            snprintf(entry->path, sizeof(entry->path), ".../%s", dir->name);
+        }
+        entry->ns = ns;
+    }
+    pthread_mutex_unlock(&report->slow_lock);
+}
+
+static void free_ignore(IgnoreList *list) {
+    free(list->rules);
+    free(list->text);
+    free(list);
+}
+
+/* Drop a reference; freeing a node drops the one it holds on its parent */
+static void dir_release(Worker *worker, DirNode *dir) {
+    WorkPool *pool = worker->pool;
+    
+    while (dir && atomic_fetch_sub(&dir->refs, 1) == 1) {
+        DirNode *parent = dir->parent;
+        if (dir->fd >= 0) {
+            close(dir->fd);
+            atomic_fetch_sub(&pool->held_fds, 1);
+        }
+        if (dir->ignore && dir->ignore->owner == dir) {
+            free_ignore(dir->ignore);
+        }
+        if (pool->report) {
+            long ns = atomic_load(&dir->work_ns);
+            if (parent) atomic_fetch_add(&parent->work_ns, ns);
+            if (dir->depth > 0) record_slow(pool->report, dir, ns);
+        }
+        arena_release(worker, &dir->arena);
+        if (!parent) free(dir);
+        dir = parent;
+    }
+}
+
+/* Join a directory chain (and optional entry name) into the worker's
+ * path buffer, back to front so no recursion or temporary is needed */
+static const char *join_path(Worker *worker, const DirNode *dir,
+                             const char *name, size_t *len_out) {
+    size_t name_len = name ? strlen(name) : 0;
+    size_t total = name ? name_len : 0;
+    
+    for (const DirNode *d = dir; d; d = d->parent) {
+        total += d->name_len + (d == dir && !name ? 0 : 1);
+    }
+    
+    if (total + 1 > worker->path_cap) {
+        size_t new_cap = worker->path_cap ? worker->path_cap : 256;
+        while (new_cap < total + 1) new_cap *= 2;
+        char *grown = realloc(worker->path_buf, new_cap);
+        if (!grown) return NULL;
+        worker->path_buf = grown;
+        worker->path_cap = new_cap;
+    }
+    
+    char *end = worker->path_buf + total;
+    *end = '\0';
+    if (name) {
+        end -= name_len;
+        memcpy(end, name, name_len);
+        *--end = '/';
+    }
+    for (const DirNode *d = dir; d; d = d->parent) {
+        end -= d->name_len;
+        memcpy(end, d->name, d->name_len);
+        if (d->parent) *--end = '/';
+    }
+    
+    if (len_out) *len_out = total;
+    return worker->path_buf;
+}
+
+/* Full path of a file, joined on first use */
+static const char *file_path(Worker *worker, FileRef *file, size_t *len_out) {
+    if (!file->path) {
+        file->path = join_path(worker, file->dir, file->name, &file->path_len);
+        if (!file->path) {
+            file->path = file->name;
+            file->path_len = strlen(file->name);
+        }
+    }
+    *len_out = file->path_len;
+    return file->path;
+}
+
+/* openat() for paths of any length: leading components are opened in
+ * pieces shorter than MAX_PATH, which the kernel would refuse */
+static int open_long(int at, char *path, size_t len, int flags) {
+    int dirfd = at;
+    
+    while (len >= MAX_PATH) {
+        char *cut = path + MAX_PATH - 1;
+        while (cut > path && *cut != '/') cut--;
+        if (cut == path) break;
+        
+        *cut = '\0';
+        int next = openat(dirfd, path, O_RDONLY | O_DIRECTORY);
+        *cut = '/';
+        if (dirfd != at) close(dirfd);
+        if (next < 0) return -1;
+        dirfd = next;
+        len -= (size_t)(cut + 1 - path);
+        path = cut + 1;
+    }
+    
+    int fd = openat(dirfd, path, flags);
+    if (dirfd != at) close(dirfd);
+    return fd;
+}
+
+/* Open an entry relative to its directory's held fd, or by its full
+ * path. Only the directory itself is used: an ancestor's fd may be
+ * closed at any time once its own entries are done. */
+static int open_entry(Worker *worker, DirNode *dir, const char *name,
+                      int flags, FileRef *file) {
+    count_call(worker->profile, CALL_OPEN);
+    if (dir && dir->fd >= 0) {
+        return openat(dir->fd, name, flags);
+    }
+    if (!dir) {
+        return open(name, flags);
+    }
+    
+    size_t len;
+    const char *path = file ? file_path(worker, file, &len)
+                            : join_path(worker, dir, name, &len);
+    if (!path) return -1;
+    if (len < MAX_PATH) return open(path, flags);
+    
+    /* open_long() cuts the path in place, so work on the scratch copy */
+    if (path != worker->path_buf) return -1;
+    if (file) file->path = NULL;
+    return open_long(AT_FDCWD, worker->path_buf, len, flags);
+}
+
+/* Directory whose fd an item opens its entry through */
+static DirNode *fd_owner(int kind, DirNode *dir) {
+    return kind == WORK_DIR ? dir->parent : kind == WORK_CHUNK ? NULL : dir;
+}
+
+/* One user of a directory's fd is done; the last closes a held fd, so
+ * a directory gives its fd back as soon as its own entries are open
+ * rather than when its whole subtree is finished */
+static void dir_fd_done(Worker *worker, DirNode *dir) {
+    if (dir && atomic_fetch_sub(&dir->fd_users, 1) == 1 && dir->fd >= 0) {
+        close(dir->fd);
+        dir->fd = -1;
+        atomic_fetch_sub(&worker->pool->held_fds, 1);
+    }
+}
+
+/* Map large files, read small ones into the worker's reusable buffer */
+static int load_file(int fd, const struct stat *st, Worker *worker, 
+                     FileView *view) {
+    view->data = NULL;
+    view->len = 0;
+    view->mapped = 0;
+    
+    if (st->st_size >= MMAP_THRESHOLD) {
+        void *map = mmap(NULL, (size_t)st->st_size, PROT_READ, MAP_PRIVATE,
+                         fd, 0);
+        count_call(worker->profile, CALL_MMAP);
+        if (map != MAP_FAILED) {
+            posix_madvise(map, (size_t)st->st_size, POSIX_MADV_SEQUENTIAL);
+            view->data = map;
+            view->len = (size_t)st->st_size;
+            view->mapped = 1;
+            return 1;
+        }
+    }
+    
+    /* Read the whole file in as few read() calls as possible; files that
+     * take several let the kernel read ahead in larger steps */
+    if (st->st_size > READ_BLOCK_BYTES) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    size_t want = st->st_size > 0 ? (size_t)st->st_size + 1 : READ_BLOCK_BYTES;
+    size_t len = 0;
+    for (;;) {
+        /* Keep one spare byte so a full read means the file grew */
+        if (len + 1 >= want) want = len + READ_BLOCK_BYTES;
+        if (want > worker->read_cap) {
+            size_t new_cap = worker->read_cap ? worker->read_cap : READ_BLOCK_BYTES;
+            while (new_cap < want) new_cap *= 2;
+            char *grown = realloc(worker->read_buf, new_cap);
+            if (!grown) return 0;
+            worker->read_buf = grown;
+            worker->read_cap = new_cap;
+        }
+        
+        ssize_t n = read(fd, worker->read_buf + len, want - len);
+        count_call(worker->profile, CALL_READ);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        if (n == 0) break;
+        len += (size_t)n;
+    }
+    
+    view->data = worker->read_buf;
+    view->len = len;
+    return 1;
+}
+
+/* Same test as grep: a NUL byte near the start means binary */
+static int looks_binary(const char *buf, size_t len) {
+    return memchr(buf, '\0', len < BINARY_PROBE_BYTES ? len : BINARY_PROBE_BYTES) 
+           != NULL;
+}
+
+static void release_file(FileView *view) {
+    if (view->mapped) {
+        munmap((void *)view->data, view->len);
+    }
+}
+
+/* --io=nocache: drop the file's pages once it is searched so a large
+ * scan leaves the page cache to whoever was using it. Pages still
+ * mapped elsewhere stay; ours must be unmapped first. */
+static void drop_cached(int fd, const SearchOptions *opts) {
+    if (opts->io_mode != IO_NORMAL) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+}
+
+/* Run a compiled regex over one line, which is not NUL-terminated */
+static int regex_matches(const regex_t *re, const char *line, size_t len,
+                         Worker *worker) {
+#ifdef REG_STARTEND
+    regmatch_t range;
+    (void)worker;
+    range.rm_so = 0;
+    range.rm_eo = (regoff_t)len;
+    return regexec(re, line, 1, &range, REG_STARTEND) == 0;
+#else
+    if (len + 1 > worker->line_cap) {
+        char *grown = realloc(worker->line_buf, len + 1);
+        if (!grown) return 0;
+        worker->line_buf = grown;
+        worker->line_cap = len + 1;
+    }
+    memcpy(worker->line_buf, line, len);
+    worker->line_buf[len] = '\0';
+    return regexec(re, worker->line_buf, 0, NULL, 0) == 0;
+#endif
+}
+
+/* Where a scan of consecutive pieces of one stream has got to; the
+ * pieces must end on line boundaries */
+typedef struct {
+    long line_number;       /* of the first line in the next piece */
+    long offset;            /* byte offset of the next piece */
+    long lines;             /* matching lines so far, for -m */
+    int done;               /* the scan stopped early: -l, -m, --max-total */
+    long after;             /* -A lines still to show from the next piece */
+    size_t back;            /* unshown bytes kept before the next piece, 
+                             * for -B; set by the scan, honoured by the caller */
+    int shown;              /* some line of the file was printed */
+    int adjacent;           /* ... and it ends right where back starts */
+} ScanCursor;
+
+/* One walk_search() call: its callback, taken one call at a time */
+typedef struct WalkRun {
+    WalkCallback callback;
+    void *data;
+    pthread_mutex_t lock;
+    long reported;
+} WalkRun;
+
+/* libwalk: hand a match to the callback instead of printing it; a
+ * nonzero return stops the whole search */
+static void report_match(const char *line, const char *line_end, long line_number,
+                         long offset, int keyword, FileRef *file, 
+                         const SearchOptions *opts, Worker *worker) {
+    WalkRun *run = opts->run;
+    WalkMatch match;
+    
+    match.path = file_path(worker, file, &match.path_len);
+    match.line = line;
+    match.line_len = line ? (size_t)(line_end - line) : 0;
+    match.line_number = line && opts->show_line_numbers ? line_number : 0;
+    match.offset = offset;
+    match.keyword = keyword;
+    
+    pthread_mutex_lock(&run->lock);
+    run->reported++;
+    int stop = run->callback(&match, run->data);
+    pthread_mutex_unlock(&run->lock);
+    if (stop) atomic_store(&worker->pool->stop, 1);
+}
+
+/* Print one -A/-B context line, marked like grep with '-' instead of ':' */
+static void print_context(const char *line, const char *line_end, long line_number,
+                          long offset, FileRef *file, const SearchOptions *opts,
+                          Worker *worker, FileMatch *out) {
+    size_t name_len;
+    const char *filename = file_path(worker, file, &name_len);
+    
+    if (opts->json) {
+        json_begin(out, "context", filename, name_len);
+        if (opts->show_line_numbers) json_long(out, "line", line_number);
+        json_long(out, "offset", offset);
+        fm_append(out, ",\"text\":", 8);
+        fm_append_json(out, line, (size_t)(line_end - line));
+        fm_append(out, "}\n", 2);
+    } else {
+        fm_append(out, filename, name_len);
+        fm_append(out, "-", 1);
+        if (opts->show_line_numbers) {
+            fm_append_long(out, line_number);
+            fm_append(out, "-", 1);
+        }
+        fm_append(out, line, (size_t)(line_end - line));
+        fm_append(out, "\n", 1);
+    }
+    record_done(worker, out);
+}
+
+/* Show up to *left lines from p, stopping at limit; returns the end of
+ * the last one shown */
+static const char *print_after(const char *p, const char *limit, long *left,
+                               long *line_number, const char *buf, long base,
+                               FileRef *file, const SearchOptions *opts,
+                               Worker *worker, FileMatch *out) {
+    while (*left > 0 && p < limit) {
+        const char *end = memchr(p, '\n', (size_t)(limit - p));
+        if (!end) end = limit;
+        print_context(p, end, *line_number, base + (long)(p - buf), file, opts,
+                      worker, out);
+        (*left)--;
+        (*line_number)++;
+        p = end < limit ? end + 1 : limit;
+    }
+    return p;
+}
+
+/* Scan a whole buffer in one pass of the keyword automaton (or
+ * find_bytes for a single plain keyword); line boundaries are only
+ * located around hits. Returns the number of (line, keyword) matches.
+ * Binary buffers print nothing and stop at the first matching line.
+ * With a cursor, buf is the next piece of a longer stream. Context
+ * lines are printed straight from the buffer: -B walks back from the
+ * hit, never past the last line already shown, and -A runs forward
+ * until the next hit, so overlapping windows merge. Each window starts
+ * with grep's "--", including a file's first (the sink drops the one
+ * that would lead the output). */
+static long scan_buffer(const char *buf, size_t len, FileRef *file,
+                        const SearchOptions *opts, Worker *worker,
+                        FileMatch *out, int binary, ScanCursor *at) {
+    const KeywordMatcher *m = opts->matcher;
+    int show_lines = !opts->count_only && !opts->only_matching_files && !binary;
+    int need_lines = show_lines && opts->show_line_numbers;
+    size_t pos = 0;
+    const char *counted = buf;  /* newlines are counted up to here */
+    long line_number = at ? at->line_number : 1;
+    long matches = 0;
+    long lines = at ? at->lines : 0;    /* matching lines, for -m */
+    int done = 0;
+    long base = at ? at->offset : 0;
+    
+    /* Context state: lines up to shown_end are printed (NULL: none in
+     * this piece or the kept bytes before it), shown_line numbers the
+     * line starting there, after_left counts pending -A lines */
+    int context = show_lines && opts->context;
+    const char *floor = at ? buf - at->back : buf;
+    const char *shown_end = at && at->adjacent ? floor : NULL;
+    long shown_line = line_number;
+    long after_left = at ? at->after : 0;
+    int shown = at ? at->shown : 0;
+    
+    while (pos < len) {
+        size_t hit;
+        uint32_t mask = 0;
+        int32_t state = 0;
+        
+        if (m->every_line) {
+            hit = pos;
+        } else if (m->single) {
+            const char *found = opts->case_sensitive
+                ? find_bytes(buf + pos, len - pos, m->lits[0].text,
+                             m->lits[0].len)
+                : m->find_case(buf + pos, len - pos, m->folded,
+                               m->lits[0].len);
+            hit = found ? (size_t)(found - buf) : len;
+            mask = 1u << m->lits[0].slot;
+        } else {
+            hit = matcher_run(m, buf, pos, len, &state, &mask);
+        }
+        if (hit >= len) break;
+        
+        /* Find the line around the hit */
+        const char *line = buf + hit;
+        while (line > buf + pos && line[-1] != '\n') line--;
+        const char *line_end = memchr(buf + hit, '\n', len - hit);
+        if (!line_end) line_end = buf + len;
+        
+        /* Collect every other keyword on the same line */
+        mask |= m->every_line;
+        if (!m->single) {
+            size_t at = m->every_line ? hit : hit + 1;
+            size_t stop = (size_t)(line_end - buf);
+            while (at < stop) {
+                uint32_t more = 0;
+                at = matcher_run(m, buf, at, stop, &state, &more) + 1;
+                mask |= more;
+            }
+        }
+        
+        /* Regex keywords only had a candidate line; confirm them */
+        for (uint32_t todo = mask & m->regex_mask; todo; todo &= todo - 1) {
+            int k = __builtin_ctz(todo);
+            if (!regex_matches(&m->regex[k], line, (size_t)(line_end - line),
+                               worker)) {
+                mask &= ~(1u << k);
+            }
+        }
+        if (!mask) {
+            if (line_end == buf + len) break;
+            pos = (size_t)(line_end - buf) + 1;
+            continue;
+        }
+        if (!claim_line(worker, opts)) {
+            done = 1;
+            break;
+        }
+        
+        /* Only the gap since the last printed hit is ever counted */
+        if (need_lines) {
+            line_number += m->count_newlines(counted, line);
+            counted = line;
+        }
+        
+        if (context) {
+            if (shown_end) {
+                shown_end = print_after(shown_end, line, &after_left, &shown_line, 
+                                        buf, base, file, opts, worker, out);
+            }
+            
+            /* Back up over at most -B whole lines not shown yet */
+            const char *from = line;
+            const char *stop = shown_end ? shown_end : floor;
+            long before = 0;
+            while (before < opts->before_context && from > stop) {
+                from--;
+                while (from > stop && from[-1] != '\n') from--;
+                before++;
+            }
+            if ((!shown || from != shown_end) && !opts->json) {
+                fm_append(out, "--\n", 3);
+                record_done(worker, out);
+            }
+            for (const char *p = from; p < line; before--) {
+                const char *end = memchr(p, '\n', (size_t)(line - p));
+                print_context(p, end, line_number - before, base + (long)(p - buf),
+                              file, opts, worker, out);
+                p = end + 1;
+            }
+            shown = 1;
+            shown_end = line_end < buf + len ? line_end + 1 : buf + len;
+            shown_line = line_number + 1;
+            after_left = opts->after_context;
+        }
+        
+        for (int k = 0; k < opts->keyword_count; k++) {
+            if (!(mask & (1u << k))) continue;
+            
+            matches++;
+            if (show_lines && opts->run) {
+                report_match(line, line_end, line_number, base + (long)(line - buf),
+                             k, file, opts, worker);
+            } else if (show_lines && opts->json) {
+                size_t name_len;
+                const char *filename = file_path(worker, file, &name_len);
+                json_begin(out, "match", filename, name_len);
+                if (opts->show_line_numbers) json_long(out, "line", line_number);
+                json_long(out, "offset", base + (long)(line - buf));
+                fm_append(out, ",\"keyword\":", 11);
+                fm_append_json(out, opts->keywords[k], opts->keyword_len[k]);
+                fm_append(out, ",\"text\":", 8);
+                fm_append_json(out, line, (size_t)(line_end - line));
+                fm_append(out, "}\n", 2);
+                record_done(worker, out);
+            } else if (show_lines) {
+                size_t name_len;
+                const char *filename = file_path(worker, file, &name_len);
+                fm_append(out, filename, name_len);
+                fm_append(out, ":", 1);
+                if (opts->show_line_numbers) {
+                    fm_append_long(out, line_number);
+                    fm_append(out, ":", 1);
+                }
+                fm_append(out, line, (size_t)(line_end - line));
+                fm_append(out, "\n", 1);
+                record_done(worker, out);
+            }
+        }
+        
+        if (opts->only_matching_files || (binary && !opts->count_only) ||
+            ++lines == opts->max_count || pool_stopped(worker)) {
+            done = 1;
+            break;
+        }
+        if (line_end == buf + len) break;
+        pos = (size_t)(line_end - buf) + 1;
+    }
+    
+    if (context && shown_end) {
+        shown_end = print_after(shown_end, buf + len, &after_left, &shown_line, 
+                                buf, base, file, opts, worker, out);
+    }
+    
+    if (at) {
+        at->line_number = need_lines 
+            ? line_number + m->count_newlines(counted, buf + len) : line_number;
+        at->offset += (long)len;
+        at->lines = lines;
+        at->done = done;
+        
+        /* Keep the last -B lines not shown yet for a hit early in the
+         * next piece; pending -A lines mean everything here was shown */
+        const char *keep = buf + len;
+        if (context && !after_left) {
+            const char *stop = shown_end ? shown_end : floor;
+            for (long n = 0; n < opts->before_context && keep > stop; n++) {
+                keep--;
+                while (keep > stop && keep[-1] != '\n') keep--;
+            }
+        }
+        at->after = after_left;
+        at->back = (size_t)(buf + len - keep);
+        at->shown = shown;
+        at->adjacent = shown_end == keep;
+    }
+    return matches;
+}
+
+/* Per-worker -z state: one context per format, set up on first use
+ * and reset between files, plus the buffer decoded text lands in */
+typedef struct Decoder {
+#ifdef WALK_HAVE_ZLIB
+    z_stream gzip;
+    int gzip_ready;
+#endif
+#ifdef WALK_HAVE_LZMA
+    lzma_stream xz;
+    int xz_ready;
+#endif
+#ifdef WALK_HAVE_ZSTD
+    ZSTD_DCtx *zstd;
+#endif
+    char *buf;
+    size_t cap;
+    int finished;           /* the stream has ended, cleanly or not */
+} Decoder;
+
+/* Format of a compressed file, or CODEC_NONE if it is not one this
+ * build can decode */
+static int detect_codec(const char *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    
+#ifdef WALK_HAVE_ZLIB
+    if (len >= 2 && p[0] == 0x1f && p[1] == 0x8b) return CODEC_GZIP;
+#endif
+#ifdef WALK_HAVE_LZMA
+    if (len >= 6 && memcmp(p, "\xfd" "7zXZ\0", 6) == 0) return CODEC_XZ;
+#endif
+#ifdef WALK_HAVE_ZSTD
+    if (len >= 4 && memcmp(p, "\x28\xb5\x2f\xfd", 4) == 0) return CODEC_ZSTD;
+#endif
+    (void)p; (void)len;
+    return CODEC_NONE;
+}
+
+static void free_decoder(Decoder *d) {
+    if (!d) return;
+#ifdef WALK_HAVE_ZLIB
+    if (d->gzip_ready) inflateEnd(&d->gzip);
+#endif
+#ifdef WALK_HAVE_LZMA
+    if (d->xz_ready) lzma_end(&d->xz);
+#endif
+#ifdef WALK_HAVE_ZSTD
+    ZSTD_freeDCtx(d->zstd);
+#endif
+    free(d->buf);
+    free(d);
+}
+
+/* Get the worker's context for codec ready for a new stream */
+static Decoder *decoder_start(Worker *worker, int codec) {
+    Decoder *d = worker->decoder;
+    
+    if (!d && !(d = worker->decoder = calloc(1, sizeof(Decoder)))) return NULL;
+    d->finished = 0;
+    
+    switch (codec) {
+#ifdef WALK_HAVE_ZLIB
+        case CODEC_GZIP:
+            if (d->gzip_ready) return inflateReset(&d->gzip) == Z_OK ? d : NULL;
+            /* 15 + 16: gzip framing only */
+            if (inflateInit2(&d->gzip, 15 + 16) != Z_OK) return NULL;
+            d->gzip_ready = 1;
+            return d;
+#endif
+#ifdef WALK_HAVE_LZMA
+        case CODEC_XZ:
+            /* liblzma keeps its allocations when a stream is re-initialized */
+            if (!d->xz_ready) {
+                lzma_stream init = LZMA_STREAM_INIT;
+                d->xz = init;
+            }
+            if (lzma_stream_decoder(&d->xz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+                return NULL;
+            }
+            d->xz_ready = 1;
+            return d;
+#endif
+#ifdef WALK_HAVE_ZSTD
+        case CODEC_ZSTD:
+            if (!d->zstd && !(d->zstd = ZSTD_createDCtx())) return NULL;
+            ZSTD_DCtx_reset(d->zstd, ZSTD_reset_session_only);
+            return d;
+#endif
+        default:
+            return NULL;
+    }
+}
+
+/* Decode from in[*in_pos..] into out; returns the bytes produced (0 once
+ * the stream is finished) or -1 if the data is corrupt */
+static long decode_some(Decoder *d, int codec, const char *in, size_t in_len,
+                        size_t *in_pos, char *out, size_t out_cap) {
+    if (d->finished) return 0;
+    
+    switch (codec) {
+#ifdef WALK_HAVE_ZLIB
+        case CODEC_GZIP: {
+            z_stream *zs = &d->gzip;
+            zs->next_in = (Bytef *)(in + *in_pos);
+            zs->avail_in = (uInt)(in_len - *in_pos);
+            zs->next_out = (Bytef *)out;
+            zs->avail_out = (uInt)out_cap;
+            int ret = inflate(zs, Z_NO_FLUSH);
+            *in_pos = in_len - zs->avail_in;
+            long produced = (long)(out_cap - zs->avail_out);
+            
+            if (ret == Z_STREAM_END) {
+                /* Concatenated members continue; trailing junk ends it */
+                if (*in_pos + 2 <= in_len && (unsigned char)in[*in_pos] == 0x1f &&
+                    (unsigned char)in[*in_pos + 1] == 0x8b) {
+                    inflateReset(zs);
+                } else {
+                    d->finished = 1;
+                }
+            } else if (ret != Z_OK) {
+                d->finished = 1;
+                if (ret != Z_BUF_ERROR) return produced ? produced : -1;
+            }
+            return produced;
+        }
+#endif
+#ifdef WALK_HAVE_LZMA
+        case CODEC_XZ: {
+            lzma_stream *xz = &d->xz;
+            xz->next_in = (const uint8_t *)in + *in_pos;
+            xz->avail_in = in_len - *in_pos;
+            xz->next_out = (uint8_t *)out;
+            xz->avail_out = out_cap;
+            lzma_ret ret = lzma_code(xz, LZMA_FINISH);
+            *in_pos = in_len - xz->avail_in;
+            long produced = (long)(out_cap - xz->avail_out);
+            
+            if (ret != LZMA_OK) {
+                d->finished = 1;
+                if (ret != LZMA_STREAM_END && !produced) return -1;
+            }
+            return produced;
+        }
+#endif
+#ifdef WALK_HAVE_ZSTD
+        case CODEC_ZSTD: {
+            ZSTD_inBuffer src = { in, in_len, *in_pos };
+            ZSTD_outBuffer dst = { out, out_cap, 0 };
+            size_t ret = ZSTD_decompressStream(d->zstd, &src, &dst);
+            *in_pos = src.pos;
+            
+            if (ZSTD_isError(ret)) {
+                d->finished = 1;
+                return dst.pos ? (long)dst.pos : -1;
+            }
+            /* All input consumed and nothing more buffered: done */
+            if (src.pos == in_len && dst.pos < out_cap) d->finished = 1;
+            return (long)dst.pos;
+        }
+#endif
+        default:
+            (void)in; (void)in_len; (void)in_pos; (void)out; (void)out_cap;
+            d->finished = 1;
+            return -1;
+    }
+}
+
+/* Where scan_stream() gets its text: fills out with up to cap bytes and
+ * returns how many, setting *eof once nothing more will come */
+typedef long (*StreamFill)(void *source, char *out, size_t cap, int *eof);
+
+/* Search text that arrives in pieces: fill DECODE_CHUNK_BYTES at a time
+ * into *bufp and scan every complete line, carrying the partial last
+ * line over to the next round so no match is split by a chunk
+ * boundary. Line numbers and offsets refer to the streamed text. */
+static long scan_stream(StreamFill fill, void *source, char **bufp,
+                        size_t *capp, FileRef *file, const SearchOptions *opts,
+                        Worker *worker, FileMatch *out, int *binary) {
+    ScanCursor at = { 1, 0, 0, 0, 0, 0, 0, 0 };
+    size_t have = 0;
+    size_t back = 0;            /* -B lines kept ahead of the new text */
+    long matches = 0;
+    int probed = 0;
+    
+    for (;;) {
+        if (*capp - have < DECODE_CHUNK_BYTES) {
+            size_t new_cap = *capp ? *capp : DECODE_CHUNK_BYTES;
+            while (new_cap - have < DECODE_CHUNK_BYTES) new_cap *= 2;
+            char *grown = realloc(*bufp, new_cap);
+            if (!grown) break;
+            *bufp = grown;
+            *capp = new_cap;
+        }
+        
+        char *buf = *bufp;
+        int eof = 0;
+        have += (size_t)fill(source, buf + have, DECODE_CHUNK_BYTES, &eof);
+        
+        /* Binary detection looks at the streamed text */
+        if (!probed && (have >= BINARY_PROBE_BYTES || eof)) {
+            probed = 1;
+            *binary = opts->binary_mode != BINARY_TEXT && looks_binary(buf, have);
+            if (*binary && opts->binary_mode == BINARY_SKIP) break;
+        }
+        if (!probed) continue;
+        
+        size_t upto = have;
+        if (!eof) {
+            while (upto > back && buf[upto - 1] != '\n') upto--;
+            if (upto == back && have - back < DECODE_MAX_LINE) continue;
+            if (upto == back) upto = have;
+        }
+        
+        matches += scan_buffer(buf + back, upto - back, file, opts, worker, 
+                               out, *binary, &at);
+        if (at.done || eof) break;
+        
+        /* Context kept for -B is bounded so memory does not grow with it;
+         * cut at a line start */
+        if (at.back > DECODE_CHUNK_BYTES) {
+            const char *cut = memchr(buf + upto - DECODE_CHUNK_BYTES, '\n', 
+                                     DECODE_CHUNK_BYTES);
+            at.back = cut ? (size_t)(buf + upto - cut - 1) : 0;
+            at.adjacent = 0;
+        }
+        back = at.back;
+        memmove(buf, buf + upto - back, have - upto + back);
+        have -= upto - back;
+    }
+    
+    /* Drop a huge buffer rather than pin it for the worker's lifetime */
+    if (*capp > 4 * DECODE_CHUNK_BYTES) {
+        free(*bufp);
+        *bufp = NULL;
+        *capp = 0;
+    }
+    return matches;
+}
+
+typedef struct {
+    Decoder *d;
+    int codec;
+    const FileView *view;
+    size_t in_pos;
+} DecodeSource;
+
+static long decode_fill(void *source, char *out, size_t cap, int *eof) {
+    DecodeSource *src = source;
+    size_t consumed = src->in_pos;
+    long n = decode_some(src->d, src->codec, src->view->data, src->view->len,
+                         &src->in_pos, out, cap);
+    *eof = src->d->finished || n < 0 || (n == 0 && src->in_pos == consumed);
+    return n > 0 ? n : 0;
+}
+
+/* Search a compressed file, decoding it a chunk at a time */
+static long scan_compressed(const FileView *view, int codec, FileRef *file,
+                            const SearchOptions *opts, Worker *worker,
+                            FileMatch *out, int *binary) {
+    DecodeSource src = { decoder_start(worker, codec), codec, view, 0 };
+    
+    if (!src.d) return 0;
+    return scan_stream(decode_fill, &src, &src.d->buf, &src.d->cap, file, 
+                       opts, worker, out, binary);
+}
+
+/* --io=direct: the file is read with O_DIRECT in aligned blocks, around
+ * the page cache, and streamed through the scanner so memory stays
+ * bounded however large it is. The block is copied out because the
+ * carried partial line leaves the scan buffer unaligned. */
+typedef struct {
+    int fd;
+    int direct;                 /* O_DIRECT still set on fd */
+    char *block;
+    size_t have, pos;
+    int eof;
+    Worker *worker;
+} DirectReader;
+
+static void direct_read(DirectReader *r) {
+    r->have = r->pos = 0;
+    while (!r->eof) {
+        ssize_t n = read(r->fd, r->block, DIRECT_BLOCK_BYTES);
+        count_call(r->worker->profile, CALL_READ);
+        if (n < 0 && errno == EINTR) continue;
+        /* The file system turned down this transfer: go on buffered */
+        if (n < 0 && errno == EINVAL && r->direct) {
+            fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) & ~O_DIRECT);
+            r->direct = 0;
+            continue;
+        }
+        if (n <= 0) {
+            r->eof = 1;
+            break;
+        }
+        /* A short read ends at an unaligned offset that O_DIRECT cannot
+         * continue from; the rest, if any, is read buffered */
+        if ((size_t)n < DIRECT_BLOCK_BYTES && r->direct) {
+            fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) & ~O_DIRECT);
+            r->direct = 0;
+        }
+        r->have = (size_t)n;
+        break;
+    }
+}
+
+static long direct_fill(void *source, char *out, size_t cap, int *eof) {
+    DirectReader *r = source;
+    
+    if (r->pos == r->have) direct_read(r);
+    size_t n = r->have - r->pos < cap ? r->have - r->pos : cap;
+    memcpy(out, r->block + r->pos, n);
+    r->pos += n;
+    *eof = r->eof && r->pos == r->have;
+    return (long)n;
+}
+
+/* Switch fd to O_DIRECT and read the first block. Returns 0 with fd
+ * rewound and buffered when the file system has no O_DIRECT, or when
+ * -z finds the file compressed: the decoders want it whole. */
+static int direct_start(DirectReader *r, int fd, Worker *worker, 
+                        const SearchOptions *opts) {
+#ifdef O_DIRECT
+    if (!worker->direct_buf &&
+        posix_memalign((void **)&worker->direct_buf, DIRECT_ALIGN, 
+                       DIRECT_BLOCK_BYTES) != 0) {
+        worker->direct_buf = NULL;
+        return 0;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) != 0) return 0;
+    
+    r->fd = fd;
+    r->direct = 1;
+    r->block = worker->direct_buf;
+    r->eof = 0;
+    r->worker = worker;
+    direct_read(r);
+    if (opts->decompress && detect_codec(r->block, r->have) != CODEC_NONE) {
+        fcntl(fd, F_SETFL, flags);
+        lseek(fd, 0, SEEK_SET);
+        return 0;
+    }
+    return 1;
+#else
+    (void)r; (void)fd; (void)worker; (void)opts;
+    return 0;
+#endif
+}
+
+/* A large file scanned in chunks by several workers. Chunks end on
+ * line boundaries and each prints into its own buffer, which moves to
+ * the file's output as soon as every chunk before it is done. With
+ * line numbers, each chunk
+ * first counts its newlines and the running sum gives every chunk its
+ * first line number. */
+typedef struct SplitFile {
+    const char *data;
+    size_t len;
+    DirNode *dir;
+    const char *name;
+    const SearchOptions *opts;
+    int nchunks;
+    atomic_int next;        /* next chunk to claim */
+    atomic_int refs;        /* the owner and each queued helper */
+    atomic_long matches;
+    FileMatch *outs;        /* per chunk */
+    unsigned char *finished;    /* per chunk: scanned, output not moved yet */
+    FileMatch *out;         /* the file's output */
+    OutputSink *sink;       /* unordered mode: where out is written in parts */
+    int emitted;            /* chunks moved to out */
+    long *lines;            /* per chunk: newlines, then first line number */
+    int numbered;           /* line numbers are printed */
+    int ready;              /* chunks 0..ready have their first line number */
+    int done;               /* chunks finished; all three under lock */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} SplitFile;
+
+/* Start of chunk k: just past the first newline at or after its nominal
+ * start, so no line is cut */
+static size_t split_boundary(const SplitFile *sf, int k) {
+    size_t at = (size_t)k * SPLIT_CHUNK_BYTES;
+    
+    if (k == 0) return 0;
+    if (at >= sf->len) return sf->len;
+    const char *nl = memchr(sf->data + at - 1, '\n', sf->len - at + 1);
+    return nl ? (size_t)(nl - sf->data) + 1 : sf->len;
+}
+
+/* Publish the newline count of chunk k (lines[] holds -1 until then)
+ * and extend the prefix sum as far as the counts in hand allow */
+static void split_counted(SplitFile *sf, int k, long newlines) {
+    pthread_mutex_lock(&sf->lock);
+    sf->lines[k + 1] = newlines;
+    while (sf->ready < sf->nchunks && sf->lines[sf->ready + 1] >= 0) {
+        sf->lines[sf->ready + 1] += sf->lines[sf->ready];
+        sf->ready++;
+    }
+    pthread_cond_broadcast(&sf->cond);
+    pthread_mutex_unlock(&sf->lock);
+}
+
+/* Move finished chunks to the file's output in file order, freeing
+ * their buffers. In unordered mode out goes to the sink in parts as it
+ * fills, so a file with huge output is never held whole. Called with
+ * sf->lock held. */
+static void split_emit(SplitFile *sf) {
+    while (sf->emitted < sf->nchunks && sf->finished[sf->emitted]) {
+        FileMatch *chunk = &sf->outs[sf->emitted++];
+        if (chunk->len == 0) continue;
+        fm_append(sf->out, chunk->data, chunk->len);
+        sf->out->count++;
+        free(chunk->data);
+        memset(chunk, 0, sizeof(*chunk));
+        if (sf->sink && sf->out->len >= OUTPUT_BATCH_BYTES) {
+            sink_submit(sf->sink, sf->out, 1);
+        }
+    }
+}
+
+/* Claim and scan chunks until none are left. Chunks are claimed in file
+ * order, so the counts a chunk waits for are already being taken. */
+static void split_work(SplitFile *sf, Worker *worker) {
+    const KeywordMatcher *m = sf->opts->matcher;
+    
+    for (;;) {
+        int k = atomic_fetch_add(&sf->next, 1);
+        if (k >= sf->nchunks) break;
+        
+        size_t from = split_boundary(sf, k), to = split_boundary(sf, k + 1);
+        long first_line = 1;
+        
+        /* Start reading the whole chunk at once rather than one fault at
+         * a time, so each worker keeps the device busy */
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t aligned = from & ~(page - 1);
+        if (from < to) madvise((void *)(sf->data + aligned), to - aligned, MADV_WILLNEED);
+        
+        if (sf->numbered) {
+            split_counted(sf, k, m->count_newlines(sf->data + from, sf->data + to));
+            pthread_mutex_lock(&sf->lock);
+            while (sf->ready < k) pthread_cond_wait(&sf->cond, &sf->lock);
+            first_line = sf->lines[k];
+            pthread_mutex_unlock(&sf->lock);
+        }
+        
+        if (from < to) {
+            FileRef file = { sf->dir, sf->name, NULL, 0 };
+            ScanCursor at = { first_line, (long)from, 0, 0, 0, 0, 0, 0 };
+            long found = scan_buffer(sf->data + from, to - from, &file, sf->opts,
+                                     worker, &sf->outs[k], 0, &at);
+            atomic_fetch_add(&sf->matches, found);
+        }
+        
+        pthread_mutex_lock(&sf->lock);
+        sf->finished[k] = 1;
+        split_emit(sf);
+        if (++sf->done == sf->nchunks) pthread_cond_broadcast(&sf->cond);
+        pthread_mutex_unlock(&sf->lock);
+    }
+}
+
+static void split_release(SplitFile *sf) {
+    if (atomic_fetch_sub(&sf->refs, 1) != 1) return;
+    for (int k = 0; k < sf->nchunks; k++) free(sf->outs[k].data);
+    free(sf->outs);
+    free(sf->finished);
+    free(sf->lines);
+    pthread_mutex_destroy(&sf->lock);
+    pthread_cond_destroy(&sf->cond);
+    free(sf);
+}
+
+/* Workers that could help with a split file: the other local ones, or
+ * for a network mount those its --device-jobs limit leaves */
+static int split_helpers(const Worker *worker) {
+    const WorkPool *pool = worker->pool;
+    
+    if (!worker->remote) return pool->nworkers - 1;
+    return (pool->device_jobs < pool->nremote ? pool->device_jobs 
+                                              : pool->nremote) - 1;
+}
+
+/* Whether a mapped file is worth splitting among workers. Per-file
+ * and total limits and context need one pass in order (chunks would
+ * claim --max-total lines as they finish, not in file order), and -l
+ * stops at the first hit anyway, so those keep the single-worker scan. */
+static int should_split(const FileView *view, const SearchOptions *opts,
+                        const Worker *worker) {
+    return view->mapped && view->len >= SPLIT_MIN_BYTES && 
+           split_helpers(worker) > 0 &&
+           !opts->only_matching_files && opts->max_count == 0 &&
+           opts->max_total == 0 && !opts->context;
+}
+
+/* Scan a text file in SPLIT_CHUNK_BYTES pieces: queue helpers where
+ * idle workers steal first, work through chunks alongside them, then
+ * wait for the last one. Returns the number of matches, or -1 if the
+ * file should be scanned the normal way. */
+static long scan_split(const FileView *view, FileRef *file, 
+                       const SearchOptions *opts, Worker *worker, 
+                       FileMatch *out) {
+    SplitFile *sf = calloc(1, sizeof(SplitFile));
+    int nchunks = (int)((view->len + SPLIT_CHUNK_BYTES - 1) / SPLIT_CHUNK_BYTES);
+    
+    if (!sf || !(sf->outs = calloc((size_t)nchunks, sizeof(FileMatch))) ||
+        !(sf->finished = calloc((size_t)nchunks, 1)) ||
+        !(sf->lines = malloc((size_t)(nchunks + 1) * sizeof(long)))) {
+        if (sf) {
+            free(sf->outs);
+            free(sf->finished);
+        }
+        free(sf);
+        return -1;
+    }
+    sf->lines[0] = 1;
+    for (int k = 1; k <= nchunks; k++) sf->lines[k] = -1;
+    sf->numbered = opts->show_line_numbers && !opts->count_only;
+    sf->data = view->data;
+    sf->len = view->len;
+    sf->dir = file->dir;
+    sf->name = file->name;
+    sf->opts = opts;
+    sf->nchunks = nchunks;
+    sf->out = out;
+    sf->sink = out == &worker->out ? worker->pool->sink : NULL;
+    pthread_mutex_init(&sf->lock, NULL);
+    pthread_cond_init(&sf->cond, NULL);
+    
+    int helpers = split_helpers(worker);
+    if (helpers > nchunks - 1) helpers = nchunks - 1;
+    atomic_init(&sf->next, 0);
+    atomic_init(&sf->refs, 1 + helpers);
+    atomic_init(&sf->matches, 0);
+    for (int k = 0; k < helpers; k++) {
+        WorkItem work = { WORK_CHUNK, file->dir, NULL, NULL, 0, sf, NULL, 0 };
+        atomic_fetch_add(&file->dir->refs, 1);
+        pool_push_item(worker, &work, 1);
+    }
+    
+    split_work(sf, worker);
+    pthread_mutex_lock(&sf->lock);
+    while (sf->done < nchunks) pthread_cond_wait(&sf->cond, &sf->lock);
+    pthread_mutex_unlock(&sf->lock);
+    
+    long matches = atomic_load(&sf->matches);
+    split_release(sf);
+    return matches;
+}
+
+/* Path of a file relative to the walk's start directory */
+static const char *relative_path(Worker *worker, FileRef *file, size_t *len) {
+    const DirNode *root = file->dir;
+    size_t full_len;
+    
+    while (root->parent) root = root->parent;
+    const char *path = file_path(worker, file, &full_len);
+    if (full_len <= root->name_len) {
+        *len = full_len;
+        return path;
+    }
+    *len = full_len - root->name_len - 1;
+    return path + root->name_len + 1;
+}
+
+static uint64_t hash_bytes(const char *p, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static int index_cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Collect the sorted, unique folded trigrams of a buffer into b->tris.
+ * Returns the count, or -1 if the file has too many to be worth it. */
+static long collect_trigrams(IndexBuilder *b, const unsigned char *p, size_t len) {
+    size_t start = b->tri_count;
+    long count = 0;
+    
+    if (len < 3) return 0;
+    
+    uint32_t t = ((uint32_t)fold_table[p[0]] << 8) | fold_table[p[1]];
+    for (size_t i = 2; i < len; i++) {
+        t = ((t << 8) | fold_table[p[i]]) & 0xffffff;
+        if (b->seen[t >> 6] & (1ULL << (t & 63))) continue;
+        
+        b->seen[t >> 6] |= 1ULL << (t & 63);
+        if (b->tri_count == b->tri_cap) {
+            size_t new_cap = b->tri_cap ? b->tri_cap * 2 : 1 << 16;
+            uint32_t *grown = realloc(b->tris, new_cap * sizeof(uint32_t));
+            if (!grown) {
+                count = -1;
+                break;
+            }
+            b->tris = grown;
+            b->tri_cap = new_cap;
+        }
+        b->tris[b->tri_count++] = t;
+        if (++count > INDEX_MAX_TRIGRAMS) {
+            count = -1;
+            break;
+        }
+    }
+    
+    /* Reset only the bits this file set */
+    for (size_t k = start; k < b->tri_count; k++) {
+        uint32_t u = b->tris[k];
+        b->seen[u >> 6] &= ~(1ULL << (u & 63));
+    }
+    
+    if (count < 0) {
+        b->tri_count = start;
+        return -1;
+    }
+    qsort(b->tris + start, (size_t)count, sizeof(uint32_t), index_cmp_u32);
+    return count;
+}
+
+/* Id of a file in an index by relative path, or INDEX_NO_ID */
+static uint32_t index_lookup(const SearchIndex *index, Worker *worker,
+                             FileRef *file) {
+    size_t len;
+    const char *rel = relative_path(worker, file, &len);
+    size_t h = (size_t)hash_bytes(rel, len);
+    
+    for (;; h++) {
+        uint32_t id = index->slots[h & index->slot_mask];
+        if (!id) return INDEX_NO_ID;    /* new since the index was built */
+        const IndexFileEntry *f = &index->files[id - 1];
+        if (f->path_len == len && memcmp(index->strings + f->path_off, rel, len) == 0) {
+            return id - 1;
+        }
+    }
+}
+
+/* An entry still describes a file if size, inode and mtime agree */
+static int index_entry_current(const IndexFileEntry *f, const struct stat *st) {
+    return (uint64_t)st->st_size == f->size &&
+           (uint64_t)st->st_ino == f->ino &&
+           (int64_t)st->st_mtim.tv_sec == f->mtime_sec &&
+           (int64_t)st->st_mtim.tv_nsec == f->mtime_nsec;
+}
+
+static int stat_entry(Worker *worker, FileRef *file, struct stat *st) {
+    int follow = worker->pool->opts->follow_links;
+    size_t len;
+    
+    count_call(worker->profile, CALL_STAT);
+    if (file->dir->fd >= 0) {
+        return fstatat(file->dir->fd, file->name, st, 
+                       follow ? 0 : AT_SYMLINK_NOFOLLOW);
+    }
+    const char *path = file_path(worker, file, &len);
+    return follow ? stat(path, st) : lstat(path, st);
+}
+
+/* O_NOFOLLOW unless -L asked for links to be followed */
+static int nofollow_flag(const SearchOptions *opts) {
+    return opts->follow_links ? 0 : O_NOFOLLOW;
+}
+
+/* (device, inode) pairs reached so far, for -L cycles and --dedup. The
+ * set is split into stripes by hash, each an open-addressed table with
+ * its own lock, so workers rarely wait on one another. {0, 0} marks a
+ * free slot; no file has inode 0. */
+#define VISITED_STRIPES 64
+#define VISITED_MIN_SLOTS 256
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+} InodeKey;
+
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;  /* a cache line per stripe */
+    InodeKey *slots;
+    size_t mask;
+    size_t count;
+} VisitedStripe;
+
+typedef struct VisitedSet {
+    VisitedStripe stripes[VISITED_STRIPES];
+} VisitedSet;
+
+static uint64_t inode_hash(uint64_t dev, uint64_t ino) {
+    uint64_t h = (ino ^ (dev * 0x9e3779b97f4a7c15ULL)) * 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 31);
+}
+
+static VisitedSet *visited_new(void) {
+    VisitedSet *set = aligned_alloc(64, sizeof(VisitedSet));
+    if (!set) return NULL;
+    memset(set, 0, sizeof(VisitedSet));
+    for (int k = 0; k < VISITED_STRIPES; k++) {
+        pthread_mutex_init(&set->stripes[k].lock, NULL);
+    }
+    return set;
+}
+
+static void visited_free(VisitedSet *set) {
+    if (!set) return;
+    for (int k = 0; k < VISITED_STRIPES; k++) {
+        pthread_mutex_destroy(&set->stripes[k].lock);
+        free(set->stripes[k].slots);
+    }
+    free(set);
+}
+
+/* Double a stripe's table; the caller holds its lock */
+static int visited_grow(VisitedStripe *s) {
+    size_t slots = s->slots ? (s->mask + 1) * 2 : VISITED_MIN_SLOTS;
+    InodeKey *table = calloc(slots, sizeof(InodeKey));
+    if (!table) return 0;
+    
+    for (size_t k = 0; s->slots && k <= s->mask; k++) {
+        InodeKey key = s->slots[k];
+        if (!key.dev && !key.ino) continue;
+        size_t i = inode_hash(key.dev, key.ino) & (slots - 1);
+        while (table[i].dev || table[i].ino) i = (i + 1) & (slots - 1);
+        table[i] = key;
+    }
+    free(s->slots);
+    s->slots = table;
+    s->mask = slots - 1;
+    return 1;
+}
+
+/* Record st's inode; 0 if it was there already. A file that cannot be
+ * recorded counts as new, so nothing is skipped for lack of memory. */
+static int visited_add(VisitedSet *set, const struct stat *st) {
+    uint64_t dev = (uint64_t)st->st_dev, ino = (uint64_t)st->st_ino;
+    uint64_t h = inode_hash(dev, ino);
+    VisitedStripe *s = &set->stripes[h >> 58];
+    int added = 1;
+    
+    pthread_mutex_lock(&s->lock);
+    /* Tables stay at most half full */
+    if ((!s->slots || (s->count + 1) * 2 > s->mask + 1) && !visited_grow(s)) {
+        pthread_mutex_unlock(&s->lock);
+        return 1;
+    }
+    size_t i = h & s->mask;
+    while (s->slots[i].dev || s->slots[i].ino) {
+        if (s->slots[i].dev == dev && s->slots[i].ino == ino) {
+            added = 0;
+            break;
+        }
+        i = (i + 1) & s->mask;
+    }
+    if (added) {
+        s->slots[i].dev = dev;
+        s->slots[i].ino = ino;
+        s->count++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return added;
+}
+
+/* The index file sits in the indexed directory but is not part of it */
+static int is_index_file(const FileRef *file) {
+    return file->dir->parent == NULL && strcmp(file->name, INDEX_FILE_NAME) == 0;
+}
+
+/* Index one file: record its identity and trigram set. When updating,
+ * files the previous index still describes are carried over unread. */
+int index_file(FileRef *file, Worker *worker) {
+    const SearchIndex *prev = worker->pool->opts->index;
+    IndexBuilder *b = worker->indexer;
+    uint32_t old_id = INDEX_NO_ID;
+    struct stat st;
+    int fd = -1;
+    
+    if (is_index_file(file)) {
+        return 0;
+    }
+    
+    if (prev) {
+        old_id = index_lookup(prev, worker, file);
+        if (old_id != INDEX_NO_ID && 
+            (stat_entry(worker, file, &st) != 0 ||
+             !index_entry_current(&prev->files[old_id], &st))) {
+            old_id = INDEX_NO_ID;
+        }
+    }
+    
+    if (old_id == INDEX_NO_ID) {
+        if (!b->seen && !(b->seen = calloc((1 << 24) / 64, sizeof(uint64_t)))) {
+            return 0;
+        }
+        fd = open_entry(worker, file->dir, file->name, 
+                        O_RDONLY | nofollow_flag(worker->pool->opts), file);
+        if (fd < 0) return 0;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return 0;
+        }
+    }
+    
+    if (b->count == b->cap) {
+        size_t new_cap = b->cap ? b->cap * 2 : 1024;
+        IndexedFile *grown = realloc(b->files, new_cap * sizeof(IndexedFile));
+        if (!grown) {
+            if (fd >= 0) close(fd);
+            return 0;
+        }
+        b->files = grown;
+        b->cap = new_cap;
+    }
+    
+    size_t rel_len;
+    const char *rel = relative_path(worker, file, &rel_len);
+    IndexedFile *entry = &b->files[b->count];
+    entry->path = malloc(rel_len + 1);
+    if (!entry->path) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    memcpy(entry->path, rel, rel_len);
+    entry->path[rel_len] = '\0';
+    entry->st = st;
+    entry->tri_off = b->tri_count;
+    entry->tri_count = 0;
+    entry->flags = 0;
+    entry->old_id = old_id;
+    b->count++;
+    worker->stats.files_searched++;
+    worker->stats.total_size += st.st_size;
+    
+    if (old_id != INDEX_NO_ID) {
+        entry->flags = prev->files[old_id].flags;
+        b->reused++;
+        return 1;
+    }
+    
+    FileView view;
+    long count = -1;
+    if (load_file(fd, &st, worker, &view)) {
+        count = collect_trigrams(b, (const unsigned char *)view.data, view.len);
+        release_file(&view);
+    }
+    close(fd);
+    
+    if (count < 0) {
+        entry->flags |= INDEX_UNINDEXED;
+    } else {
+        entry->tri_count = (uint32_t)count;
+    }
+    return 1;
+}
+
+static int index_cmp_files(const void *a, const void *b) {
+    const IndexedFile *x = *(IndexedFile *const *)a;
+    const IndexedFile *y = *(IndexedFile *const *)b;
+    return strcmp(x->path, y->path);
+}
+
+/* Append an unsigned LEB128 varint */
+static size_t put_varint(unsigned char *out, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+/* Read one varint, never past end */
+static uint32_t get_varint(const unsigned char **p, const unsigned char *end) {
+    uint64_t value = 0;
+    int shift = 0;
+    
+    while (*p < end && (**p & 0x80)) {
+        value |= (uint64_t)(*(*p)++ & 0x7f) << shift;
+        shift += 7;
+    }
+    if (*p < end) value |= (uint64_t)*(*p)++ << shift;
+    return (uint32_t)value;
+}
+
+/* Count (ids == NULL) or place the postings of carried-over files */
+static size_t replay_postings(const SearchIndex *prev, const uint32_t *new_of_old,
+                            uint32_t *counts, uint32_t *ids) {
+    const unsigned char *end = prev->postings + 
+                               (prev->map_len - prev->hdr->postings_off);
+    size_t pairs = 0;
+    
+    for (uint64_t k = 0; k < prev->hdr->ntrigrams; k++) {
+        const IndexTrigram *entry = &prev->trigrams[k];
+        const unsigned char *p = prev->postings + entry->offset;
+        uint32_t id = 0;
+        
+        for (uint32_t j = 0; j < entry->count && p < end; j++) {
+            id += get_varint(&p, end);
+            if (id >= prev->hdr->nfiles || new_of_old[id] == INDEX_NO_ID) continue;
+            if (ids) {
+                ids[counts[entry->trigram]++] = new_of_old[id];
+            } else {
+                counts[entry->trigram]++;
+            }
+            pairs++;
+        }
+    }
+    return pairs;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+/* Merge every worker's results, plus the postings of files carried over
+ * from the previous index, and write DIR/.walkindex atomically */
+int write_index(const SearchOptions *opts, Worker *workers, int nworkers,
+                long *files_out, long *trigrams_out) {
+    const SearchIndex *prev = opts->index;
+    size_t nfiles = 0, strings_len = 0;
+    uint32_t *new_of_old = NULL;
+    int ok = 0;
+    
+    for (int w = 0; w < nworkers; w++) {
+        if (workers[w].indexer) nfiles += workers[w].indexer->count;
+    }
+    
+    IndexedFile **order = malloc((nfiles ? nfiles : 1) * sizeof(IndexedFile *));
+    uint32_t *counts = calloc(1 << 24, sizeof(uint32_t));
+    IndexFileEntry *entries = calloc(nfiles ? nfiles : 1, sizeof(IndexFileEntry));
+    uint32_t *builder_of = malloc((nfiles ? nfiles : 1) * sizeof(uint32_t));
+    uint32_t *ids = NULL;
+    IndexTrigram *table = NULL;
+    unsigned char *postings = NULL;
+    if (!order || !counts || !entries || !builder_of) goto done;
+    if (prev) {
+        new_of_old = malloc(((size_t)prev->hdr->nfiles + 1) * sizeof(uint32_t));
+        if (!new_of_old) goto done;
+        memset(new_of_old, 0xff, ((size_t)prev->hdr->nfiles + 1) * sizeof(uint32_t));
+    }
+    
+    size_t n = 0;
+    for (int w = 0; w < nworkers; w++) {
+        IndexBuilder *b = workers[w].indexer;
+        for (size_t k = 0; b && k < b->count; k++) {
+            order[n++] = &b->files[k];
+        }
+    }
+    qsort(order, nfiles, sizeof(IndexedFile *), index_cmp_files);
+    
+    /* Posting list sizes, then file ids bucketed by trigram in id order */
+    size_t pairs = 0;
+    for (size_t id = 0; id < nfiles; id++) {
+        const IndexedFile *f = order[id];
+        const uint32_t *tris = NULL;
+        for (int w = 0; w < nworkers; w++) {
+            IndexBuilder *b = workers[w].indexer;
+            if (b && f >= b->files && f < b->files + b->count) {
+                tris = b->tris + f->tri_off;
+                builder_of[id] = (uint32_t)w;
+            }
+        }
+        for (uint32_t k = 0; tris && k < f->tri_count; k++) counts[tris[k]]++;
+        pairs += f->tri_count;
+        strings_len += strlen(f->path);
+        if (f->old_id != INDEX_NO_ID) new_of_old[f->old_id] = (uint32_t)id;
+    }
+    if (prev) {
+        pairs += replay_postings(prev, new_of_old, counts, NULL);
+    }
+    
+    size_t ntrigrams = 0;
+    for (uint32_t t = 0; t < (1u << 24); t++) {
+        if (counts[t]) ntrigrams++;
+    }
+    table = calloc(ntrigrams ? ntrigrams : 1, sizeof(IndexTrigram));
+    ids = malloc((pairs ? pairs : 1) * sizeof(uint32_t));
+    if (!table || !ids) goto done;
+    
+    /* counts[] becomes each trigram's fill cursor into ids[] */
+    size_t slot = 0, cursor = 0;
+    for (uint32_t t = 0; t < (1u << 24); t++) {
+        if (!counts[t]) continue;
+        table[slot].trigram = t;
+        table[slot].count = counts[t];
+        slot++;
+        uint32_t c = counts[t];
+        counts[t] = (uint32_t)cursor;
+        cursor += c;
+    }
+    for (size_t id = 0; id < nfiles; id++) {
+        const IndexedFile *f = order[id];
+        const uint32_t *tris = workers[builder_of[id]].indexer->tris + f->tri_off;
+        for (uint32_t k = 0; k < f->tri_count; k++) {
+            ids[counts[tris[k]]++] = (uint32_t)id;
+        }
+    }
+    
+    /* Carried-over ids land after the fresh ones; re-sort mixed lists */
+    if (prev) {
+        replay_postings(prev, new_of_old, counts, ids);
+        cursor = 0;
+        for (size_t k = 0; k < ntrigrams; k++) {
+            uint32_t *list = ids + cursor;
+            for (uint32_t j = 1; j < table[k].count; j++) {
+                if (list[j - 1] > list[j]) {
+                    qsort(list, table[k].count, sizeof(uint32_t), index_cmp_u32);
+                    break;
+                }
+            }
+            cursor += table[k].count;
+        }
+    }
+    
+    /* Encode each list as varint deltas */
+    postings = malloc(pairs * 5 + 1);
+    if (!postings) goto done;
+    size_t post_len = 0;
+    cursor = 0;
+    for (size_t k = 0; k < ntrigrams; k++) {
+        uint32_t prev = 0;
+        table[k].offset = post_len;
+        for (uint32_t j = 0; j < table[k].count; j++) {
+            uint32_t id = ids[cursor++];
+            post_len += put_varint(postings + post_len, id - prev);
+            prev = id;
+        }
+    }
+    
+    IndexHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, INDEX_MAGIC, 8);
+    hdr.version = INDEX_VERSION;
+    hdr.nfiles = (uint32_t)nfiles;
+    hdr.ntrigrams = ntrigrams;
+    hdr.files_off = sizeof(hdr);
+    hdr.strings_off = hdr.files_off + nfiles * sizeof(IndexFileEntry);
+    hdr.trigrams_off = (hdr.strings_off + strings_len + 7) & ~(uint64_t)7;
+    hdr.postings_off = hdr.trigrams_off + ntrigrams * sizeof(IndexTrigram);
+    hdr.file_size = hdr.postings_off + post_len;
+    
+    uint32_t path_off = 0;
+    for (size_t id = 0; id < nfiles; id++) {
+        const IndexedFile *f = order[id];
+        entries[id].mtime_sec = (int64_t)f->st.st_mtim.tv_sec;
+        entries[id].mtime_nsec = (int64_t)f->st.st_mtim.tv_nsec;
+        entries[id].size = (uint64_t)f->st.st_size;
+        entries[id].ino = (uint64_t)f->st.st_ino;
+        entries[id].path_off = path_off;
+        entries[id].path_len = (uint32_t)strlen(f->path);
+        entries[id].flags = f->flags;
+        path_off += entries[id].path_len;
+    }
+    
+    char path[MAX_PATH + 32], tmp[MAX_PATH + 40];
+    snprintf(path, sizeof(path), "%s/%s", opts->start_dir, INDEX_FILE_NAME);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) goto done;
+    
+    static const char zeros[8];
+    ok = write_all(fd, &hdr, sizeof(hdr)) &&
+         write_all(fd, entries, nfiles * sizeof(IndexFileEntry));
+    for (size_t id = 0; ok && id < nfiles; id++) {
+        ok = write_all(fd, order[id]->path, entries[id].path_len);
+    }
+    ok = ok && write_all(fd, zeros, hdr.trigrams_off - hdr.strings_off - strings_len) &&
+         write_all(fd, table, ntrigrams * sizeof(IndexTrigram)) &&
+         write_all(fd, postings, post_len);
+    ok = (close(fd) == 0) && ok;
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok) unlink(tmp);
+    
+    *files_out = (long)nfiles;
+    *trigrams_out = (long)ntrigrams;
+    
+done:
+    free(new_of_old);
+    free(order);
+    free(counts);
+    free(entries);
+    free(builder_of);
+    free(ids);
+    free(table);
+    free(postings);
+    return ok;
+}
+
+static void free_builder(IndexBuilder *b) {
+    if (!b) return;
+    for (size_t k = 0; k < b->count; k++) free(b->files[k].path);
+    free(b->files);
+    free(b->tris);
+    free(b->seen);
+    free(b);
+}
+
+/* Map DIR/.walkindex and check it is one of ours */
+SearchIndex *load_index(const char *dir) {
+    char path[MAX_PATH + 32];
+    struct stat st;
+    
+    snprintf(path, sizeof(path), "%s/%s", dir, INDEX_FILE_NAME);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IndexHeader)) {
+        close(fd);
+        return NULL;
+    }
+    
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    
+    const IndexHeader *hdr = map;
+    if (memcmp(hdr->magic, INDEX_MAGIC, 8) != 0 || 
+        hdr->version != INDEX_VERSION ||
+        hdr->file_size != (uint64_t)st.st_size ||
+        hdr->strings_off < hdr->files_off ||
+        hdr->files_off + (uint64_t)hdr->nfiles * sizeof(IndexFileEntry) > hdr->strings_off ||
+        hdr->postings_off > hdr->file_size ||
+        hdr->trigrams_off + hdr->ntrigrams * sizeof(IndexTrigram) > hdr->postings_off) {
+        munmap(map, (size_t)st.st_size);
+        return NULL;
+    }
+    
+    SearchIndex *index = calloc(1, sizeof(SearchIndex));
+    if (!index) {
+        munmap(map, (size_t)st.st_size);
+        return NULL;
+    }
+    index->map = map;
+    index->map_len = (size_t)st.st_size;
+    index->hdr = hdr;
+    index->files = (const IndexFileEntry *)((const char *)map + hdr->files_off);
+    index->strings = (const char *)map + hdr->strings_off;
+    index->trigrams = (const IndexTrigram *)((const char *)map + hdr->trigrams_off);
+    index->postings = (const unsigned char *)map + hdr->postings_off;
+    
+    /* Open-addressed path table at most half full */
+    size_t slots = 16;
+    while (slots < (size_t)hdr->nfiles * 2) slots *= 2;
+    index->slots = calloc(slots, sizeof(uint32_t));
+    index->slot_mask = slots - 1;
+    if (!index->slots) {
+        free_index(index);
+        return NULL;
+    }
+    for (uint32_t id = 0; id < hdr->nfiles; id++) {
+        const IndexFileEntry *f = &index->files[id];
+        size_t h = (size_t)hash_bytes(index->strings + f->path_off, f->path_len);
+        while (index->slots[h & index->slot_mask]) h++;
+        index->slots[h & index->slot_mask] = id + 1;
+    }
+    
+    return index;
+}
+
+void free_index(SearchIndex *index) {
+    if (!index) return;
+    free(index->slots);
+    free(index->candidate);
+    munmap((void *)index->map, index->map_len);
+    free(index);
+}
+
+static const IndexTrigram *find_trigram(const SearchIndex *index, uint32_t t) {
+    size_t lo = 0, hi = index->hdr->ntrigrams;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index->trigrams[mid].trigram < t) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo < index->hdr->ntrigrams && index->trigrams[lo].trigram == t) {
+        return &index->trigrams[lo];
+    }
+    return NULL;
+}
+
+/* Mark files that contain every trigram of a literal; returns 0 if the
+ * literal is too short for the index to say anything about it */
+static int mark_literal(SearchIndex *index, const char *lit, size_t len,
+                        uint16_t *hits) {
+    uint32_t nfiles = index->hdr->nfiles;
+    uint32_t tris[256];
+    int ntris = 0;
+    
+    if (len < 3) return 0;
+    
+    for (size_t i = 0; i + 3 <= len && ntris < 256; i++) {
+        uint32_t t = ((uint32_t)fold_table[(unsigned char)lit[i]] << 16) |
+                     ((uint32_t)fold_table[(unsigned char)lit[i + 1]] << 8) |
+                     fold_table[(unsigned char)lit[i + 2]];
+        int dup = 0;
+        for (int k = 0; k < ntris; k++) dup |= tris[k] == t;
+        if (!dup) tris[ntris++] = t;
+    }
+    
+    memset(hits, 0, nfiles * sizeof(uint16_t));
+    for (int k = 0; k < ntris; k++) {
+        const IndexTrigram *entry = find_trigram(index, tris[k]);
+        if (!entry) return 1;   /* no file has it */
+        
+        const unsigned char *p = index->postings + entry->offset;
+        const unsigned char *end = index->postings + 
+                                   (index->map_len - index->hdr->postings_off);
+        uint32_t id = 0;
+        for (uint32_t j = 0; j < entry->count && p < end; j++) {
+            id += get_varint(&p, end);
+            if (id < nfiles && hits[id] == k) hits[id]++;
+        }
+    }
+    
+    for (uint32_t id = 0; id < nfiles; id++) {
+        if (hits[id] == ntris) index->candidate[id] = 1;
+    }
+    return 1;
+}
+
+/* Work out, once per query, which indexed files could match */
+void prepare_index(SearchIndex *index, const SearchOptions *opts) {
+    uint32_t nfiles = index->hdr->nfiles;
+    uint16_t *hits = malloc((nfiles ? nfiles : 1) * sizeof(uint16_t));
+    
+    const KeywordMatcher *m = opts->matcher;
+    
+    /* A file is a candidate if it holds any literal the automaton looks
+     * for; keywords that make every line a candidate rule pruning out */
+    index->candidate = calloc(nfiles ? nfiles : 1, 1);
+    index->usable = hits && index->candidate && !m->every_line;
+    
+    /* Trigrams were taken from the raw bytes, not decoded content */
+    if (opts->decompress) index->usable = 0;
+    
+    for (int j = 0; index->usable && j < m->nlits; j++) {
+        const char *lit = m->lits[j].text;
+        size_t len = m->lits[j].len;
+        
+        if (memchr(lit, '\n', len)) continue;    /* never matches content */
+        if (!mark_literal(index, lit, len, hits)) index->usable = 0;
+    }
+    
+    for (uint32_t id = 0; id < nfiles; id++) {
+        if (index->files[id].flags & INDEX_UNINDEXED) index->candidate[id] = 1;
+    }
+    free(hits);
+}
+
+/* True if the index proves this file cannot match. st is filled in. */
+static int index_prunes(const SearchIndex *index, FileRef *file, 
+                        Worker *worker, struct stat *st) {
+    if (!index->usable) return 0;
+    
+    uint32_t id = index_lookup(index, worker, file);
+    if (id == INDEX_NO_ID || index->candidate[id]) return 0;
+    
+    return stat_entry(worker, file, st) == 0 && 
+           index_entry_current(&index->files[id], st);
+}
+
+/* Hash of every option that changes what a file's content search
+ * prints, so each query has its own records in a shared cache */
+static uint64_t cache_query(const SearchOptions *opts) {
+    long shape[] = {
+        CACHE_VERSION, opts->keyword_count, opts->regex_keywords,
+        opts->case_sensitive, opts->show_line_numbers, opts->json,
+        opts->count_only, opts->only_matching_files, opts->max_count,
+        opts->before_context, opts->after_context, opts->context,
+        opts->binary_mode,
+        opts->decompress,
+    };
+    uint64_t h = hash_bytes((const char *)shape, sizeof(shape));
+    
+    for (int k = 0; k < opts->keyword_count; k++) {
+        h = (h ^ hash_bytes(opts->keywords[k], opts->keyword_len[k])) * 1099511628211ULL;
+    }
+    /* Printed paths start with the start directory */
+    return (h ^ hash_bytes(opts->start_dir, strlen(opts->start_dir))) * 1099511628211ULL;
+}
+
+static size_t cache_record_size(const CacheRecord *r) {
+    return (sizeof(CacheRecord) + r->path_len + r->out_len + 7) & ~(size_t)7;
+}
+
+static size_t cache_hash(uint64_t query, const char *path, size_t len) {
+    return (size_t)(hash_bytes(path, len) ^ query);
+}
+
+/* Slot of (query, path) in the table: its record, or the empty slot
+ * where it belongs */
+static size_t cache_slot(const ResultCache *cache, uint64_t query, 
+                         const char *path, size_t len) {
+    size_t h = cache_hash(query, path, len);
+    
+    for (;; h++) {
+        uint64_t off = cache->slots[h & cache->slot_mask];
+        if (!off) return h & cache->slot_mask;
+        const CacheRecord *r = (const CacheRecord *)(cache->map + off - 1);
+        if (r->query == query && r->path_len == len &&
+            memcmp(r + 1, path, len) == 0) {
+            return h & cache->slot_mask;
+        }
+    }
+}
+
+/* Map the cache file and index its records; a missing or foreign file
+ * gives an empty cache that is written from scratch */
+ResultCache *load_cache(const char *path, const SearchOptions *opts) {
+    ResultCache *cache = calloc(1, sizeof(ResultCache));
+    struct stat st;
+    
+    if (!cache) return NULL;
+    strcpy(cache->path, path);
+    cache->query = cache_query(opts);
+    
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(CacheHeader)) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        const CacheHeader *hdr = map;
+        if (map != MAP_FAILED && (memcmp(hdr->magic, CACHE_MAGIC, 8) != 0 ||
+                                  hdr->version != CACHE_VERSION)) {
+            munmap(map, (size_t)st.st_size);
+        } else if (map != MAP_FAILED) {
+            cache->map = map;
+            cache->map_len = (size_t)st.st_size;
+            cache->dev = st.st_dev;
+            cache->ino = st.st_ino;
+        }
+    }
+    if (fd >= 0) close(fd);
+    
+    /* Count whole records; anything after the last one was cut short */
+    size_t off = sizeof(CacheHeader);
+    while (cache->map && off + sizeof(CacheRecord) <= cache->map_len) {
+        const CacheRecord *r = (const CacheRecord *)(cache->map + off);
+        if (cache_record_size(r) > cache->map_len - off) break;
+        off += cache_record_size(r);
+        cache->records++;
+    }
+    cache->valid_len = cache->map ? off : 0;
+    
+    size_t slots = 16;
+    while (slots < cache->records * 2) slots *= 2;
+    cache->slots = calloc(slots, sizeof(uint64_t));
+    cache->replaced = calloc(slots, 1);
+    cache->slot_mask = slots - 1;
+    if (!cache->slots || !cache->replaced) {
+        free_cache(cache);
+        return NULL;
+    }
+    for (off = sizeof(CacheHeader); off < cache->valid_len; ) {
+        const CacheRecord *r = (const CacheRecord *)(cache->map + off);
+        size_t slot = cache_slot(cache, r->query, (const char *)(r + 1), r->path_len);
+        if (!cache->slots[slot]) cache->live++;
+        cache->slots[slot] = off + 1;
+        off += cache_record_size(r);
+    }
+    return cache;
+}
+
+void free_cache(ResultCache *cache) {
+    if (!cache) return;
+    if (cache->map) munmap((void *)cache->map, cache->map_len);
+    free(cache->slots);
+    free(cache->replaced);
+    free(cache);
+}
+
+/* Queue a record of one file's results for write_cache() */
+static void cache_store(Worker *worker, ResultCache *cache, size_t slot, 
+                        const char *rel, size_t rel_len, const struct stat *st,
+                        long matches, const char *output, size_t out_len) {
+    CacheRecord r;
+    
+    memset(&r, 0, sizeof(r));
+    r.query = cache->query;
+    r.mtime_sec = (int64_t)st->st_mtim.tv_sec;
+    r.mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+    r.size = (uint64_t)st->st_size;
+    r.ino = (uint64_t)st->st_ino;
+    r.matches = matches;
+    r.path_len = (uint32_t)rel_len;
+    r.out_len = (uint32_t)out_len;
+    
+    size_t size = cache_record_size(&r);
+    if (worker->cache_cap - worker->cache_len < size) {
+        size_t new_cap = worker->cache_cap ? worker->cache_cap * 2 : 64 * 1024;
+        while (new_cap - worker->cache_len < size) new_cap *= 2;
+        char *grown = realloc(worker->cache_buf, new_cap);
+        if (!grown) return;
+        worker->cache_buf = grown;
+        worker->cache_cap = new_cap;
+    }
+    
+    char *p = worker->cache_buf + worker->cache_len;
+    memset(p, 0, size);
+    memcpy(p, &r, sizeof(r));
+    memcpy(p + sizeof(r), rel, rel_len);
+    if (out_len) memcpy(p + sizeof(r) + rel_len, output, out_len);
+    worker->cache_len += size;
+    
+    /* Each path is searched once, so no other worker writes this slot */
+    if (cache->slots[slot]) {
+        cache->replaced[slot] = 1;
+        worker->cache_stale++;
+    }
+}
+
+/* Append this run's records to the cache file. The file is rewritten
+ * instead when it is new, ends in a torn record, or mostly holds
+ * superseded ones. Returns 0 on failure. */
+int write_cache(ResultCache *cache, Worker *workers, int nworkers) {
+    size_t added = 0;
+    long stale = (long)(cache->records - cache->live);
+    
+    for (int w = 0; w < nworkers; w++) {
+        added += workers[w].cache_len;
+        stale += workers[w].cache_stale;
+    }
+    int rewrite = !cache->map || cache->valid_len != cache->map_len ||
+                  (stale > CACHE_MIN_STALE && (size_t)stale > cache->live);
+    if (!added && !rewrite) return 1;
+    
+    char tmp[MAX_PATH + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cache->path);
+    int fd = rewrite ? open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                     : open(cache->path, O_WRONLY | O_APPEND);
+    if (fd < 0) return 0;
+    
+    int ok = 1;
+    if (rewrite) {
+        CacheHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, CACHE_MAGIC, 8);
+        hdr.version = CACHE_VERSION;
+        ok = write_all(fd, &hdr, sizeof(hdr));
+        for (size_t k = 0; ok && k <= cache->slot_mask; k++) {
+            if (!cache->slots[k] || cache->replaced[k]) continue;
+            const CacheRecord *r = (const CacheRecord *)(cache->map + cache->slots[k] - 1);
+            ok = write_all(fd, r, cache_record_size(r));
+        }
+    } else {
+        /* Concurrent runs append whole batches, one after the other */
+        flock(fd, LOCK_EX);
+    }
+    for (int w = 0; ok && w < nworkers; w++) {
+        ok = write_all(fd, workers[w].cache_buf, workers[w].cache_len);
+    }
+    ok = (close(fd) == 0) && ok;
+    if (rewrite) {
+        ok = ok && rename(tmp, cache->path) == 0;
+        if (!ok) unlink(tmp);
+    }
+    return ok;
+}
+
+/* Search a single file safely */
+/* Files of a WORK_BATCH item that the uring backend opened and read up
+ * front, so their openat() and read() calls were in flight together.
+ * fds[k] is -1 where the file is opened the usual way; lens[k] bytes
+ * from its start are in slot k of data, or -1 if the read failed. */
+typedef struct Prefetch {
+    const char **names;
+    int count;
+    int fds[FILE_BATCH];
+    long lens[FILE_BATCH];
+    char *data;             /* FILE_BATCH slots of PREFETCH_BYTES */
+} Prefetch;
+
+/* The fd prefetch_batch() opened for file, or -1. *data is set to what
+ * was read of it; keep_prefetched() decides if that is the whole file. */
+static int prefetch_take(Worker *worker, const FileRef *file, 
+                         const char **data, long *len) {
+    Prefetch *pre = worker->prefetch;
+    
+    *data = NULL;
+    if (!pre) return -1;
+    for (int k = 0; k < pre->count; k++) {
+        if (pre->names[k] != file->name) continue;
+        int fd = pre->fds[k];
+        pre->fds[k] = -1;
+        *len = pre->lens[k];
+        if (fd >= 0 && *len >= 0) *data = pre->data + (size_t)k * PREFETCH_BYTES;
+        return fd;
+    }
+    return -1;
+}
+
+/* Search the prefetched bytes in place if they are all of the file */
+static int keep_prefetched(const char *data, long len, const struct stat *st,
+                           FileView *view) {
+    if (!data || len != st->st_size || len >= PREFETCH_BYTES) return 0;
+    view->data = data;
+    view->len = (size_t)len;
+    view->mapped = 0;
+    return 1;
+}
+
+/* Close what the files of the batch left unused */
+static void prefetch_done(Worker *worker) {
+    Prefetch *pre = worker->prefetch;
+    
+    if (!pre) return;
+    for (int k = 0; k < pre->count; k++) {
+        if (pre->fds[k] >= 0) close(pre->fds[k]);
+    }
+    pre->count = 0;
+}
+
+int search_file(FileRef *file, const SearchOptions *opts, 
+               Worker *worker, FileMatch *out) {
+    SearchStats *stats = &worker->stats;
+    const char *filename;
+    size_t name_len;
+    int match_in_file = 0;
+    struct stat st;
+    
+    if (opts->index_mode != INDEX_NONE && is_index_file(file)) {
+        return 0;
+    }
+    
+    /* An up-to-date index entry lacking the keywords' trigrams means the
+     * content cannot match, so only the name is left to check */
+    if (opts->index && index_prunes(opts->index, file, worker, &st)) {
+        stats->files_searched++;
+        stats->files_pruned++;
+        stats->total_size += st.st_size;
+        goto check_name;
+    }
+    
+    /* A cached record for this query and an unchanged file is replayed
+     * as it was printed, without opening the file */
+    ResultCache *cache = opts->cache;
+    size_t slot = 0;
+    int claimed = 0;            /* --dedup: inode recorded as ours already */
+    if (cache) {
+        size_t rel_len;
+        const char *rel = relative_path(worker, file, &rel_len);
+        slot = cache_slot(cache, cache->query, rel, rel_len);
+        uint64_t off = cache->slots[slot];
+        if (stat_entry(worker, file, &st) == 0) {
+            if (cache->map && st.st_dev == cache->dev && st.st_ino == cache->ino) {
+                return 0;
+            }
+            /* --dedup: the inode was searched through another path */
+            if (opts->dedup && !visited_add(worker->pool->visited, &st)) {
+                stats->files_duplicate++;
+                goto check_name;
+            }
+            claimed = opts->dedup;
+            const CacheRecord *r = off ? (const CacheRecord *)(cache->map + off - 1)
+                                       : NULL;
+            if (r && (uint64_t)st.st_size == r->size && 
+                (uint64_t)st.st_ino == r->ino &&
+                (int64_t)st.st_mtim.tv_sec == r->mtime_sec &&
+                (int64_t)st.st_mtim.tv_nsec == r->mtime_nsec) {
+                fm_append(out, (const char *)(r + 1) + r->path_len, r->out_len);
+                if (r->out_len) record_done(worker, out);
+                stats->files_searched++;
+                stats->files_cached++;
+                stats->total_size += st.st_size;
+                stats->total_matches += r->matches;
+                match_in_file = r->matches > 0;
+                goto check_name;
+            }
+        }
+    }
+    
+    Profile *profile = worker->profile;
+    int64_t started = phase_start(profile);
+    const char *early;
+    long early_len = 0;
+    int fd = prefetch_take(worker, file, &early, &early_len);
+    if (fd < 0) {
+        fd = open_entry(worker, file->dir, file->name, 
+                        O_RDONLY | nofollow_flag(opts), file);
+    }
+    if (fd < 0) {
+        return 0;
+    }
+    
+    /* Size and name filters already ran in search_directory(); fstat
+     * again only so a file that changed since is mapped correctly */
+    count_call(profile, CALL_STAT);
+    if (fstat(fd, &st) != 0) {
+        st.st_size = 0;
+    } else if (opts->dedup && !claimed && 
+               !visited_add(worker->pool->visited, &st)) {
+        phase_end(profile, PHASE_OPEN, started);
+        close(fd);
+        stats->files_duplicate++;
+        goto check_name;
+    }
+    phase_end(profile, PHASE_OPEN, started);
+    
+    stats->files_searched++;
+    stats->total_size += st.st_size;
+    
+    /* Search in content */
+    if (opts->search_content) {
+        FileView view;
+        size_t mark = out->len;
+        long found = 0;
+        DirectReader direct;
+        started = phase_start(profile);
+        int streamed = opts->io_mode == IO_DIRECT && 
+                       direct_start(&direct, fd, worker, opts);
+        int loaded = streamed || keep_prefetched(early, early_len, &st, &view) ||
+                     load_file(fd, &st, worker, &view);
+        phase_end(profile, PHASE_READ, started);
+        
+        /* Page faults of mapped files land in the match phase */
+        if (loaded) {
+            started = phase_start(profile);
+            if (streamed) {
+                view.data = NULL;
+                view.len = 0;
+                view.mapped = 0;
+            }
+            int codec = opts->decompress && !streamed 
+                        ? detect_codec(view.data, view.len) : CODEC_NONE;
+            int binary = !streamed && codec == CODEC_NONE && 
+                         opts->binary_mode != BINARY_TEXT && 
+                         looks_binary(view.data, view.len);
+            
+            /* Reads past the first block land in the match phase too */
+            if (streamed) {
+                found = scan_stream(direct_fill, &direct, &worker->read_buf,
+                                    &worker->read_cap, file, opts, worker, 
+                                    out, &binary);
+                stats->total_matches += found;
+                match_in_file = found > 0;
+            }
+            else if (codec != CODEC_NONE) {
+                found = scan_compressed(&view, codec, file, opts, worker, 
+                                        out, &binary);
+                stats->total_matches += found;
+                match_in_file = found > 0;
+            }
+            /* Large binaries are mapped, so skipping them never reads
+             * past the probed pages */
+            else if (!binary || opts->binary_mode == BINARY_SUMMARY) {
+                found = !binary && should_split(&view, opts, worker) 
+                    ? scan_split(&view, file, opts, worker, out) : -1;
+                if (found < 0) {
+                    found = scan_buffer(view.data, view.len, file,
+                                        opts, worker, out, binary, NULL);
+                }
+                stats->total_matches += found;
+                match_in_file = found > 0;
+            }
+            if (binary && match_in_file && !opts->count_only && 
+                !opts->only_matching_files) {
+                filename = file_path(worker, file, &name_len);
+                if (opts->json) {
+                    json_begin(out, "binary", filename, name_len);
+                    fm_append(out, "}\n", 2);
+                } else {
+                    fm_append(out, "Binary file ", 12);
+                    fm_append(out, filename, name_len);
+                    fm_append(out, " matches\n", 9);
+                }
+                record_done(worker, out);
+            }
+            release_file(&view);
+            drop_cached(fd, opts);
+            phase_end(profile, PHASE_MATCH, started);
+            
+            /* Output already written in parts is gone, so such files
+             * are searched again next time */
+            if (cache && !out->held && !pool_stopped(worker)) {
+                size_t rel_len;
+                const char *rel = relative_path(worker, file, &rel_len);
+                cache_store(worker, cache, slot, rel, rel_len, &st, found,
+                            out->data + mark, out->len - mark);
+            }
+        }
+    }
+    
+    close(fd);
+    
+check_name:    
+    /* Search in filename */
+    if (opts->search_filenames && !match_in_file) {
+        const char *basename = file->name;
+        
+        for (int k = 0; k < opts->keyword_count; k++) {
+            const char *found;
+            
+            if (opts->regex_keywords & (1u << k)) {
+                found = regexec(&opts->matcher->regex[k], basename, 0, NULL, 0) == 0
+                    ? basename : NULL;
+            } else if (opts->case_sensitive) {
+                found = strstr(basename, opts->keywords[k]);
+            } else {
+                found = strstr_case(basename, opts->keywords[k]);
+            }
+            
+            if (found) {
+                if (!claim_line(worker, opts)) return 0;
+                stats->total_matches++;
+                match_in_file = 1;
+                stats->files_matched++;
+                
+                if (opts->run) {
+                    report_match(NULL, NULL, 0, -1, k, file, opts, worker);
+                } else if (!opts->count_only) {
+                    filename = file_path(worker, file, &name_len);
+                    if (opts->json) {
+                        json_begin(out, "filename", filename, name_len);
+                        fm_append(out, ",\"keyword\":", 11);
+                        fm_append_json(out, opts->keywords[k], 
+                                       opts->keyword_len[k]);
+                        fm_append(out, "}\n", 2);
+                    } else {
+                        fm_append(out, "Filename match: ", 16);
+                        fm_append(out, filename, name_len);
+                        fm_append(out, "\n", 1);
+                    }
+                    record_done(worker, out);
+                }
+                return 1;
+            }
+        }
+    }
+    
+    if (match_in_file) {
+        stats->files_matched++;
+        if (opts->only_matching_files && !opts->count_only) {
+            filename = file_path(worker, file, &name_len);
+            if (opts->json) {
+                json_begin(out, "file", filename, name_len);
+                fm_append(out, "}\n", 2);
+            } else {
+                fm_append(out, filename, name_len);
+                fm_append(out, "\n", 1);
+            }
+            record_done(worker, out);
+        }
+    }
+    
+    return match_in_file;
+}
+
+#ifdef WALK_HAVE_GETDENTS
+/* Record layout returned by getdents64(2) */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+#ifdef WALK_HAVE_IO_URING
+/* Minimal io_uring over the raw syscalls: one ring per worker, used to
+ * keep a whole batch of statx(), openat() or read() calls in flight */
+typedef struct Uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Uring;
+
+static Uring *uring_open(unsigned entries) {
+    struct io_uring_params params;
+    Uring *ring = calloc(1, sizeof(Uring));
+    if (!ring) return NULL;
+    
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(SYS_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+    
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + 
+                         params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) goto fail;
+    
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, 
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            goto fail;
+        }
+    }
+    
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        goto fail;
+    }
+    
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return ring;
+    
+fail:
+    close(ring->fd);
+    free(ring);
+    return NULL;
+}
+
+static void uring_close(Uring *ring) {
+    if (!ring) return;
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring);
+}
+
+/* Submission entry k of a batch, cleared; callers fill in the op. A
+ * batch never has more entries than the ring (STAT_BATCH). */
+static struct io_uring_sqe *uring_sqe(Uring *ring, int k) {
+    unsigned idx = (*ring->sq_tail + (unsigned)k) & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t)k;
+    ring->sq_array[idx] = idx;
+    return sqe;
+}
+
+/* Submit the count entries filled in with uring_sqe() and wait for all
+ * of them; res[k] gets the result of entry k */
+static int uring_run(Uring *ring, int count, int *res) {
+    atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, 
+                          *ring->sq_tail + (unsigned)count, memory_order_release);
+    
+    int submitted = 0, reaped = 0;
+    while (reaped < count) {
+        int ret = (int)syscall(SYS_io_uring_enter, ring->fd, 
+                               (unsigned)(count - submitted),
+                               (unsigned)(count - reaped),
+                               IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        submitted += ret;
+        
+        unsigned head = *ring->cq_head;
+        unsigned cq_tail = atomic_load_explicit((_Atomic unsigned *)ring->cq_tail,
+                                                memory_order_acquire);
+        while (head != cq_tail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            res[cqe->user_data] = cqe->res;
+            head++;
+            reaped++;
+        }
+        atomic_store_explicit((_Atomic unsigned *)ring->cq_head, head,
+                              memory_order_release);
+    }
+    return 1;
+}
+
+/* statx() every name relative to dirfd; res[k] gets 0 or -errno */
+static int uring_statx(Uring *ring, int dirfd, const char **names, int count,
+                       struct statx *out, int *res) {
+    for (int k = 0; k < count; k++) {
+        struct io_uring_sqe *sqe = uring_sqe(ring, k);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dirfd;
+        sqe->addr = (uint64_t)(uintptr_t)names[k];
+        sqe->len = STATX_TYPE | STATX_SIZE;
+        sqe->off = (uint64_t)(uintptr_t)&out[k];
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+    }
+    return uring_run(ring, count, res);
+}
+
+/* Open and read the files of a batch through the ring: one submission
+ * with every openat(), then one with a read() of the first
+ * PREFETCH_BYTES for each file that opened. Whatever the ring cannot
+ * do (an old kernel answers -EINVAL) search_file() does as usual. */
+static void prefetch_batch(Worker *worker, DirNode *dir, const char **names,
+                           int count) {
+    const SearchOptions *opts = worker->pool->opts;
+    Prefetch *pre = worker->prefetch;
+    Uring *ring = worker->uring;
+    int res[FILE_BATCH], which[FILE_BATCH];
+    
+    /* Files the index or cache may skip are better not opened at all */
+    if (!ring || dir->fd < 0 || !opts->search_content || worker->indexer ||
+        opts->index_mode != INDEX_NONE || opts->cache || 
+        opts->io_mode != IO_NORMAL) {
+        return;
+    }
+    if (!pre) {
+        pre = calloc(1, sizeof(Prefetch));
+        if (pre) pre->data = malloc((size_t)FILE_BATCH * PREFETCH_BYTES);
+        if (!pre || !pre->data) {
+            free(pre);
+            return;
+        }
+        worker->prefetch = pre;
+    }
+    
+    pre->names = names;
+    pre->count = count;
+    for (int k = 0; k < count; k++) {
+        struct io_uring_sqe *sqe = uring_sqe(ring, k);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = dir->fd;
+        sqe->addr = (uint64_t)(uintptr_t)names[k];
+        sqe->open_flags = (uint32_t)(O_RDONLY | nofollow_flag(opts));
+        pre->fds[k] = -1;
+        pre->lens[k] = -1;
+    }
+    if (!uring_run(ring, count, res)) return;
+    if (worker->profile) worker->profile->calls[CALL_OPEN] += count;
+    
+    int reads = 0;
+    for (int k = 0; k < count; k++) {
+        if (res[k] < 0) continue;
+        pre->fds[k] = res[k];
+        struct io_uring_sqe *sqe = uring_sqe(ring, reads);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = res[k];
+        sqe->addr = (uint64_t)(uintptr_t)(pre->data + (size_t)k * PREFETCH_BYTES);
+        sqe->len = PREFETCH_BYTES;
+        which[reads++] = k;
+    }
+    if (reads == 0 || !uring_run(ring, reads, res)) return;
+    if (worker->profile) worker->profile->calls[CALL_READ] += reads;
+    for (int j = 0; j < reads; j++) {
+        if (res[j] >= 0) pre->lens[which[j]] = res[j];
+    }
+}
+#else
+typedef struct Uring Uring;
+static void uring_close(Uring *ring) { (void)ring; }
+static void prefetch_batch(Worker *worker, DirNode *dir, const char **names,
+                           int count) {
+    (void)worker; (void)dir; (void)names; (void)count;
+}
+#endif
+
+/* Make room for one more item in a deque's ring; the caller holds
+ * the lock that guards it */
+static int deque_grow(WorkDeque *dq) {
+    if (dq->count < dq->cap) return 1;
+    
+    size_t new_cap = dq->cap ? dq->cap * 2 : 64;
+    WorkItem *grown = malloc(new_cap * sizeof(WorkItem));
+    if (!grown) return 0;
+    /* Unwrap the ring into the new array */
+    for (size_t k = 0; k < dq->count; k++) {
+        grown[k] = dq->items[(dq->head + k) % dq->cap];
+    }
+    free(dq->items);
+    dq->items = grown;
+    dq->head = 0;
+    dq->cap = new_cap;
+    return 1;
+}
+
+/* Push an item onto a worker's own deque: at the tail, or with front
+ * set at the head, where thieves look first. The item owns one reference
+ * on dir (taken by the caller), which keeps a file's name alive. Items
+ * of a network mount go to its device queue instead, and remote
+ * workers hand local finds to worker 0, which always runs. */
+static void pool_push_item(Worker *worker, const WorkItem *work, int front) {
+    WorkPool *pool = worker->pool;
+    WorkItem item = *work;
+    WorkDeque *dq;
+    pthread_mutex_t *lock;
+    
+    item.device = item.dir ? item.dir->device : 0;
+    if (item.device) {
+        dq = &pool->devices[item.device - 1].queue;
+        lock = &pool->remote_lock;
+    } else {
+        dq = worker->remote ? &pool->workers[0].deque : &worker->deque;
+        lock = &dq->lock;
+    }
+    
+    pthread_mutex_lock(lock);
+    if (!deque_grow(dq)) {
+        pthread_mutex_unlock(lock);
+        goto fail;
+    }
+    /* Counted before the item is visible, so a thief that finishes it
+     * first cannot take the count to zero under the enumeration */
+    DirNode *owner = fd_owner(item.kind, item.dir);
+    if (owner) atomic_fetch_add(&owner->fd_users, 1);
+    
+    if (front) {
+        dq->head = (dq->head + dq->cap - 1) % dq->cap;
+        dq->items[dq->head] = item;
+    } else {
+        dq->items[(dq->head + dq->count) % dq->cap] = item;
+    }
+    dq->count++;
+    atomic_fetch_add(&pool->pending, 1);
+    if (item.device) {
+        pthread_cond_signal(&pool->remote_cond);
+        pthread_mutex_unlock(lock);
+        return;
+    }
+    atomic_fetch_add(&pool->queued, 1);
+    pthread_mutex_unlock(lock);
+    
+    if (atomic_load(&pool->sleepers) > 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+    return;
+    
+fail:
+    /* Drop what the item would have released when it ran */
+    if (work->kind == WORK_CHUNK) split_release(work->split);
+    dir_release(worker, work->dir);
+    if (work->slot) sink_complete(pool->sink, work->slot);
+}
+
+static void pool_push(Worker *worker, int kind, DirNode *dir, 
+                      const char *name, OrderNode *slot) {
+    WorkItem work = { kind, dir, name, NULL, 0, NULL, slot, 0 };
+    pool_push_item(worker, &work, 0);
+}
+
+/* Take an item from a deque: the tail for the owner, the head for thieves */
+static int deque_take(WorkDeque *dq, int from_tail, WorkItem *out) {
+    int taken = 0;
+    
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        if (from_tail) {
+            *out = dq->items[(dq->head + dq->count - 1) % dq->cap];
+        } else {
+            *out = dq->items[dq->head];
+            dq->head = (dq->head + 1) % dq->cap;
+        }
+        dq->count--;
+        taken = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    
+    return taken;
+}
+
+/* A remote worker's next item: the oldest one of a device that is
+ * below --device-jobs, trying the devices in turn */
+static int remote_next(Worker *worker, WorkItem *out) {
+    WorkPool *pool = worker->pool;
+    int found = 0;
+    
+    pthread_mutex_lock(&pool->remote_lock);
+    while (!found && atomic_load(&pool->pending) > 0) {
+        for (int k = 0; k < pool->ndevices && !found; k++) {
+            int index = (pool->next_device + k) % pool->ndevices;
+            Device *d = &pool->devices[index];
+            WorkDeque *dq = &d->queue;
+            
+            if (d->busy < pool->device_jobs && dq->count > 0) {
+                *out = dq->items[dq->head];
+                dq->head = (dq->head + 1) % dq->cap;
+                dq->count--;
+                d->busy++;
+                pool->next_device = index + 1;
+                found = 1;
+            }
+        }
+        if (!found) pthread_cond_wait(&pool->remote_cond, &pool->remote_lock);
+    }
+    pthread_mutex_unlock(&pool->remote_lock);
+    return found;
+}
+
+/* Find the next item: own deque first, then steal from a random victim */
+static int pool_next(Worker *worker, WorkItem *out) {
+    WorkPool *pool = worker->pool;
+    
+    if (worker->remote) return remote_next(worker, out);
+    
+    for (;;) {
+        if (deque_take(&worker->deque, pool->opts->order == ORDER_DFS, out)) {
+            atomic_fetch_sub(&pool->queued, 1);
+            return 1;
+        }
+        
+        if (pool->nworkers > 1) {
+            worker->rng = worker->rng * 1103515245u + 12345u;
+            int start = (int)((worker->rng >> 16) % (unsigned)pool->nworkers);
+            for (int k = 0; k < pool->nworkers; k++) {
+                Worker *victim = &pool->workers[(start + k) % pool->nworkers];
+                if (victim != worker && deque_take(&victim->deque, 0, out)) {
+                    atomic_fetch_sub(&pool->queued, 1);
+                    return 1;
+                }
+            }
+        }
+        
+        /* Nothing to steal: sleep until new work arrives or all is done.
+         * sleepers is raised before queued is rechecked so a concurrent
+         * push either sees us sleeping or we see its item. */
+        pthread_mutex_lock(&pool->idle_lock);
+        atomic_fetch_add(&pool->sleepers, 1);
+        while (atomic_load(&pool->queued) == 0 &&
+               atomic_load(&pool->pending) > 0) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+        atomic_fetch_sub(&pool->sleepers, 1);
+        pthread_mutex_unlock(&pool->idle_lock);
+        
+        if (atomic_load(&pool->pending) == 0) {
+            return 0;
+        }
+    }
+}
+
+/* Mark an item finished; the last one wakes everybody up to exit */
+static void pool_finish(Worker *worker, WorkItem *item) {
+    WorkPool *pool = worker->pool;
+    
+    /* A device below its limit again may let a remote worker go on */
+    if (item->device) {
+        pthread_mutex_lock(&pool->remote_lock);
+        pool->devices[item->device - 1].busy--;
+        pthread_cond_signal(&pool->remote_cond);
+        pthread_mutex_unlock(&pool->remote_lock);
+    }
+    dir_release(worker, item->dir);
+    if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_broadcast(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+        pthread_mutex_lock(&pool->remote_lock);
+        pthread_cond_broadcast(&pool->remote_cond);
+        pthread_mutex_unlock(&pool->remote_lock);
+    }
+}
+
+/* Account one finished work item to its thread and its directory */
+static void profile_item(Profile *profile, DirNode *dir, int64_t ns) {
+    long us = (long)(ns / 1000);
+    int bucket = 0;
+    
+    while (bucket < LATENCY_BUCKETS - 1 && us >= (2L << bucket)) bucket++;
+    profile->latency[bucket]++;
+    profile->items++;
+    profile->busy_ns += (long)ns;
+    if (dir) atomic_fetch_add(&dir->work_ns, (long)ns);
+}
+
+/* Worker loop: run items until the whole tree has been processed */
+static void *worker_main(void *arg) {
+    Worker *worker = arg;
+    const SearchOptions *opts = worker->pool->opts;
+    OutputSink *sink = worker->pool->sink;
+    WorkItem item;
+    
+    while (pool_next(worker, &item)) {
+        int64_t started = phase_start(worker->profile);
+        
+        /* After a --max-total stop, queued items are only retired */
+        if (item.kind == WORK_DIR && !pool_stopped(worker)) {
+            search_directory(item.dir, opts, worker, item.slot);
+            phase_end(worker->profile, PHASE_TRAVERSE, started);
+        } else if (item.kind == WORK_FILE || item.kind == WORK_BATCH) {
+            FileMatch *out = item.slot ? &item.slot->out : &worker->out;
+            const char **names = item.kind == WORK_FILE ? &item.name : item.names;
+            int count = item.kind == WORK_FILE ? 1 : item.count;
+            
+            if (item.kind == WORK_BATCH) prefetch_batch(worker, item.dir, names, count);
+            for (int k = 0; k < count && !pool_stopped(worker); k++) {
+                FileRef file = { item.dir, names[k], NULL, 0 };
+                worker->out.count = 0;
+                if (worker->indexer) {
+                    index_file(&file, worker);
+                } else {
+                    search_file(&file, opts, worker, out);
+                }
+                /* Only between files, so one file's lines stay together */
+                if (!item.slot && (worker->out.count >= MAX_MATCHES_PER_FILE ||
+                                   worker->out.len >= OUTPUT_BATCH_BYTES ||
+                                   worker->out.held)) {
+                    sink_submit(sink, &worker->out, 0);
+                }
+            }
+            prefetch_done(worker);
+        } else if (item.kind == WORK_CHUNK) {
+            /* Queued helpers always drop their reference, even after a stop */
+            if (!pool_stopped(worker)) split_work(item.split, worker);
+            split_release(item.split);
+        }
+        if (item.slot) {
+            sink_complete(sink, item.slot);
+        }
+        if (worker->profile) {
+            profile_item(worker->profile, item.dir, now_ns() - started);
+        }
+        dir_fd_done(worker, fd_owner(item.kind, item.dir));
+        pool_finish(worker, &item);
+    }
+    
+    if (worker->out.len > 0) {
+        sink_submit(sink, &worker->out, 0);
+    }
+    free(worker->out.data);
+    memset(&worker->out, 0, sizeof(worker->out));
+    free(worker->read_buf);
+    worker->read_buf = NULL;
+    worker->read_cap = 0;
+    free(worker->direct_buf);
+    worker->direct_buf = NULL;
+    free(worker->path_buf);
+    worker->path_buf = NULL;
+    worker->path_cap = 0;
+    free(worker->dents_buf);
+    worker->dents_buf = NULL;
+    free(worker->line_buf);
+    worker->line_buf = NULL;
+    uring_close(worker->uring);
+    worker->uring = NULL;
+    if (worker->prefetch) {
+        free(worker->prefetch->data);
+        free(worker->prefetch);
+        worker->prefetch = NULL;
+    }
+    free(worker->scan);
+    worker->scan = NULL;
+    free_decoder(worker->decoder);
+    worker->decoder = NULL;
+    arena_cache_free(worker);
+    
+    return NULL;
+}
+
+/* Read a small file next to an open directory; NULL if absent */
+static char *read_dir_file(int dirfd, const char *name, size_t *len_out) {
+    struct stat st;
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) return NULL;
+    
+    char *text = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && 
+        st.st_size < IGNORE_FILE_MAX && (text = malloc((size_t)st.st_size + 1))) {
+        size_t len = 0;
+        ssize_t n;
+        while (len < (size_t)st.st_size &&
+               ((n = read(fd, text + len, (size_t)st.st_size - len)) > 0 ||
+                (n < 0 && errno == EINTR))) {
+            if (n > 0) len += (size_t)n;
+        }
+        text[len] = '\0';
+        *len_out = len;
+    }
+    close(fd);
+    return text;
+}
+
+/* Turn ignore-file text into rules pointing into it. Follows
+ * gitignore(5): '#' comments, '!' negation, trailing '/' for
+ * directories, and a '/' anywhere else anchors the pattern. */
+static int parse_ignore(IgnoreList *list, char *text, size_t len) {
+    int cap = 0;
+    
+    for (char *line = text; line < text + len; ) {
+        char *end = memchr(line, '\n', (size_t)(text + len - line));
+        char *next = end ? end + 1 : text + len;
+        if (!end) end = text + len;
+        
+        /* Trailing CR and unescaped spaces are not part of the pattern */
+        while (end > line && (end[-1] == '\r' || 
+                              (end[-1] == ' ' && !(end - 1 > line && end[-2] == '\\')))) {
+            end--;
+        }
+        if (end == line || line[0] == '#') {
+            line = next;
+            continue;
+        }
+        
+        int flags = 0;
+        if (line[0] == '!') {
+            flags |= IGNORE_NEGATE;
+            line++;
+        } else if (line[0] == '\\' && end - line > 1 && 
+                   (line[1] == '#' || line[1] == '!')) {
+            line++;
+        }
+        if (end > line && end[-1] == '/') {
+            flags |= IGNORE_DIR_ONLY;
+            end--;
+        }
+        if (end > line && line[0] == '/') {
+            flags |= IGNORE_ANCHORED;
+            line++;
+        } else if (memchr(line, '/', (size_t)(end - line))) {
+            flags |= IGNORE_ANCHORED;
+        }
+        if (end == line) {
+            line = next;
+            continue;
+        }
+        
+        /* Cheap forms for the common "name" and "*.ext" rules */
+        size_t n = (size_t)(end - line);
+        if (!(flags & IGNORE_ANCHORED)) {
+            if (!has_glob_meta(line, n)) {
+                flags |= IGNORE_LITERAL;
+            } else if (line[0] == '*' && !has_glob_meta(line + 1, n - 1)) {
+                flags |= IGNORE_SUFFIX;
+                line++;
+                n--;
+            }
+        }
+        
+        if (list->count == cap) {
+            int new_cap = cap ? cap * 2 : 16;
+            IgnoreRule *grown = realloc(list->rules, (size_t)new_cap * sizeof(IgnoreRule));
+            if (!grown) return 0;
+            list->rules = grown;
+            cap = new_cap;
+        }
+        list->rules[list->count].glob = line;
+        list->rules[list->count].len = n;
+        list->rules[list->count].flags = flags;
+        list->count++;
+        list->anchored |= (flags & IGNORE_ANCHORED) != 0;
+        line = next;
+    }
+    return 1;
+}
+
+/* Read dir's .gitignore and .ignore (the latter overriding) into a list
+ * chained to the inherited rules; NULL if neither exists */
+static IgnoreList *load_ignore(DirNode *dir, int dirfd) {
+    size_t git_len = 0, own_len = 0;
+    char *git = read_dir_file(dirfd, ".gitignore", &git_len);
+    char *own = read_dir_file(dirfd, ".ignore", &own_len);
+    
+    if (!git && !own) return NULL;
+    
+    IgnoreList *list = calloc(1, sizeof(IgnoreList));
+    char *text = malloc(git_len + own_len + 2);
+    if (!list || !text) {
+        free(list);
+        free(text);
+        free(git);
+        free(own);
+        return NULL;
+    }
+    
+    size_t len = 0;
+    if (git) {
+        memcpy(text, git, git_len);
+        len = git_len;
+        text[len++] = '\n';
+    }
+    if (own) {
+        memcpy(text + len, own, own_len);
+        len += own_len;
+    }
+    text[len] = '\0';
+    free(git);
+    free(own);
+    
+    list->parent = dir->ignore;
+    list->owner = dir;
+    list->text = text;
+    if (!parse_ignore(list, text, len) || list->count == 0) {
+        free_ignore(list);
+        return NULL;
+    }
+    return list;
+}
+
+/* Path of name below the directory owning an ignore list */
+static const char *path_below(const DirNode *owner, const DirNode *dir,
+                              const char *name, size_t name_len,
+                              char *buf, size_t cap, size_t *len_out) {
+    size_t total = name_len;
+    
+    for (const DirNode *d = dir; d && d != owner; d = d->parent) {
+        total += d->name_len + 1;
+    }
+    if (total >= cap) return NULL;
+    
+    char *end = buf + total;
+    *end = '\0';
+    end -= name_len;
+    memcpy(end, name, name_len);
+    for (const DirNode *d = dir; d && d != owner; d = d->parent) {
+        *--end = '/';
+        end -= d->name_len;
+        memcpy(end, d->name, d->name_len);
+    }
+    *len_out = total;
+    return buf;
+}
+
+static int ignore_rule_matches(const IgnoreRule *r, const char *name, 
+                               size_t name_len, const char *rel, size_t rel_len) {
+    if (r->flags & IGNORE_LITERAL) {
+        return r->len == name_len && memcmp(r->glob, name, name_len) == 0;
+    }
+    if (r->flags & IGNORE_SUFFIX) {
+        return r->len <= name_len && 
+               memcmp(r->glob, name + name_len - r->len, r->len) == 0;
+    }
+    if (r->flags & IGNORE_ANCHORED) {
+        return rel && glob_match(r->glob, r->glob + r->len, rel, rel + rel_len,
+                                 GLOB_PATHNAME);
+    }
+    return glob_match(r->glob, r->glob + r->len, name, name + name_len, 
+                      GLOB_PATHNAME);
+}
+
+/* Decide an entry of dir against the ignore rules in force: the last
+ * matching rule of the innermost file that has one wins */
+static int is_ignored(const DirNode *dir, const char *name, int is_dir) {
+    size_t name_len = strlen(name);
+    
+    for (const IgnoreList *list = dir->ignore; list; list = list->parent) {
+        char buf[MAX_PATH];
+        const char *rel = NULL;
+        size_t rel_len = 0;
+        
+        if (list->anchored) {
+            rel = path_below(list->owner, dir, name, name_len, 
+                             buf, sizeof(buf), &rel_len);
+        }
+        for (int k = list->count - 1; k >= 0; k--) {
+            const IgnoreRule *r = &list->rules[k];
+            if ((r->flags & IGNORE_DIR_ONLY) && !is_dir) continue;
+            if (ignore_rule_matches(r, name, name_len, rel, rel_len)) {
+                return !(r->flags & IGNORE_NEGATE);
+            }
+        }
+    }
+    return 0;
+}
+
+/* Traversal-stage filters: decide from the directory entry (and its
+ * stat result when a size filter needs one) whether an entry is worth
+ * queueing at all. Directories only face --exclude. */
+static int entry_passes_filters(const DirNode *dir, const char *name, int is_dir,
+                                const struct stat *st, const SearchOptions *opts) {
+    const PatternSet *inc = &opts->includes, *exc = &opts->excludes;
+    
+    if (!is_dir && st && 
+        ((opts->min_size > 0 && st->st_size < opts->min_size) ||
+         (opts->max_size >= 0 && st->st_size > opts->max_size))) {
+        return 0;
+    }
+    if (exc->count == 0 && (is_dir || inc->count == 0)) {
+        return 1;
+    }
+    
+    /* The path below the start directory, joined only for path globs */
+    size_t name_len = strlen(name), rel_len = 0;
+    const char *rel = NULL;
+    char buf[MAX_PATH];
+    if (exc->any_path || (!is_dir && inc->any_path)) {
+        const DirNode *root = dir;
+        while (root->parent) root = root->parent;
+        rel = path_below(root, dir, name, name_len, buf, sizeof(buf), &rel_len);
+    }
+    
+    if (exc->count && pattern_set_matches(exc, name, name_len, rel, rel_len)) {
         return 0;
     }
+    return is_dir || inc->count == 0 || 
+           pattern_set_matches(inc, name, name_len, rel, rel_len);
+}
+
+/* State for enumerating one directory */
+typedef struct DirScan {
+    DirNode *dir;
+    int dirfd;
+    int size_filter;
+    const SearchOptions *opts;
+    Worker *worker;
+    OrderNode *slot;
+    /* Entries staged for a batched statx (io_uring backend) */
+    int staged;
+    char names[STAT_BATCH][256];
+    int types[STAT_BATCH];
+    /* Files gathered into the next WORK_BATCH item */
+    int batched;
+    const char *batch[FILE_BATCH];
+} DirScan;
+
+/* Queue the gathered files as one item (or a lone WORK_FILE), so small
+ * files do not pay a deque round trip and an order node each. Called
+ * before anything else is queued to keep readdir order for -O. */
+static void flush_batch(DirScan *scan) {
+    DirNode *dir = scan->dir;
+    Worker *worker = scan->worker;
+    int count = scan->batched;
+    
+    if (count == 0) return;
+    scan->batched = 0;
+    
+    OrderNode *slot = scan->slot ? order_child(scan->slot) : NULL;
+    atomic_fetch_add(&dir->refs, 1);
+    if (count == 1) {
+        pool_push(worker, WORK_FILE, dir, scan->batch[0], slot);
+        return;
+    }
+    
+    const char **names = arena_alloc(worker, &dir->arena, 
+                                     (size_t)count * sizeof(char *), 
+                                     sizeof(char *));
+    if (!names) {
+        /* Fall back to one item per file */
+        for (int k = 0; k < count; k++) {
+            if (k > 0) atomic_fetch_add(&dir->refs, 1);
+            pool_push(worker, WORK_FILE, dir, scan->batch[k], 
+                      k == 0 ? slot : scan->slot ? order_child(scan->slot) : NULL);
+        }
+        return;
+    }
+    memcpy(names, scan->batch, (size_t)count * sizeof(char *));
+    WorkItem work = { WORK_BATCH, dir, NULL, names, count, NULL, slot, 0 };
+    pool_push_item(worker, &work, 0);
+}
+
+/* Queue one classified entry as work */
+static void add_entry(DirScan *scan, const char *name, int is_dir, 
+                      int is_reg, const struct stat *st) {
+    const SearchOptions *opts = scan->opts;
+    DirNode *dir = scan->dir;
+    
+    /* Ignored subtrees are never opened */
+    if (opts->use_ignore && (is_dir || is_reg) &&
+        ((is_dir && strcmp(name, ".git") == 0) || 
+         (dir->ignore && is_ignored(dir, name, is_dir)))) {
+        return;
+    }
+    
+    /* Check if it's a directory */
+    if (is_dir) {
+        if (opts->recursive &&
+            (opts->max_depth < 0 || dir->depth < opts->max_depth) &&
+            entry_passes_filters(dir, name, 1, NULL, opts)) {
+            DirNode *child = dir_new(scan->worker, dir, name, strlen(name));
+            if (child) {
+                flush_batch(scan);
+                pool_push(scan->worker, WORK_DIR, child, NULL,
+                          scan->slot ? order_child(scan->slot) : NULL);
+            }
+        }
+    } 
+    /* Check if it's a regular file */
+    else if (is_reg) {
+        if (entry_passes_filters(dir, name, 0, scan->size_filter ? st : NULL, 
+                                 opts)) {
+            const char *copy = arena_strdup(scan->worker, &dir->arena, name,
+                                            strlen(name));
+            if (copy) {
+                /* Files known to be large go on their own */
+                int alone = st && st->st_size >= MMAP_THRESHOLD;
+                if (alone) flush_batch(scan);
+                scan->batch[scan->batched++] = copy;
+                if (alone || scan->batched == FILE_BATCH) flush_batch(scan);
+            }
+        }
+    }
+    /* Skip other file types (symlinks, devices, etc.) */
+}
+
+/* Classify an entry from d_type, falling back to fstatat(). Under -L a
+ * link counts as what it points to, and a dangling one is skipped. */
+static void classify_entry(DirScan *scan, const char *name, int type) {
+    int follow = scan->opts->follow_links;
+    struct stat st;
+    
+    if (type == DT_UNKNOWN || (type == DT_LNK && follow) ||
+        (type == DT_REG && scan->size_filter)) {
+        count_call(scan->worker->profile, CALL_STAT);
+        if (fstatat(scan->dirfd, name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) != 0) {
+            return;  /* Skip if can't stat */
+        }
+        add_entry(scan, name, S_ISDIR(st.st_mode), S_ISREG(st.st_mode), &st);
+    } else {
+        add_entry(scan, name, type == DT_DIR, type == DT_REG, NULL);
+    }
+}
+
+/* Classify staged entries, stat'ing those that need it in one batch */
+static void flush_staged(DirScan *scan) {
+#ifdef WALK_HAVE_IO_URING
+    struct statx stx[STAT_BATCH];
+    const char *names[STAT_BATCH];
+    int res[STAT_BATCH];
+    int index[STAT_BATCH];
+    int count = 0;
+    
+    for (int k = 0; k < scan->staged; k++) {
+        int type = scan->types[k];
+        index[k] = -1;
+        if (type == DT_UNKNOWN || (type == DT_REG && scan->size_filter)) {
+            names[count] = scan->names[k];
+            index[k] = count++;
+        }
+    }
+    
+    int ok = count == 0 || uring_statx(scan->worker->uring, scan->dirfd,
+                                       names, count, stx, res);
+    if (scan->worker->profile) scan->worker->profile->calls[CALL_STAT] += count;
+    
+    for (int k = 0; k < scan->staged; k++) {
+        const char *name = scan->names[k];
+        int type = scan->types[k];
+        int j = index[k];
+        
+        /* statx here does not follow links, so -L links go one by one */
+        if (j < 0) {
+            classify_entry(scan, name, type);
+        } else if (!ok || res[j] == -EINVAL) {
+            /* Kernel without IORING_OP_STATX: do it the slow way */
+            classify_entry(scan, name, type);
+        } else if (res[j] == 0) {
+            struct stat st;
+            memset(&st, 0, sizeof(st));
+            st.st_mode = stx[j].stx_mode;
+            st.st_size = (off_t)stx[j].stx_size;
+            if (S_ISLNK(st.st_mode) && scan->opts->follow_links) {
+                classify_entry(scan, name, DT_LNK);
+            } else {
+                add_entry(scan, name, S_ISDIR(st.st_mode), S_ISREG(st.st_mode), &st);
+            }
+        }
+    }
+#endif
+    scan->staged = 0;
+}
+
+/* Handle one raw directory entry */
+static void visit_entry(DirScan *scan, const char *name, int type) {
+    /* Skip . and .. */
+    if (name[0] == '.' && (name[1] == '\0' || 
+                           (name[1] == '.' && name[2] == '\0'))) {
+        return;
+    }
     
-    stats->files_searched++;
-    
-    int match_in_file = 0;
-    int line_number = 0;
-    char line[MAX_LINE];
+    /* With a ring, every entry is staged so the batch keeps readdir
+     * order; without one, classify right away */
+    if (scan->worker->uring) {
+        size_t len = strlen(name);
+        if (len >= sizeof(scan->names[0])) {
+            classify_entry(scan, name, type);
+            return;
+        }
+        memcpy(scan->names[scan->staged], name, len + 1);
+        scan->types[scan->staged++] = type;
+        if (scan->staged == STAT_BATCH) flush_staged(scan);
+    } else {
+        classify_entry(scan, name, type);
+    }
+}
+
+#ifdef __linux__
+/* File systems where any call may wait on the network */
+static int is_network_fs(uint32_t type) {
+    switch (type) {
+    case 0x6969:            /* NFS */
+    case 0x517b:            /* SMB */
+    case 0xff534d42:        /* CIFS */
+    case 0xfe534d42:        /* SMB2 */
+    case 0x5346414f:        /* AFS */
+    case 0x73757245:        /* Coda */
+    case 0x00c36400:        /* Ceph */
+    case 0x01021997:        /* 9P */
+    case 0x0bd00bd0:        /* Lustre */
+    case 0x47504653:        /* GPFS */
+    case 0x65735546:        /* FUSE: sshfs and the like */
+        return 1;
+    }
+    return 0;
+}
+
+/* The same file systems by their name in the mount table */
+static int is_network_type(const char *type) {
+    static const char *const names[] = {
+        "nfs", "smb", "cifs", "afs", "coda", "ceph", "9p", "lustre", "gpfs",
+        "fuse",
+    };
+    for (size_t k = 0; k < sizeof(names) / sizeof(names[0]); k++) {
+        if (strncmp(type, names[k], strlen(names[k])) == 0) return 1;
+    }
+    return 0;
+}
+
+/* Undo the octal escapes (\040 for a space) of a mount table path */
+static void unescape_mount(char *path) {
+    char *out = path;
     
-    /* Search in content */
-    if (opts->search_content) {
-        while (fgets(line, sizeof(line), file)) {
-            line_number++;
-            
-            /* Remove newline */
-            line[strcspn(line, "\n")] = '\0';
-            
-            /* Check each keyword */
-            for (int k = 0; k < opts->keyword_count; k++) {
-                const char *found;
-                
-                if (opts->case_sensitive) {
-                    found = strstr(line, opts->keywords[k]);
-                } else {
-                    found = strstr_case(line, opts->keywords[k]);
-                }
-                
-                if (found) {
-                    stats->total_matches++;
-                    match_in_file = 1;
-                    
-                    if (!opts->count_only && !opts->only_matching_files) {
-                        if (opts->show_line_numbers) {
-                            printf("%s:%d:%s\n", filename, line_number, line);
-                        } else {
-                            printf("%s:%s\n", filename, line);
-                        }
-                    }
-                    
-                    if (opts->only_matching_files) {
-                        /* Found at least one match */
-                        fclose(file);
-                        stats->files_matched++;
-                        return 1;
-                    }
-                }
-            }
+    for (const char *p = path; *p; p++) {
+        if (p[0] == '\\' && p[1] >= '0' && p[1] <= '3' && p[2] >= '0' && 
+            p[2] <= '7' && p[3] >= '0' && p[3] <= '7') {
+            *out++ = (char)((p[1] - '0') << 6 | (p[2] - '0') << 3 | (p[3] - '0'));
+            p += 3;
+        } else {
+            *out++ = *p;
         }
     }
+    *out = '\0';
+}
+#endif
+
+/* Read the mount table once for the network mount queues. Keeps every
+ * mount point below the start directory, relative to it, so only those
+ * directories are looked at. Returns whether a network mount can be
+ * reached: the start directory's own or one below it, or under -L any
+ * at all. Without a mount table every directory is checked. */
+static int load_mounts(WorkPool *pool, const SearchOptions *opts) {
+#ifdef __linux__
+    FILE *table = fopen("/proc/self/mountinfo", "r");
+    char *real = realpath(opts->start_dir, NULL);
     
-    fclose(file);
+    if (!table || !real) {
+        if (table) fclose(table);
+        free(real);
+        pool->nmounts = -1;
+        return 1;
+    }
     
-    /* Search in filename */
-    if (opts->search_filenames && !match_in_file) {
-        const char *basename = strrchr(filename, '/');
-        basename = basename ? basename + 1 : filename;
+    size_t real_len = strlen(real);
+    size_t base_len = real_len == 1 ? 0 : real_len;    /* "/" */
+    size_t held_len = 0;        /* longest mount point holding real */
+    int held_network = 0, below_network = 0, any_network = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    int cap = 0;
+    
+    while (getline(&line, &line_cap, table) > 0) {
+        /* ID, parent ID, major:minor, root, mount point, ... - type ... */
+        char *sep = strstr(line, " - ");
+        char type[64], *save = NULL;
+        if (!sep || sscanf(sep + 3, "%63s", type) != 1) continue;
+        *sep = '\0';
+        char *point = strtok_r(line, " ", &save);
+        for (int field = 1; point && field < 5; field++) {
+            point = strtok_r(NULL, " ", &save);
+        }
+        if (!point) continue;
+        unescape_mount(point);
         
-        for (int k = 0; k < opts->keyword_count; k++) {
-            const char *found;
-            
-            if (opts->case_sensitive) {
-                found = strstr(basename, opts->keywords[k]);
-            } else {
-                found = strstr_case(basename, opts->keywords[k]);
+        size_t len = strlen(point);
+        int network = is_network_type(type);
+        any_network |= network;
+        if (len <= real_len && strncmp(real, point, len) == 0 &&
+            (len == 1 || real[len] == '/' || real[len] == '\0')) {
+            /* Later lines are mounted on top of earlier ones */
+            if (len >= held_len) {
+                held_len = len;
+                held_network = network;
             }
-            
-            if (found) {
-                stats->total_matches++;
-                match_in_file = 1;
-                stats->files_matched++;
-                
-                if (!opts->count_only) {
-                    printf("Filename match: %s\n", filename);
-                }
-                return 1;
+        } else if (len > base_len + 1 && strncmp(point, real, base_len) == 0 &&
+                   point[base_len] == '/') {
+            below_network |= network;
+            if (pool->nmounts == cap) {
+                cap = cap ? cap * 2 : 16;
+                char **grown = realloc(pool->mounts, (size_t)cap * sizeof(char *));
+                if (!grown) break;
+                pool->mounts = grown;
             }
+            pool->mounts[pool->nmounts] = strdup(point + base_len + 1);
+            if (pool->mounts[pool->nmounts]) pool->nmounts++;
         }
     }
+    free(line);
+    free(real);
+    fclose(table);
+    return held_network || below_network || (opts->follow_links && any_network);
+#else
+    (void)pool; (void)opts;
+    return 0;
+#endif
+}
+
+/* Whether dir is a mount point load_mounts() found, comparing its names
+ * up to the root with the relative path from the end. The root always
+ * counts, as it may sit on a network mount itself. */
+static int at_mount(const WorkPool *pool, const DirNode *dir) {
+    if (!dir->parent || pool->nmounts < 0) return 1;
     
-    if (match_in_file) {
-        stats->files_matched++;
-        if (opts->only_matching_files && !opts->count_only) {
-            printf("%s\n", filename);
+    for (int k = 0; k < pool->nmounts; k++) {
+        const char *rel = pool->mounts[k];
+        size_t end = strlen(rel);
+        const DirNode *d = dir;
+        
+        while (d->parent && end >= d->name_len &&
+               memcmp(rel + end - d->name_len, d->name, d->name_len) == 0 &&
+               (end == d->name_len || rel[end - d->name_len - 1] == '/')) {
+            end -= d->name_len;
+            d = d->parent;
+            if (end == 0) break;
+            end--;
         }
+        if (end == 0 && !d->parent) return 1;
     }
+    return 0;
+}
+
+/* The device queue for a directory on another file system than its
+ * parent's: its index + 1 for a network mount, 0 for a local one. The
+ * remote workers start when the first network mount turns up. */
+static int device_of(Worker *worker, int fd, dev_t dev) {
+    int device = 0;
+#ifdef __linux__
+    WorkPool *pool = worker->pool;
+    struct statfs sfs;
     
-    return match_in_file;
+    if (pool->nremote == 0) return 0;
+    count_call(worker->profile, CALL_STAT);
+    if (fstatfs(fd, &sfs) != 0 || !is_network_fs((uint32_t)sfs.f_type)) return 0;
+    
+    pthread_mutex_lock(&pool->remote_lock);
+    for (int k = 0; k < pool->ndevices && !device; k++) {
+        if (pool->devices[k].dev == dev) device = k + 1;
+    }
+    if (!pool->devices) pool->devices = calloc(MAX_DEVICES, sizeof(Device));
+    /* Mounts past MAX_DEVICES are searched like local ones */
+    if (!device && pool->devices && pool->ndevices < MAX_DEVICES) {
+        pool->devices[pool->ndevices].dev = dev;
+        device = ++pool->ndevices;
+    }
+    while (device && pool->remote_started < pool->nremote) {
+        Worker *remote = &pool->remote_workers[pool->remote_started];
+        if (pthread_create(&remote->thread, NULL, worker_main, remote) != 0) break;
+        pool->remote_started++;
+    }
+    if (pool->remote_started == 0) device = 0;
+    pthread_mutex_unlock(&pool->remote_lock);
+#else
+    (void)worker; (void)fd; (void)dev;
+#endif
+    return device;
 }
 
-/* Recursively search directory SAFELY */
-void search_directory(const char *path, int depth, 
-                     const SearchOptions *opts, SearchStats *stats) {
-    if (!path) return;
+/* Enumerate one directory, queueing subdirectories and files as work.
+ * The entry type comes from d_type where the filesystem reports it, so
+ * fstatat() is only needed for DT_UNKNOWN or when a size filter needs
+ * st_size. The getdents backend reads entries in DENTS_BUF_BYTES
+ * chunks; the uring backend also batches those stat calls. */
+void search_directory(DirNode *dir, const SearchOptions *opts, 
+                     Worker *worker, OrderNode *slot) {
+    WorkPool *pool = worker->pool;
+    
+    if (!dir) return;
     
-    /* Check depth limit */
-    if (opts->max_depth >= 0 && depth > opts->max_depth) {
+    int flags = O_RDONLY | O_DIRECTORY | (dir->parent ? nofollow_flag(opts) : 0);
+    int fd = open_entry(worker, dir->parent, dir->name, flags, NULL);
+    if (fd < 0) {
         return;
     }
     
-    DIR *dir = opendir(path);
-    if (!dir) {
+    /* Place the directory once: -x keeps to the start directory's
+     * device, and one reached before, through a link or a second mount,
+     * is not entered again (under -L that is what ends link cycles). On
+     * a mount point the device is looked up, and a network mount's
+     * directory moves to its device queue. Without -x or a visited set
+     * only mount points from the mount table pay for the fstat(). */
+    if (!dir->classified && (pool->visited || opts->one_file_system || 
+                             (pool->nremote && at_mount(pool, dir)))) {
+        struct stat st;
+        dir->classified = 1;
+        count_call(worker->profile, CALL_STAT);
+        if (fstat(fd, &st) == 0) {
+            if (!dir->parent) pool->root_dev = st.st_dev;
+            if ((opts->one_file_system && st.st_dev != pool->root_dev) ||
+                (pool->visited && !visited_add(pool->visited, &st))) {
+                close(fd);
+                return;
+            }
+            if (!dir->parent || st.st_dev != dir->parent->dev) {
+                dir->device = device_of(worker, fd, st.st_dev);
+            }
+            dir->dev = st.st_dev;
+            if (dir->device && !worker->remote) {
+                close(fd);
+                atomic_fetch_add(&dir->refs, 1);
+                pool_push(worker, WORK_DIR, dir, NULL, 
+                          slot ? order_child(slot) : NULL);
+                return;
+            }
+        }
+    }
+    
+    /* Keep the fd for the children if the budget allows */
+    int hold = atomic_fetch_add(&pool->held_fds, 1) < pool->max_held_fds;
+    if (!hold) {
+        atomic_fetch_sub(&pool->held_fds, 1);
+    }
+    
+    if (!worker->scan) worker->scan = malloc(sizeof(DirScan));
+    DirScan *scan = worker->scan;
+    if (!scan) {
+        if (hold) atomic_fetch_sub(&pool->held_fds, 1);
+        close(fd);
+        return;
+    }
+    scan->dir = dir;
+    scan->dirfd = fd;
+    scan->size_filter = opts->min_size > 0 || opts->max_size >= 0;
+    scan->opts = opts;
+    scan->worker = worker;
+    scan->slot = slot;
+    scan->staged = 0;
+    scan->batched = 0;
+    
+    /* Rules read here apply to everything below, so load them first */
+    if (opts->use_ignore) {
+        IgnoreList *own = load_ignore(dir, fd);
+        if (own) dir->ignore = own;
+    }
+    
+#ifdef WALK_HAVE_GETDENTS
+    if (opts->backend != BACKEND_POSIX && 
+        (worker->dents_buf || (worker->dents_buf = malloc(DENTS_BUF_BYTES)))) {
+        /* getdents64 reads straight from fd, which can be held as is */
+        atomic_store(&dir->fd_users, 1);
+        if (hold) dir->fd = fd;
+        
+        for (;;) {
+            long n = syscall(SYS_getdents64, fd, worker->dents_buf, 
+                             DENTS_BUF_BYTES);
+            count_call(worker->profile, CALL_DIRREAD);
+            if (n <= 0) break;
+            
+            for (long off = 0; off < n; ) {
+                struct linux_dirent64 *d = 
+                    (struct linux_dirent64 *)(worker->dents_buf + off);
+                visit_entry(scan, d->d_name, d->d_type);
+                off += d->d_reclen;
+            }
+        }
+        flush_staged(scan);
+        flush_batch(scan);
+        
+        if (!hold) close(fd);
+        dir_fd_done(worker, dir);
+        return;
+    }
+#endif
+    
+    atomic_store(&dir->fd_users, 1);
+    if (hold && (dir->fd = dup(fd)) < 0) {
+        atomic_fetch_sub(&pool->held_fds, 1);
+    }
+    
+    DIR *stream = fdopendir(fd);
+    if (!stream) {
+        close(fd);
+        dir_fd_done(worker, dir);
         return;
     }
+    count_call(worker->profile, CALL_DIRREAD);
     
     struct dirent *entry;
-    char fullpath[MAX_PATH];
+    while ((entry = readdir(stream)) != NULL) {
+        int type = DT_UNKNOWN;
+#ifdef DT_DIR
+        type = entry->d_type;
+#endif
+        visit_entry(scan, entry->d_name, type);
+    }
+    flush_staged(scan);
+    flush_batch(scan);
+    
+    closedir(stream);
+    dir_fd_done(worker, dir);
+}
+
+static int builds_index(const SearchOptions *opts) {
+    return opts->index_mode == INDEX_BUILD || opts->index_mode == INDEX_UPDATE ||
+           opts->index_mode == INDEX_WATCH;
+}
+
+/* Walk the tree with a pool of workers and merge their statistics */
+void run_search(const SearchOptions *opts, SearchStats *stats) {
+    WorkPool pool;
+    OutputSink sink;
+    int nworkers = opts->jobs;
+    
+    if (nworkers <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = online > 0 ? (int)online : 1;
+    }
+    
+    memset(&sink, 0, sizeof(sink));
+    sink.fd = STDOUT_FILENO;
+    sink.ordered = opts->ordered_output;
+    sink.lead_separator = opts->context && !opts->json;
+    pthread_mutex_init(&sink.lock, NULL);
+    pthread_cond_init(&sink.released, NULL);
+    
+    memset(&pool, 0, sizeof(pool));
+    pool.opts = opts;
+    pool.sink = &sink;
+    pool.nworkers = nworkers;
+    /* Remote workers only exist when a network mount can be reached */
+    int nremote = opts->remote_jobs > 0 && load_mounts(&pool, opts) 
+                  ? opts->remote_jobs : 0;
+    int total = nworkers + nremote;
+    pool.workers = calloc((size_t)total, sizeof(Worker));
+    if (!pool.workers) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&pool.pending, 0);
+    atomic_init(&pool.queued, 0);
+    atomic_init(&pool.sleepers, 0);
+    atomic_init(&pool.held_fds, 0);
+    
+    /* Leave half the fd limit for files being scanned and stdio */
+    struct rlimit lim;
+    pool.max_held_fds = 256;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+        if (lim.rlim_cur == RLIM_INFINITY) {
+            pool.max_held_fds = 1 << 16;
+        } else {
+            long budget = ((long)lim.rlim_cur - 16 - nworkers) / 2;
+            pool.max_held_fds = budget > 0 ? (int)budget : 0;
+        }
+    }
+    if (opts->max_open_dirs >= 0 && opts->max_open_dirs < pool.max_held_fds) {
+        pool.max_held_fds = opts->max_open_dirs;
+    }
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.idle_cond, NULL);
+    pool.nremote = nremote;
+    pool.remote_workers = pool.workers + nworkers;
+    pool.device_jobs = opts->device_jobs;
+    pthread_mutex_init(&pool.remote_lock, NULL);
+    pthread_cond_init(&pool.remote_cond, NULL);
+    if (opts->follow_links || opts->dedup) {
+        pool.visited = visited_new();
+        if (!pool.visited) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    ProfileReport *report = NULL;
+    if (opts->detailed_stats) {
+        report = calloc(1, sizeof(ProfileReport));
+        if (report) report->threads = calloc((size_t)total, sizeof(Profile));
+        if (!report || !report->threads) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        report->nthreads = nworkers;
+        pthread_mutex_init(&report->slow_lock, NULL);
+        pool.report = report;
+    }
+    
+    /* Remote workers may never start, so they get buffers on first use
+     * and no ring: they wait on the network, not on syscall overhead */
+    for (int k = 0; k < total; k++) {
+        pool.workers[k].pool = &pool;
+        pool.workers[k].id = k;
+        pool.workers[k].rng = (unsigned int)k * 2654435761u + 1;
+        pool.workers[k].remote = k >= nworkers;
+        pthread_mutex_init(&pool.workers[k].deque.lock, NULL);
+        if (k < nworkers) fm_reserve(&pool.workers[k].out, OUTPUT_BATCH_BYTES);
+        if (report) {
+            pool.workers[k].profile = &report->threads[k];
+        }
+        if (builds_index(opts)) {
+            pool.workers[k].indexer = calloc(1, sizeof(IndexBuilder));
+        }
+#ifdef WALK_HAVE_IO_URING
+        if (opts->backend == BACKEND_URING && k < nworkers) {
+            pool.workers[k].uring = uring_open(STAT_BATCH);
+        }
+#endif
+    }
+    
+    OrderNode *root = NULL;
+    if (sink.ordered) {
+        root = order_child(NULL);
+        sink.cursor = root;
+    }
+    DirNode *top = dir_new(&pool.workers[0], NULL, opts->start_dir, 
+                           strlen(opts->start_dir));
+    if (top) {
+        pool_push(&pool.workers[0], WORK_DIR, top, NULL, root);
+    } else if (root) {
+        sink_complete(&sink, root);
+    }
+    
+    /* The calling thread doubles as worker 0 */
+    int started = 1;
+    for (int k = 1; k < nworkers; k++) {
+        if (pthread_create(&pool.workers[k].thread, NULL, 
+                           worker_main, &pool.workers[k]) != 0) {
+            break;
+        }
+        started++;
+    }
+    pool.nworkers = started;
+    worker_main(&pool.workers[0]);
+    
+    for (int k = 1; k < started; k++) {
+        pthread_join(pool.workers[k].thread, NULL);
+    }
+    /* No item is left to start more of them */
+    for (int k = 0; k < pool.remote_started; k++) {
+        pthread_join(pool.remote_workers[k].thread, NULL);
+    }
+    
+    pthread_mutex_lock(&sink.lock);
+    sink_drain(&sink, 1);
+    pthread_mutex_unlock(&sink.lock);
+    for (size_t k = 0; k < sink.spare_count; k++) {
+        free(sink.spare[k]);
+    }
+    free(sink.spare);
+    pthread_mutex_destroy(&sink.lock);
+    pthread_cond_destroy(&sink.released);
+    
+    if (builds_index(opts)) {
+        long indexed = 0, trigrams = 0, reused = 0;
+        if (!write_index(opts, pool.workers, total, &indexed, &trigrams)) {
+            fprintf(stderr, "Error: Cannot write index in %s\n", opts->start_dir);
+            exit(EXIT_FAILURE);
+        }
+        for (int k = 0; k < total; k++) {
+            if (pool.workers[k].indexer) reused += pool.workers[k].indexer->reused;
+            free_builder(pool.workers[k].indexer);
+        }
+        printf("Indexed %ld files (%ld read, %ld unchanged), "
+               "%ld distinct trigrams\n", indexed, indexed - reused, reused,
+               trigrams);
+        fflush(stdout);
+    }
+    
+    if (opts->cache) {
+        if (!write_cache(opts->cache, pool.workers, total)) {
+            fprintf(stderr, "Warning: Cannot write cache %s\n", opts->cache->path);
+        }
+        for (int k = 0; k < total; k++) free(pool.workers[k].cache_buf);
+    }
+    
+    for (int k = 0; k < total; k++) {
+        const SearchStats *ws = &pool.workers[k].stats;
+        int ran = k < started || 
+                  (k >= nworkers && k - nworkers < pool.remote_started);
+        stats->files_searched += ws->files_searched;
+        stats->files_matched += ws->files_matched;
+        stats->total_matches += ws->total_matches;
+        stats->total_size += ws->total_size;
+        stats->files_pruned += ws->files_pruned;
+        stats->files_cached += ws->files_cached;
+        stats->files_duplicate += ws->files_duplicate;
+        if (report && ran) {
+            const Profile *p = &report->threads[k];
+            for (int i = 0; i < PHASE_COUNT; i++) report->total.phase_ns[i] += p->phase_ns[i];
+            for (int i = 0; i < CALL_COUNT; i++) report->total.calls[i] += p->calls[i];
+            for (int i = 0; i < LATENCY_BUCKETS; i++) report->total.latency[i] += p->latency[i];
+            report->total.items += p->items;
+            report->total.busy_ns += p->busy_ns;
+        }
+        free(pool.workers[k].deque.items);
+        pthread_mutex_destroy(&pool.workers[k].deque.lock);
+    }
+    
+    if (report) {
+        report->nthreads = pool.remote_started ? nworkers + pool.remote_started 
+                                               : started;
+        report->total.phase_ns[PHASE_OUTPUT] = sink.write_ns;
+        report->total.calls[CALL_WRITE] = sink.write_calls;
+        pthread_mutex_destroy(&report->slow_lock);
+        stats->report = report;
+    }
     
+    pthread_mutex_destroy(&pool.idle_lock);
+    pthread_cond_destroy(&pool.idle_cond);
+    pthread_mutex_destroy(&pool.remote_lock);
+    pthread_cond_destroy(&pool.remote_cond);
+    for (int k = 0; k < pool.ndevices; k++) free(pool.devices[k].queue.items);
+    free(pool.devices);
+    for (int k = 0; k < pool.nmounts; k++) free(pool.mounts[k]);
+    free(pool.mounts);
+    visited_free(pool.visited);
+    free(pool.workers);
+}
+
+#ifdef WALK_HAVE_INOTIFY
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                      IN_MOVED_TO | IN_ATTRIB)
+
+/* inotify descriptor plus the directory path behind each watch */
+typedef struct {
+    int fd;
+    int root_wd;
+    char **paths;
+    int cap;
+} Watcher;
+
+/* Watch a directory and every directory below it; returns its wd */
+static int watch_tree(Watcher *w, const char *path) {
+    int wd = inotify_add_watch(w->fd, path, WATCH_EVENTS | IN_ONLYDIR | 
+                                            IN_DONT_FOLLOW);
+    if (wd < 0) return wd;
+    
+    if (wd >= w->cap) {
+        int new_cap = w->cap ? w->cap : 64;
+        while (new_cap <= wd) new_cap *= 2;
+        char **grown = realloc(w->paths, (size_t)new_cap * sizeof(char *));
+        if (!grown) return wd;
+        memset(grown + w->cap, 0, (size_t)(new_cap - w->cap) * sizeof(char *));
+        w->paths = grown;
+        w->cap = new_cap;
+    }
+    free(w->paths[wd]);
+    w->paths[wd] = strdup(path);
+    
+    DIR *dir = opendir(path);
+    if (!dir) return wd;
+    
+    struct dirent *entry;
+    char child[MAX_PATH];
     while ((entry = readdir(dir)) != NULL) {
-        /* Skip . and .. */
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
             continue;
         }
-        
-        /* Build full path safely */
-        if (strlen(path) + strlen(entry->d_name) + 2 > MAX_PATH) {
-            continue;  /* Path too long */
+        if (snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) >= 
+            (int)sizeof(child)) {
+            continue;
         }
         
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", path, entry->d_name);
-        
         struct stat st;
-        if (lstat(fullpath, &st) != 0) {
-            continue;  /* Skip if can't stat */
+        if (entry->d_type == DT_DIR ||
+            (entry->d_type == DT_UNKNOWN && lstat(child, &st) == 0 && 
+             S_ISDIR(st.st_mode))) {
+            watch_tree(w, child);
+        }
+    }
+    closedir(dir);
+    return wd;
+}
+
+/* Wait up to timeout_ms for events; 1 if the tree changed, 0 if nothing
+ * relevant happened, -1 on error */
+static int watch_wait(Watcher *w, int timeout_ms) {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = { w->fd, POLLIN, 0 };
+    int changed = 0;
+    
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready < 0) return errno == EINTR ? 0 : -1;
+    if (ready == 0) return 0;
+    
+    ssize_t len = read(w->fd, buf, sizeof(buf));
+    if (len <= 0) return -1;
+    
+    for (char *p = buf; p < buf + len; ) {
+        const struct inotify_event *ev = (const struct inotify_event *)p;
+        p += sizeof(struct inotify_event) + ev->len;
+        
+        if (ev->mask & IN_Q_OVERFLOW) {
+            changed = 1;
+            continue;
         }
+        /* Our own index writes would otherwise retrigger forever */
+        if (ev->wd == w->root_wd && ev->len > 0 &&
+            strncmp(ev->name, INDEX_FILE_NAME, strlen(INDEX_FILE_NAME)) == 0) {
+            continue;
+        }
+        changed = 1;
         
-        /* Check if it's a directory */
-        if (S_ISDIR(st.st_mode)) {
-            if (opts->recursive) {
-                search_directory(fullpath, depth + 1, opts, stats);
+        if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+            ev->wd >= 0 && ev->wd < w->cap && w->paths[ev->wd]) {
+            char child[MAX_PATH];
+            if (snprintf(child, sizeof(child), "%s/%s", w->paths[ev->wd], 
+                         ev->name) < (int)sizeof(child)) {
+                watch_tree(w, child);
             }
-        } 
-        /* Check if it's a regular file */
-        else if (S_ISREG(st.st_mode)) {
-            search_file(fullpath, opts, stats);
         }
-        /* Skip other file types (symlinks, devices, etc.) */
     }
+    return changed;
+}
+#endif
+
+/* Refresh the index, then again after every burst of changes */
+void watch_index(SearchOptions *opts) {
+#ifdef WALK_HAVE_INOTIFY
+    Watcher w;
+    
+    memset(&w, 0, sizeof(w));
+    w.fd = inotify_init1(IN_CLOEXEC);
+    if (w.fd < 0) {
+        fprintf(stderr, "Error: Cannot start inotify: %s\n", strerror(errno));
+        return;
+    }
+    w.root_wd = watch_tree(&w, opts->start_dir);
     
-    closedir(dir);
+    for (;;) {
+        SearchStats stats;
+        int ret;
+        
+        memset(&stats, 0, sizeof(stats));
+        opts->index = load_index(opts->start_dir);
+        run_search(opts, &stats);
+        free_index(opts->index);
+        opts->index = NULL;
+        
+        while ((ret = watch_wait(&w, -1)) == 0) {}
+        if (ret < 0) break;
+        while (watch_wait(&w, WATCH_SETTLE_MS) > 0) {}
+    }
+    
+    fprintf(stderr, "Error: Lost inotify events: %s\n", strerror(errno));
+    for (int wd = 0; wd < w.cap; wd++) free(w.paths[wd]);
+    free(w.paths);
+    close(w.fd);
+#else
+    (void)opts;
+    fprintf(stderr, "Error: --index watch needs inotify\n");
+#endif
 }
 
 /* Print help message */
@@ -382,10 +6309,52 @@ void print_help(void) {
     printf("  -l            Only show names of files with matches\n");
     printf("  -c            Only count matches, don't show them\n");
     printf("  -n            Show line numbers\n");
-    printf("  -f PATTERN    Search only files matching pattern (e.g., *.c)\n");
+    printf("  -N            Do not show line numbers (skips counting them)\n");
+    printf("  -f PATTERN    Search only files matching a glob (e.g., *.c, src/**/*.h);\n"
+           "                repeatable\n");
+    printf("  --exclude GLOB  Skip files and directories matching a glob; repeatable\n");
     printf("  -d DEPTH      Maximum directory depth (default: unlimited)\n");
     printf("  -s MIN_SIZE   Minimum file size in bytes\n");
     printf("  -S MAX_SIZE   Maximum file size in bytes\n");
+    printf("  -j JOBS       Worker threads (default: online CPUs)\n");
+    printf("  -O            Keep output in directory traversal order\n");
+    printf("  -e REGEX      Also match a POSIX extended regex; repeatable\n");
+    printf("  -m N          Stop reading a file after N matching lines\n");
+    printf("  -A N, -B N    Show N lines after / before each matching line\n");
+    printf("  -C N          Show N lines before and after each matching line\n");
+    printf("  --max-total N Stop the whole search after N matching lines\n");
+    printf("  --first       Same as --max-total 1\n");
+    printf("  -q            Print nothing; exit status 0 if anything matched\n");
+    printf("  --stats=detailed  Add phase timings, syscall counts, slowest\n"
+           "                subtrees and per-thread latency histograms\n");
+    printf("  --json        Print JSON Lines: match, file and stats records\n");
+    printf("  -z            Search inside gzip, xz and zstd files\n");
+    printf("  -a            Search binary files as if they were text\n");
+    printf("  -I            Skip binary files\n");
+    printf("  -L            Follow symbolic links; each directory is entered once\n");
+    printf("  --dedup       Search each file once however many links or mounts\n"
+           "                reach it\n");
+    printf("  -x, --one-file-system  Do not descend into other file systems\n");
+    printf("  --remote-jobs N  Workers for network file systems, started when\n"
+           "                one is reached (default: %d; 0 = use the others)\n",
+           REMOTE_JOBS);
+    printf("  --device-jobs N  Items of one network file system worked on at\n"
+           "                once (default: %d)\n", DEVICE_JOBS);
+    printf("  --no-ignore   Also search what .gitignore/.ignore exclude, and .git;\n"
+           "                by default both are skipped\n");
+    printf("  --backend=B   Directory backend: posix (default), getdents, uring\n");
+    printf("  --order=O     Traversal order: dfs (default) or bfs\n");
+    printf("  --max-open-dirs N  Hold at most N directory fds (default: half\n"
+           "                the fd limit)\n");
+    printf("  --index build DIR  Build a trigram index of DIR\n");
+    printf("  --index update DIR Re-index only files changed since the last build\n");
+    printf("  --index watch DIR  Keep the index of DIR current using inotify\n");
+    printf("  --index DIR   Search DIR, opening only files the index allows\n");
+    printf("  --cache FILE  Reuse results of unchanged files from FILE and\n"
+           "                record the rest there\n");
+    printf("  --io=MODE     File I/O: normal (default), nocache (drop each file\n"
+           "                from the page cache once searched) or direct (O_DIRECT)\n");
+    printf("  --no-cache-pollution  Same as --io=nocache\n");
     printf("  -h            Show this help message\n\n");
     printf("Examples:\n");
     printf("  fwalker error                   # Search for 'error' in current dir\n");
@@ -396,14 +6365,23 @@ void print_help(void) {
 
 /* Print statistics */
 void print_stats(const SearchStats *stats) {
-    time_t end_time = time(NULL);
-    double elapsed = difftime(end_time, stats->start_time);
+    double elapsed = (double)(now_ns() - stats->start_ns) / 1e9;
     
     printf("\n=== Search Statistics ===\n");
     printf("Files searched:    %ld\n", stats->files_searched);
     printf("Files matched:     %ld\n", stats->files_matched);
     printf("Total matches:     %ld\n", stats->total_matches);
     printf("Total size:        %ld bytes\n", stats->total_size);
+    if (stats->files_pruned > 0) {
+        printf("Files pruned:      %ld (by index)\n", stats->files_pruned);
+    }
+    if (stats->files_cached > 0) {
+        printf("Files cached:      %ld (results replayed)\n", stats->files_cached);
+    }
+    if (stats->files_duplicate > 0) {
+        printf("Files skipped:     %ld (inode already searched)\n", 
+               stats->files_duplicate);
+    }
     printf("Time elapsed:      %.2f seconds\n", elapsed);
     
     if (stats->files_searched > 0) {
@@ -416,7 +6394,199 @@ void print_stats(const SearchStats *stats) {
     }
 }
 
+/* Print the --stats=detailed breakdown gathered by run_search() */
+void print_profile(const SearchStats *stats) {
+    const ProfileReport *report = stats->report;
+    const Profile *total = &report->total;
+    double elapsed = (double)(now_ns() - stats->start_ns) / 1e9;
+    long phase_sum = 0;
+    
+    for (int i = 0; i < PHASE_COUNT; i++) phase_sum += total->phase_ns[i];
+    
+    printf("\n=== Detailed Statistics ===\n");
+    printf("Wall time:         %.3f seconds\n", elapsed);
+    if (elapsed > 0) {
+        printf("Throughput:        %.2f MB/s, %.0f files/s\n",
+               (double)stats->total_size / elapsed / (1024 * 1024),
+               (double)stats->files_searched / elapsed);
+    }
+    
+    /* Traverse covers whole directory items; the rest are file phases */
+    printf("\nPhase (thread time):\n");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        printf("  %-10s %10.3f ms  %5.1f%%\n", phase_names[i], 
+               total->phase_ns[i] / 1e6,
+               phase_sum ? 100.0 * total->phase_ns[i] / phase_sum : 0.0);
+    }
+    
+    printf("\nSystem calls:\n");
+    for (int i = 0; i < CALL_COUNT; i++) {
+        printf("  %-10s %10ld\n", call_names[i], total->calls[i]);
+    }
+    
+    if (report->nslow > 0) {
+        printf("\nSlowest subtrees:\n");
+        for (int i = 0; i < report->nslow; i++) {
+            printf("  %10.3f ms  %s\n", report->slow[i].ns / 1e6, 
+                   report->slow[i].path);
+        }
+    }
+    
+    printf("\nThreads:\n");
+    for (int k = 0; k < report->nthreads; k++) {
+        const Profile *p = &report->threads[k];
+        printf("  #%-3d %8ld items  %10.3f ms busy  %5.1f%%\n", k, p->items,
+               p->busy_ns / 1e6, elapsed > 0 ? p->busy_ns / 1e7 / elapsed : 0.0);
+    }
+    
+    printf("\nItem latency:\n");
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if (!total->latency[i]) continue;
+        if (i == 0) {
+            printf("  %9s us  %ld\n", "< 2", total->latency[i]);
+        } else if (i == LATENCY_BUCKETS - 1) {
+            printf("  >= %6ld us  %ld\n", 1L << i, total->latency[i]);
+        } else {
+            printf("  %4ld-%-4ld us  %ld\n", 1L << i, (2L << i) - 1, 
+                   total->latency[i]);
+        }
+    }
+}
+
+/* Print the final --json record; --stats=detailed adds its phase times
+ * and call counts */
+void print_stats_json(const SearchStats *stats) {
+    double elapsed = (double)(now_ns() - stats->start_ns) / 1e9;
+    
+    printf("{\"type\":\"stats\",\"files_searched\":%ld,\"files_matched\":%ld,"
+           "\"matches\":%ld,\"bytes\":%ld,\"files_pruned\":%ld,"
+           "\"files_cached\":%ld,\"files_duplicate\":%ld,\"elapsed\":%.6f", 
+           stats->files_searched, stats->files_matched, stats->total_matches, 
+           stats->total_size, stats->files_pruned, stats->files_cached, 
+           stats->files_duplicate, elapsed);
+    if (stats->report) {
+        const Profile *total = &stats->report->total;
+        printf(",\"phase_ns\":{");
+        for (int i = 0; i < PHASE_COUNT; i++) {
+            printf("%s\"%s\":%ld", i ? "," : "", phase_names[i], total->phase_ns[i]);
+        }
+        printf("},\"calls\":{");
+        for (int i = 0; i < CALL_COUNT; i++) {
+            printf("%s\"%s\":%ld", i ? "," : "", call_names[i], total->calls[i]);
+        }
+        printf("}");
+    }
+    printf("}\n");
+}
+
 /* Main function - safe entry point */
+#ifdef WALK_LIBRARY
+struct WalkQuery {
+    SearchOptions opts;
+};
+
+/* Parse and compile into opts; 0 if the arguments were refused */
+static int compile_query(SearchOptions *opts, int argc, char *argv[]) {
+    jmp_buf abort_to;
+    
+    if (setjmp(abort_to)) {
+        compile_abort = NULL;
+        return 0;
+    }
+    compile_abort = &abort_to;
+    parse_arguments(argc, argv, opts);
+    
+    /* Output is the caller's, so nothing that only changes printing */
+    if (opts->count_only || opts->only_matching_files || opts->quiet ||
+        opts->ordered_output || opts->context ||
+        opts->json || opts->detailed_stats || opts->index_mode != INDEX_NONE ||
+        opts->cache_file[0]) {
+        fprintf(stderr, "Error: -c, -l, -q, -O, context, --json, --stats, "
+                "--index and --cache are not available in libwalk\n");
+        argument_exit(EXIT_FAILURE);
+    }
+    compile_keywords(opts);
+    compile_filters(opts);
+    compile_abort = NULL;
+    
+    /* A binary file has no lines to report */
+    if (opts->binary_mode == BINARY_SUMMARY) opts->binary_mode = BINARY_SKIP;
+    return 1;
+}
+
+WalkQuery *walk_compile(int argc, char *argv[]) {
+    WalkQuery *query = malloc(sizeof(WalkQuery));
+    char **args = malloc((size_t)(argc + 2) * sizeof(char *));
+    
+    if (!query || !args) {
+        free(query);
+        free(args);
+        return NULL;
+    }
+    
+    /* parse_arguments() skips the program name */
+    args[0] = "walk";
+    memcpy(args + 1, argv, (size_t)argc * sizeof(char *));
+    args[argc + 1] = NULL;
+    
+    init_options(&query->opts);
+    int ok = compile_query(&query->opts, argc + 1, args);
+    free(args);
+    if (!ok) {
+        walk_free(query);
+        return NULL;
+    }
+    return query;
+}
+
+long walk_search(const WalkQuery *query, const char *dir,
+                 WalkCallback callback, void *data) {
+    SearchStats stats = {0};
+    WalkRun run = { callback, data, PTHREAD_MUTEX_INITIALIZER, 0 };
+    struct stat st;
+    
+    /* Each search gets its own copy for the directory and the run; the
+     * compiled matcher and filters are shared read-only */
+    SearchOptions *opts = malloc(sizeof(SearchOptions));
+    if (!opts) return -1;
+    *opts = query->opts;
+    if (dir && strlen(dir) >= sizeof(opts->start_dir)) {
+        free(opts);
+        return -1;
+    }
+    if (dir) strcpy(opts->start_dir, dir);
+    if (stat(opts->start_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        free(opts);
+        return -1;
+    }
+    
+    opts->run = &run;
+    run_search(opts, &stats);
+    pthread_mutex_destroy(&run.lock);
+    free(opts);
+    return run.reported;
+}
+
+void walk_free(WalkQuery *query) {
+    if (!query) return;
+    free_filters(&query->opts);
+    free_keywords(&query->opts);
+    free(query);
+}
+
+#else
+/* Release what a search used */
+static void finish_search(SearchOptions *opts, SearchStats *stats) {
+    if (stats->report) {
+        free(stats->report->threads);
+        free(stats->report);
+    }
+    free_index(opts->index);
+    free_cache(opts->cache);
+    free_filters(opts);
+    free_keywords(opts);
+}
+
 int main(int argc, char *argv[]) {
     SearchOptions opts;
     SearchStats stats = {0};
@@ -429,6 +6599,56 @@ int main(int argc, char *argv[]) {
     /* Initialize everything */
     init_options(&opts);
     parse_arguments(argc, argv, &opts);
+    compile_keywords(&opts);
+    compile_filters(&opts);
+    
+    if (opts.index_mode == INDEX_BUILD || opts.index_mode == INDEX_UPDATE) {
+        if (opts.index_mode == INDEX_UPDATE) {
+            opts.index = load_index(opts.start_dir);
+        }
+        run_search(&opts, &stats);
+        free_index(opts.index);
+        free_keywords(&opts);
+        return EXIT_SUCCESS;
+    }
+    
+    if (opts.index_mode == INDEX_WATCH) {
+        watch_index(&opts);
+        free_keywords(&opts);
+        return EXIT_FAILURE;
+    }
+    
+    if (opts.index_mode == INDEX_QUERY) {
+        opts.index = load_index(opts.start_dir);
+        if (opts.index) {
+            prepare_index(opts.index, &opts);
+        } else {
+            fprintf(stderr, "Warning: No usable index in %s, scanning everything\n",
+                    opts.start_dir);
+        }
+    }
+    
+    /* Replayed records cannot honour a limit shared across files */
+    if (opts.cache_file[0] && opts.search_content && opts.max_total == 0) {
+        opts.cache = load_cache(opts.cache_file, &opts);
+    }
+    
+    /* -q: the exit status is the whole answer; printed output always
+     * exits 0, as it did before -q */
+    if (opts.quiet) {
+        run_search(&opts, &stats);
+        finish_search(&opts, &stats);
+        return stats.files_matched > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    
+    /* --json: records only, so no banner and a stats record at the end */
+    if (opts.json) {
+        stats.start_ns = now_ns();
+        run_search(&opts, &stats);
+        print_stats_json(&stats);
+        finish_search(&opts, &stats);
+        return EXIT_SUCCESS;
+    }
     
     printf("Searching for: ");
     for (int i = 0; i < opts.keyword_count; i++) {
@@ -439,22 +6659,30 @@ int main(int argc, char *argv[]) {
     printf("Starting directory: %s\n", opts.start_dir);
     printf("Case %s\n", opts.case_sensitive ? "sensitive" : "insensitive");
     
-    if (opts.file_pattern[0]) {
-        printf("File pattern: %s\n", opts.file_pattern);
+    for (int i = 0; i < opts.include_count; i++) {
+        printf("File pattern: %s\n", opts.include[i]);
+    }
+    for (int i = 0; i < opts.exclude_count; i++) {
+        printf("Exclude: %s\n", opts.exclude[i]);
     }
     
     printf("----------------------------------------\n");
     
-    stats.start_time = time(NULL);
+    stats.start_ns = now_ns();
+    fflush(stdout);
     
     /* Start search from specified directory */
-    search_directory(opts.start_dir, 0, &opts, &stats);
+    run_search(&opts, &stats);
     
     if (!opts.count_only && !opts.only_matching_files) {
         printf("\n");
     }
     
     print_stats(&stats);
-    
+    if (stats.report) {
+        print_profile(&stats);
+    }
+    finish_search(&opts, &stats);
     return EXIT_SUCCESS;
 }
+#endif
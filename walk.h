@@ -0,0 +1,52 @@
+/* libwalk: the walk search as a library. A query is compiled once from
+ * walk's own arguments and can then search any number of directories,
+ * handing each matching line to a callback instead of printing it.
+ * Build with make libwalk.a or make libwalk.so. */
+#ifndef WALK_H
+#define WALK_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WALK_API __attribute__((visibility("default")))
+
+typedef struct WalkQuery WalkQuery;
+
+/* One matching line; the pointers are only valid during the callback */
+typedef struct {
+    const char *path;       /* the file, as walk prints it */
+    size_t path_len;
+    const char *line;       /* without its newline; NULL if the name matched */
+    size_t line_len;
+    long line_number;       /* 0 with -N or for a name match */
+    long offset;            /* of the line in the file (decoded under -z) */
+    int keyword;            /* index among the query's keywords */
+} WalkMatch;
+
+/* Called once per matching line and keyword, from the search threads
+ * but never two at a time; return nonzero to stop the search */
+typedef int (*WalkCallback)(const WalkMatch *match, void *data);
+
+/* Compile a query from arguments as walk takes them, without the
+ * program name: options, an optional directory, then keywords. Options
+ * that only shape printed output (-c, -l, -q, -O, -A/-B/-C, --json,
+ * --stats) and --index/--cache are refused. Binary files are skipped
+ * unless -a is given. Returns NULL after printing why on stderr. */
+WALK_API WalkQuery *walk_compile(int argc, char *argv[]);
+
+/* Search dir, or with NULL the directory given to walk_compile(). A
+ * query may be searched by several threads at once. Returns the number
+ * of matches passed to the callback, or -1 if dir is unusable. */
+WALK_API long walk_search(const WalkQuery *query, const char *dir,
+                          WalkCallback callback, void *data);
+
+WALK_API void walk_free(WalkQuery *query);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif